@@ -0,0 +1,118 @@
+#include "common.h"
+#include "arena.h"
+
+#define ARENA_ALIGN	(2 * sizeof(void *))
+
+struct arena_chunk
+{
+	struct arena_chunk *prev;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena *arena_current = NULL;
+
+void arena_init(struct arena *arena, size_t chunk_size)
+{
+	memset(arena, 0, sizeof(struct arena));
+	arena->chunk_size = chunk_size;
+}
+
+void arena_fini(struct arena *arena)
+{
+	arena_release(arena, (struct arena_mark){ NULL, 0 });
+	xfree(arena->spare);
+	arena->spare = NULL;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunk;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if(!chunk || chunk->used + size > chunk->size)
+	{
+		// Oversized allocations get a chunk of their own
+		if(arena->spare && size <= arena->spare->size)
+		{
+			chunk = arena->spare;
+			arena->spare = NULL;
+		}
+		else
+		{
+			size_t chunk_size = max(arena->chunk_size, size);
+			chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+			chunk->size = chunk_size;
+			arena->chunks++;
+		}
+
+		chunk->used = 0;
+		chunk->prev = arena->chunk;
+		arena->chunk = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	arena->allocs++;
+	arena->bytes += size;
+	return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	return memcpy(arena_alloc(arena, len), str, len);
+}
+
+char *arena_printf(struct arena *arena, const char *fmt, ...)
+{
+	va_list args, args2;
+	char *str;
+	int len;
+
+	va_start(args, fmt);
+	va_copy(args2, args);
+	len = vsnprintf(NULL, 0, fmt, args);
+	str = arena_alloc(arena, len + 1);
+	vsnprintf(str, len + 1, fmt, args2);
+	va_end(args2);
+	va_end(args);
+	return str;
+}
+
+struct arena_mark arena_mark(struct arena *arena)
+{
+	struct arena_mark mark = { NULL, 0 };
+
+	if(arena && arena->chunk)
+	{
+		mark.chunk = arena->chunk;
+		mark.used = arena->chunk->used;
+	}
+
+	return mark;
+}
+
+// Releases everything allocated since the mark was taken
+void arena_release(struct arena *arena, struct arena_mark mark)
+{
+	if(!arena)
+		return;
+
+	while(arena->chunk != mark.chunk)
+	{
+		struct arena_chunk *chunk = arena->chunk;
+		arena->chunk = chunk->prev;
+
+		// Keep one regular chunk around so a command does not malloc() at all
+		if(!arena->spare && chunk->size == arena->chunk_size)
+			arena->spare = chunk;
+		else
+			free(chunk);
+	}
+
+	if(arena->chunk)
+		arena->chunk->used = mark.used;
+}
@@ -0,0 +1,42 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// Bump-pointer allocator for short-lived data (query parameters, server info
+// records, ...). Nothing is freed individually; everything allocated after a
+// mark is released at once by arena_release().
+
+struct arena_chunk;
+
+struct arena
+{
+	struct arena_chunk *chunk; // current chunk; older chunks are linked from it
+	struct arena_chunk *spare; // released chunk kept for the next allocation
+	size_t chunk_size;
+
+	// Statistics since arena_init()
+	unsigned long allocs;
+	unsigned long chunks;
+	size_t bytes;
+};
+
+struct arena_mark
+{
+	struct arena_chunk *chunk;
+	size_t used;
+};
+
+// The arena of the command currently being executed; NULL if none is
+// running, i.e. callers have to fall back to malloc().
+extern struct arena *arena_current;
+
+void arena_init(struct arena *arena, size_t chunk_size);
+void arena_fini(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+char *arena_printf(struct arena *arena, const char *fmt, ...) PRINTF_LIKE(2, 3);
+
+struct arena_mark arena_mark(struct arena *arena);
+void arena_release(struct arena *arena, struct arena_mark mark);
+
+#endif
@@ -0,0 +1,255 @@
+// bench.c replaces malloc & co. itself; see below
+#define MEMSTATS_NO_WRAP
+#include "common.h"
+#include "main.h"
+#include "bench.h"
+#include <getopt.h>
+
+// Globals normally provided by main.c
+sigjmp_buf sigint_jmp_buf;
+volatile int sigint_jmp_on = 0;
+volatile int sigint_received = 0;
+int quit = 0;
+int debug_output_enabled = 0;
+int batch_mode = 1;
+int no_colors = 1;
+int output_format = 0;
+
+struct bench_result
+{
+	unsigned long iterations;
+	double ns_op[2]; // min, median
+	double ns_op_max;
+	double allocs_op;
+	double bytes_op;
+};
+
+static void bench_usage(const char *self);
+static unsigned long long bench_now();
+static int bench_cmp_double(const void *a, const void *b);
+static void bench_run(struct benchmark *bench, struct bench_result *result);
+static void bench_print(const struct benchmark *bench, const struct bench_result *result);
+
+static unsigned int runs = 5;
+static unsigned int warmup_ms = 50;
+static unsigned int target_ms = 100;
+static int json_output = 0;
+static FILE *results;
+
+// Allocation counters. glibc allows replacing malloc & co. and routes its
+// internal allocations (strdup, asprintf, ...) through them as well.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long long alloc_count;
+static unsigned long long alloc_bytes;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+unsigned int bench_rand()
+{
+	// xorshift32 - deterministic so all runs see the same data
+	static unsigned int state = 2463534242U;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+char *bench_server_name(char *buf, size_t size, unsigned int i)
+{
+	static const char *locations[] = { "Amsterdam", "Chicago", "Dallas", "Frankfurt", "London", "NewYork", "Paris", "Seattle" };
+	snprintf(buf, size, "%s%u.%s.GameSurge.net", (i % 3) ? "Leaf" : "Hub", i, locations[i % ArraySize(locations)]);
+	return buf;
+}
+
+char *bench_hostmask(char *buf, size_t size, unsigned int i)
+{
+	snprintf(buf, size, "ident%u@host-%u.dsl%u.example%u.net", i % 97, i, i % 13, i % 7);
+	return buf;
+}
+
+static unsigned long long bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void bench_run(struct benchmark *bench, struct bench_result *result)
+{
+	void *ctx = bench->setup ? bench->setup(bench->n) : NULL;
+	unsigned long long start, elapsed, allocs = 0, bytes = 0;
+	unsigned long iterations = 0;
+	double samples[runs];
+
+	// Warmup and calibration: find an iteration count taking roughly target_ms
+	start = bench_now();
+	do
+	{
+		bench->run(ctx, bench->n);
+		iterations++;
+	} while((elapsed = bench_now() - start) < warmup_ms * 1000000ULL);
+
+	iterations = (unsigned long)((double)iterations * target_ms / max(1, elapsed / 1000000));
+	if(!iterations)
+		iterations = 1;
+
+	for(unsigned int r = 0; r < runs; r++)
+	{
+		unsigned long long count = alloc_count, size = alloc_bytes;
+
+		start = bench_now();
+		for(unsigned long i = 0; i < iterations; i++)
+			bench->run(ctx, bench->n);
+		elapsed = bench_now() - start;
+
+		allocs += alloc_count - count;
+		bytes += alloc_bytes - size;
+		samples[r] = (double)elapsed / iterations;
+	}
+
+	if(bench->teardown)
+		bench->teardown(ctx);
+
+	qsort(samples, runs, sizeof(double), bench_cmp_double);
+	result->iterations = iterations;
+	result->ns_op[0] = samples[0];
+	result->ns_op[1] = samples[runs / 2];
+	result->ns_op_max = samples[runs - 1];
+	result->allocs_op = (double)allocs / ((double)iterations * runs);
+	result->bytes_op = (double)bytes / ((double)iterations * runs);
+}
+
+static void bench_print(const struct benchmark *bench, const struct bench_result *result)
+{
+	if(json_output)
+	{
+		fprintf(results, "{\"name\":\"%s\",\"n\":%u,\"runs\":%u,\"iterations\":%lu,"
+			"\"ns_op\":%.1f,\"ns_op_min\":%.1f,\"ns_op_max\":%.1f,\"ns_item\":%.2f,"
+			"\"allocs_op\":%.2f,\"bytes_op\":%.1f}\n",
+			bench->name, bench->n, runs, result->iterations,
+			result->ns_op[1], result->ns_op[0], result->ns_op_max, result->ns_op[1] / max(1, bench->n),
+			result->allocs_op, result->bytes_op);
+	}
+	else
+	{
+		fprintf(results, "%s\t%u\t%u\t%lu\t%.1f\t%.1f\t%.1f\t%.2f\t%.2f\t%.1f\n",
+			bench->name, bench->n, runs, result->iterations,
+			result->ns_op[1], result->ns_op[0], result->ns_op_max, result->ns_op[1] / max(1, bench->n),
+			result->allocs_op, result->bytes_op);
+	}
+
+	fflush(results);
+}
+
+static void bench_usage(const char *self)
+{
+	fprintf(stderr, "Usage: %s [-j] [-l] [-r runs] [-w warmup_ms] [-t run_ms] [-f mask]\n", self);
+	fprintf(stderr, "  -j  emit JSON lines instead of TSV\n");
+	fprintf(stderr, "  -l  list benchmarks and exit\n");
+	fprintf(stderr, "  -r  measured runs per benchmark (default 5)\n");
+	fprintf(stderr, "  -w  warmup/calibration time in ms (default 50)\n");
+	fprintf(stderr, "  -t  target time per run in ms (default 100)\n");
+	fprintf(stderr, "  -f  only run benchmarks matching the wildcard mask\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct benchmark *groups[] = { bench_containers, bench_strings, bench_table, bench_database };
+	const char *filter = NULL;
+	int list_only = 0;
+	int c;
+
+	while((c = getopt(argc, argv, "jlr:w:t:f:h")) != -1)
+	{
+		switch(c)
+		{
+			case 'j':
+				json_output = 1;
+				break;
+			case 'l':
+				list_only = 1;
+				break;
+			case 'r':
+				runs = max(1, atoi(optarg));
+				break;
+			case 'w':
+				warmup_ms = max(1, atoi(optarg));
+				break;
+			case 't':
+				target_ms = max(1, atoi(optarg));
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			default:
+				bench_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	// Results go to the original stdout; out() output of the benchmarked
+	// code (e.g. table_send) is discarded.
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	assert(results);
+	assert(freopen("/dev/null", "w", stdout));
+
+	if(!json_output && !list_only)
+		fprintf(results, "name\tn\truns\titerations\tns_op\tns_op_min\tns_op_max\tns_item\tallocs_op\tbytes_op\n");
+
+	for(unsigned int g = 0; g < ArraySize(groups); g++)
+	{
+		for(struct benchmark *bench = groups[g]; bench->name; bench++)
+		{
+			struct bench_result result;
+
+			if(filter && match(filter, bench->name))
+				continue;
+
+			if(list_only)
+			{
+				fprintf(results, "%s\t%u\n", bench->name, bench->n);
+				continue;
+			}
+
+			bench_run(bench, &result);
+			bench_print(bench, &result);
+		}
+	}
+
+	fclose(results);
+	return 0;
+}
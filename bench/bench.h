@@ -0,0 +1,33 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+typedef void *(bench_setup_f)(unsigned int n);
+typedef void (bench_run_f)(void *ctx, unsigned int n);
+typedef void (bench_teardown_f)(void *ctx);
+
+struct benchmark
+{
+	const char *name;
+	unsigned int n; // problem size passed to the callbacks
+	bench_setup_f *setup; // optional, not timed
+	bench_run_f *run; // one call == one op
+	bench_teardown_f *teardown; // optional, not timed
+};
+
+#define BENCH(NAME, N, SETUP, RUN, TEARDOWN)	{ NAME, N, SETUP, RUN, TEARDOWN }
+#define BENCH_LIST_END				{ NULL, 0, NULL, NULL, NULL }
+
+// Prevent the compiler from optimizing away results
+#define bench_use(PTR)	__asm__ __volatile__("" : : "g"(PTR) : "memory")
+
+// Deterministic data generators shared by all benchmark files
+unsigned int bench_rand();
+char *bench_server_name(char *buf, size_t size, unsigned int i);
+char *bench_hostmask(char *buf, size_t size, unsigned int i);
+
+extern struct benchmark bench_containers[];
+extern struct benchmark bench_strings[];
+extern struct benchmark bench_table[];
+extern struct benchmark bench_database[];
+
+#endif
@@ -0,0 +1,282 @@
+#include "common.h"
+#include "bench.h"
+#include "ptrlist.h"
+#include "stringlist.h"
+#include "stringbuffer.h"
+#include "arena.h"
+
+struct keys
+{
+	unsigned int count;
+	char **keys;
+	struct dict *dict;
+	struct ptrlist *ptrlist;
+	struct stringlist *slist;
+};
+
+static void *keys_setup(unsigned int n)
+{
+	struct keys *ctx = malloc(sizeof(struct keys));
+	char buf[128];
+
+	memset(ctx, 0, sizeof(struct keys));
+	ctx->count = n;
+	ctx->keys = malloc(n * sizeof(char *));
+	for(unsigned int i = 0; i < n; i++)
+		ctx->keys[i] = strdup(bench_server_name(buf, sizeof(buf), i));
+	return ctx;
+}
+
+static void keys_teardown(void *ptr)
+{
+	struct keys *ctx = ptr;
+
+	if(ctx->dict)
+		dict_free(ctx->dict);
+	if(ctx->ptrlist)
+		ptrlist_free(ctx->ptrlist);
+	if(ctx->slist)
+		stringlist_free(ctx->slist);
+	for(unsigned int i = 0; i < ctx->count; i++)
+		free(ctx->keys[i]);
+	free(ctx->keys);
+	free(ctx);
+}
+
+// dict
+static void dict_insert_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+	struct dict *dict = dict_create();
+
+	for(unsigned int i = 0; i < n; i++)
+		dict_insert(dict, ctx->keys[i], ctx->keys[i]);
+	dict_free(dict);
+}
+
+static void *dict_find_setup(unsigned int n)
+{
+	struct keys *ctx = keys_setup(n);
+
+	ctx->dict = dict_create();
+	for(unsigned int i = 0; i < n; i++)
+		dict_insert(ctx->dict, ctx->keys[i], ctx->keys[i]);
+	return ctx;
+}
+
+static void dict_find_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+
+	for(unsigned int i = 0; i < n; i++)
+		bench_use(dict_find(ctx->dict, ctx->keys[i]));
+	bench_use(dict_find(ctx->dict, "missing.GameSurge.net"));
+}
+
+// ptrlist
+static void ptrlist_add_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+	struct ptrlist *list = ptrlist_create();
+
+	for(unsigned int i = 0; i < n; i++)
+		ptrlist_add(list, 0, ctx->keys[i]);
+	ptrlist_free(list);
+}
+
+static void *ptrlist_find_setup(unsigned int n)
+{
+	struct keys *ctx = keys_setup(n);
+
+	ctx->ptrlist = ptrlist_create();
+	for(unsigned int i = 0; i < n; i++)
+		ptrlist_add(ctx->ptrlist, 0, ctx->keys[i]);
+	return ctx;
+}
+
+static void ptrlist_find_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+
+	for(unsigned int i = 0; i < n; i++)
+		bench_use(ptrlist_find(ctx->ptrlist, ctx->keys[i]));
+}
+
+// stringlist
+static void stringlist_build_run(void *ptr, unsigned int n)
+{
+	// Typical pgsql_query() parameter list
+	for(unsigned int i = 0; i < n; i++)
+	{
+		struct stringlist *list = stringlist_build("Hub.Chicago.GameSurge.net", "Leaf.Paris.GameSurge.net", "4400", "1", NULL);
+		bench_use(list);
+		stringlist_free(list);
+	}
+}
+
+// Transient allocations of `buildconfs' for n servers: every config section
+// runs one query with the server name as parameter and the config file names
+// are expanded a few times per server.
+static void buildconf_params(unsigned int n)
+{
+	char buf[128], path[PATH_MAX];
+
+	for(unsigned int i = 0; i < n; i++)
+	{
+		struct arena_mark mark = arena_mark(arena_current);
+		const char *name = bench_server_name(buf, sizeof(buf), i);
+
+		for(int j = 0; j < 13; j++)
+		{
+			struct stringlist *list = stringlist_build(name, NULL);
+			bench_use(list);
+			stringlist_free(list);
+		}
+
+		for(int j = 0; j < 4; j++)
+			expand_num_args(path, sizeof(path), "configs/$1/ircd.conf", 1, name);
+		arena_release(arena_current, mark);
+	}
+}
+
+static void buildconf_params_run(void *ptr, unsigned int n)
+{
+	buildconf_params(n);
+}
+
+// Same with the command arena used by cmd_handle()
+static void *buildconf_arena_setup(unsigned int n)
+{
+	struct arena *arena = malloc(sizeof(struct arena));
+	arena_init(arena, 8192);
+	return arena;
+}
+
+static void buildconf_arena_run(void *ptr, unsigned int n)
+{
+	struct arena_mark mark = arena_mark(ptr);
+
+	arena_current = ptr;
+	buildconf_params(n);
+	arena_release(ptr, mark);
+	arena_current = NULL;
+}
+
+static void buildconf_arena_teardown(void *ptr)
+{
+	arena_fini(ptr);
+	free(ptr);
+}
+
+static void stringlist_add_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+	struct stringlist *list = stringlist_create();
+
+	for(unsigned int i = 0; i < n; i++)
+		stringlist_add(list, strdup(ctx->keys[i]));
+	stringlist_free(list);
+}
+
+static void *stringlist_find_setup(unsigned int n)
+{
+	struct keys *ctx = keys_setup(n);
+
+	ctx->slist = stringlist_create();
+	for(unsigned int i = 0; i < n; i++)
+		stringlist_add(ctx->slist, strdup(ctx->keys[i]));
+	return ctx;
+}
+
+static void stringlist_find_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+
+	for(unsigned int i = 0; i < n; i++)
+		bench_use(stringlist_find(ctx->slist, ctx->keys[i]));
+}
+
+static void stringlist_sort_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+	struct stringlist *list = stringlist_create();
+
+	// Insert in a scrambled order so every run sorts the same input
+	for(unsigned int i = 0; i < n; i++)
+		stringlist_add(list, strdup(ctx->keys[(i * 7919) % n]));
+	stringlist_sort(list);
+	stringlist_free(list);
+}
+
+// stringbuffer
+static void stringbuffer_append_char_run(void *ptr, unsigned int n)
+{
+	struct stringbuffer *sbuf = stringbuffer_create();
+
+	for(unsigned int i = 0; i < n; i++)
+		stringbuffer_append_char(sbuf, ' ');
+	stringbuffer_free(sbuf);
+}
+
+static void stringbuffer_append_string_run(void *ptr, unsigned int n)
+{
+	struct keys *ctx = ptr;
+	struct stringbuffer *sbuf = stringbuffer_create();
+
+	for(unsigned int i = 0; i < n; i++)
+		stringbuffer_append_string(sbuf, ctx->keys[i]);
+	stringbuffer_free(sbuf);
+}
+
+static void stringbuffer_printf_run(void *ptr, unsigned int n)
+{
+	struct stringbuffer *sbuf = stringbuffer_create();
+
+	for(unsigned int i = 0; i < n; i++)
+		stringbuffer_append_printf(sbuf, "Connect {\n\tname = \"%s%u\";\n\tport = %u;\n};\n", "Leaf", i, 4400 + i);
+	stringbuffer_free(sbuf);
+}
+
+static void stringbuffer_shift_run(void *ptr, unsigned int n)
+{
+	struct stringbuffer *sbuf = stringbuffer_create();
+	char *line;
+
+	for(unsigned int i = 0; i < n; i++)
+		stringbuffer_append_string(sbuf, "make[2]: Entering directory `/home/ircd/ircu2.10.12/ircd'\n");
+	while((line = stringbuffer_shift(sbuf, "\n", 1)))
+	{
+		bench_use(line);
+		free(line);
+	}
+	stringbuffer_free(sbuf);
+}
+
+struct benchmark bench_containers[] = {
+	BENCH("dict_insert", 16, keys_setup, dict_insert_run, keys_teardown),
+	BENCH("dict_insert", 1024, keys_setup, dict_insert_run, keys_teardown),
+	BENCH("dict_find", 16, dict_find_setup, dict_find_run, keys_teardown),
+	BENCH("dict_find", 1024, dict_find_setup, dict_find_run, keys_teardown),
+	BENCH("ptrlist_add", 16, keys_setup, ptrlist_add_run, keys_teardown),
+	BENCH("ptrlist_add", 4096, keys_setup, ptrlist_add_run, keys_teardown),
+	BENCH("ptrlist_find", 16, ptrlist_find_setup, ptrlist_find_run, keys_teardown),
+	BENCH("ptrlist_find", 4096, ptrlist_find_setup, ptrlist_find_run, keys_teardown),
+	BENCH("stringlist_build", 1, NULL, stringlist_build_run, NULL),
+	BENCH("buildconf_params", 100, NULL, buildconf_params_run, NULL),
+	BENCH("buildconf_params_arena", 100, buildconf_arena_setup, buildconf_arena_run, buildconf_arena_teardown),
+	BENCH("stringlist_add", 16, keys_setup, stringlist_add_run, keys_teardown),
+	BENCH("stringlist_add", 4096, keys_setup, stringlist_add_run, keys_teardown),
+	BENCH("stringlist_find", 16, stringlist_find_setup, stringlist_find_run, keys_teardown),
+	BENCH("stringlist_find", 1024, stringlist_find_setup, stringlist_find_run, keys_teardown),
+	BENCH("stringlist_sort", 64, keys_setup, stringlist_sort_run, keys_teardown),
+	BENCH("stringlist_sort", 4096, keys_setup, stringlist_sort_run, keys_teardown),
+	BENCH("stringbuffer_append_char", 80, NULL, stringbuffer_append_char_run, NULL),
+	BENCH("stringbuffer_append_char", 65536, NULL, stringbuffer_append_char_run, NULL),
+	BENCH("stringbuffer_append_string", 64, keys_setup, stringbuffer_append_string_run, keys_teardown),
+	BENCH("stringbuffer_append_string", 4096, keys_setup, stringbuffer_append_string_run, keys_teardown),
+	BENCH("stringbuffer_printf", 64, NULL, stringbuffer_printf_run, NULL),
+	BENCH("stringbuffer_printf", 4096, NULL, stringbuffer_printf_run, NULL),
+	BENCH("stringbuffer_shift", 64, NULL, stringbuffer_shift_run, NULL),
+	BENCH("stringbuffer_shift", 2048, NULL, stringbuffer_shift_run, NULL),
+	BENCH_LIST_END
+};
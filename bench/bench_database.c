@@ -0,0 +1,86 @@
+#include "common.h"
+#include "bench.h"
+#include "database.h"
+
+struct database_ctx
+{
+	char filename[64];
+	struct dict *nodes;
+};
+
+// Writes a config file in gsconf.cfg syntax: n objects with strings,
+// string lists, nested objects and comments.
+static void *database_setup(unsigned int n)
+{
+	struct database_ctx *ctx = malloc(sizeof(struct database_ctx));
+	char buf[128];
+	FILE *fp;
+	int fd;
+
+	strcpy(ctx->filename, "/tmp/gsconf-bench-XXXXXX");
+	fd = mkstemp(ctx->filename);
+	assert(fd >= 0);
+	fp = fdopen(fd, "w");
+	assert(fp);
+
+	fprintf(fp, "// Generated by microbench\n\"prompt\" = \"\\1\\C[1;33m\\2gsconf\\1\\C[0m\\2 \";\n");
+	for(unsigned int i = 0; i < n; i++)
+	{
+		fprintf(fp, "/* server %u */\n\"%s\" = {\n", i, bench_server_name(buf, sizeof(buf), i));
+		fprintf(fp, "\t\"ip\" = \"10.0.%u.%u\";\n", (i >> 8) & 255, i & 255);
+		fprintf(fp, "\t\"ports\" = (\"6660\", \"6666\", \"6667\", \"6668\", \"6669\");\n");
+		fprintf(fp, "\t\"ssh\" = {\n\t\t\"user\" = \"ircd\";\n\t\t\"port\" = \"22\";\n\t};\n");
+		fprintf(fp, "};\n");
+	}
+
+	fclose(fp);
+	ctx->nodes = NULL;
+	return ctx;
+}
+
+static void database_teardown(void *ptr)
+{
+	struct database_ctx *ctx = ptr;
+
+	unlink(ctx->filename);
+	if(ctx->nodes)
+		dict_free(ctx->nodes);
+	free(ctx);
+}
+
+static void database_load_run(void *ptr, unsigned int n)
+{
+	struct database_ctx *ctx = ptr;
+	struct dict *nodes = database_load(ctx->filename);
+
+	assert(nodes);
+	dict_free(nodes);
+}
+
+static void *database_fetch_setup(unsigned int n)
+{
+	struct database_ctx *ctx = database_setup(n);
+
+	ctx->nodes = database_load(ctx->filename);
+	assert(ctx->nodes);
+	return ctx;
+}
+
+static void database_fetch_run(void *ptr, unsigned int n)
+{
+	struct database_ctx *ctx = ptr;
+	char path[160], buf[128];
+
+	for(unsigned int i = 0; i < n; i += 7)
+	{
+		snprintf(path, sizeof(path), "%s/ssh/port", bench_server_name(buf, sizeof(buf), i));
+		bench_use(database_fetch(ctx->nodes, path, DB_STRING));
+	}
+}
+
+struct benchmark bench_database[] = {
+	BENCH("database_load", 8, database_setup, database_load_run, database_teardown),
+	BENCH("database_load", 1000, database_setup, database_load_run, database_teardown),
+	BENCH("database_fetch", 64, database_fetch_setup, database_fetch_run, database_teardown),
+	BENCH_LIST_END
+};
@@ -0,0 +1,146 @@
+#include "common.h"
+#include "bench.h"
+#include "tokenize.h"
+#include "strnatcmp.h"
+
+#define LINE_SIMPLE	"addclient Staff Leaf1.Chicago.GameSurge.net ident@host.example.net 1.2.3.4 secret"
+#define LINE_QUOTED	"addoper \"Some Oper\" --mask \"*!*@staff.GameSurge.net\" --flags \"local global\" --password 'foo bar' --server \"Hub1.Dallas.GameSurge.net\""
+
+struct lines
+{
+	unsigned int count;
+	char **lines;
+	char *buf;
+};
+
+static void *lines_setup(unsigned int n)
+{
+	struct lines *ctx = malloc(sizeof(struct lines));
+	char buf[128];
+
+	ctx->count = n;
+	ctx->lines = malloc(n * sizeof(char *));
+	for(unsigned int i = 0; i < n; i++)
+		ctx->lines[i] = strdup(bench_hostmask(buf, sizeof(buf), bench_rand() % 5000));
+	ctx->buf = malloc(n * 128 + sizeof(LINE_QUOTED));
+	return ctx;
+}
+
+static void lines_teardown(void *ptr)
+{
+	struct lines *ctx = ptr;
+
+	for(unsigned int i = 0; i < ctx->count; i++)
+		free(ctx->lines[i]);
+	free(ctx->lines);
+	free(ctx->buf);
+	free(ctx);
+}
+
+// tokenize/tokenize_quoted modify their input so every op copies the line first
+static void tokenize_run(void *ptr, unsigned int n)
+{
+	struct lines *ctx = ptr;
+	char *argv[32];
+
+	memcpy(ctx->buf, LINE_SIMPLE, sizeof(LINE_SIMPLE));
+	bench_use(tokenize(ctx->buf, argv, ArraySize(argv), ' ', 0));
+}
+
+static void *tokenize_long_setup(unsigned int n)
+{
+	struct lines *ctx = lines_setup(n);
+	char *p = ctx->buf;
+
+	// A comma-separated list like the ones read from a flags column
+	for(unsigned int i = 0; i < n; i++)
+		p += sprintf(p, "%s%s", i ? "," : "", ctx->lines[i]);
+	return ctx;
+}
+
+static void tokenize_long_run(void *ptr, unsigned int n)
+{
+	struct lines *ctx = ptr;
+	char *copy = strdup(ctx->buf);
+	char **argv = malloc(n * sizeof(char *));
+
+	bench_use(tokenize(copy, argv, n, ',', 0));
+	free(argv);
+	free(copy);
+}
+
+static void tokenize_quoted_run(void *ptr, unsigned int n)
+{
+	struct lines *ctx = ptr;
+	char *argv[32];
+
+	memcpy(ctx->buf, LINE_QUOTED, sizeof(LINE_QUOTED));
+	bench_use(tokenize_quoted(ctx->buf, argv, ArraySize(argv)));
+}
+
+// match() against n hostmasks, like client/oper mask checks
+static void match_literal_run(void *ptr, unsigned int n)
+{
+	struct lines *ctx = ptr;
+
+	for(unsigned int i = 0; i < n; i++)
+		bench_use(match("ident1@host-1.dsl1.example1.net", ctx->lines[i]));
+}
+
+static void match_wildcard_run(void *ptr, unsigned int n)
+{
+	struct lines *ctx = ptr;
+
+	for(unsigned int i = 0; i < n; i++)
+		bench_use(match("*@host-*.dsl?.example*.net", ctx->lines[i]));
+}
+
+static void match_pathological_run(void *ptr, unsigned int n)
+{
+	for(unsigned int i = 0; i < n; i++)
+		bench_use(match("*a*a*a*a*a*a*a*a*b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"));
+}
+
+// strnatcmp on server names, i.e. what sorting lists does
+static void *names_setup(unsigned int n)
+{
+	struct lines *ctx = malloc(sizeof(struct lines));
+	char buf[128];
+
+	ctx->count = n;
+	ctx->lines = malloc(n * sizeof(char *));
+	for(unsigned int i = 0; i < n; i++)
+		ctx->lines[i] = strdup(bench_server_name(buf, sizeof(buf), bench_rand() % 1000));
+	ctx->buf = NULL;
+	return ctx;
+}
+
+static void strnatcmp_run(void *ptr, unsigned int n)
+{
+	struct lines *ctx = ptr;
+
+	for(unsigned int i = 1; i < n; i++)
+		bench_use(strnatcmp(ctx->lines[i - 1], ctx->lines[i]));
+}
+
+static void strnatcasecmp_run(void *ptr, unsigned int n)
+{
+	struct lines *ctx = ptr;
+
+	for(unsigned int i = 1; i < n; i++)
+		bench_use(strnatcasecmp(ctx->lines[i - 1], ctx->lines[i]));
+}
+
+struct benchmark bench_strings[] = {
+	BENCH("tokenize", 1, lines_setup, tokenize_run, lines_teardown),
+	BENCH("tokenize_long", 1024, tokenize_long_setup, tokenize_long_run, lines_teardown),
+	BENCH("tokenize_quoted", 1, lines_setup, tokenize_quoted_run, lines_teardown),
+	BENCH("match_literal", 256, lines_setup, match_literal_run, lines_teardown),
+	BENCH("match_wildcard", 256, lines_setup, match_wildcard_run, lines_teardown),
+	BENCH("match_wildcard", 16384, lines_setup, match_wildcard_run, lines_teardown),
+	BENCH("match_pathological", 16, NULL, match_pathological_run, NULL),
+	BENCH("strnatcmp", 256, names_setup, strnatcmp_run, lines_teardown),
+	BENCH("strnatcasecmp", 256, names_setup, strnatcasecmp_run, lines_teardown),
+	BENCH("strnatcasecmp", 16384, names_setup, strnatcasecmp_run, lines_teardown),
+	BENCH_LIST_END
+};
@@ -0,0 +1,94 @@
+#include "common.h"
+#include "bench.h"
+#include "table.h"
+
+struct table_ctx
+{
+	struct table *table;
+	char ***rows; // original row order, restored before every sort
+};
+
+// Builds a table looking like `serverlist': name, type, ip, port, description
+static struct table *table_build(unsigned int n)
+{
+	static const char *types[] = { "LEAF", "HUB", "STAFF", "BOTS" };
+	struct table *table = table_create(5, 0);
+	char buf[128];
+
+	table_set_header(table, "Name", "Type", "IP", "Port", "Description");
+	table_free_column(table, 0, 1);
+	table_free_column(table, 2, 1);
+	table_free_column(table, 3, 1);
+	table_free_column(table, 4, 1);
+	table_bold_column(table, 0, 1);
+	table_ralign_column(table, 3, 1);
+
+	for(unsigned int row = 0; row < n; row++)
+	{
+		unsigned int i = bench_rand() % (n * 4);
+		table_col_str(table, row, 0, strdup(bench_server_name(buf, sizeof(buf), i)));
+		table_col_str(table, row, 1, (char *)types[i % ArraySize(types)]);
+		table_col_fmt(table, row, 2, "10.%u.%u.%u", (i >> 16) & 255, (i >> 8) & 255, i & 255);
+		table_col_num(table, row, 3, 4400 + (i % 100));
+		table_col_fmt(table, row, 4, "Server number %u", i);
+	}
+
+	return table;
+}
+
+static void *table_setup(unsigned int n)
+{
+	struct table_ctx *ctx = malloc(sizeof(struct table_ctx));
+
+	ctx->table = table_build(n);
+	ctx->rows = malloc(n * sizeof(char **));
+	memcpy(ctx->rows, ctx->table->data, n * sizeof(char **));
+	return ctx;
+}
+
+static void table_teardown(void *ptr)
+{
+	struct table_ctx *ctx = ptr;
+
+	table_free(ctx->table);
+	free(ctx->rows);
+	free(ctx);
+}
+
+static void table_build_run(void *ptr, unsigned int n)
+{
+	table_free(table_build(n));
+}
+
+static void table_sort_run(void *ptr, unsigned int n)
+{
+	struct table_ctx *ctx = ptr;
+
+	memcpy(ctx->table->data, ctx->rows, n * sizeof(char **));
+	table_sort(ctx->table, 0);
+}
+
+static void table_sort_sorted_run(void *ptr, unsigned int n)
+{
+	struct table_ctx *ctx = ptr;
+
+	table_sort(ctx->table, 0);
+}
+
+static void table_send_run(void *ptr, unsigned int n)
+{
+	struct table_ctx *ctx = ptr;
+
+	table_send(ctx->table);
+}
+
+struct benchmark bench_table[] = {
+	BENCH("table_build", 50, NULL, table_build_run, NULL),
+	BENCH("table_build", 5000, NULL, table_build_run, NULL),
+	BENCH("table_sort", 50, table_setup, table_sort_run, table_teardown),
+	BENCH("table_sort", 5000, table_setup, table_sort_run, table_teardown),
+	BENCH("table_sort_sorted", 5000, table_setup, table_sort_sorted_run, table_teardown),
+	BENCH("table_send", 50, table_setup, table_send_run, table_teardown),
+	BENCH("table_send", 2000, table_setup, table_send_run, table_teardown),
+	BENCH_LIST_END
+};
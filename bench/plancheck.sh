@@ -0,0 +1,180 @@
+#!/bin/sh
+# Query plan check for the config builder and list queries (`make plancheck').
+#
+# Creates a scratch PostgreSQL cluster, loads gsconf.sql and the synthetic
+# network from bench/plancheck.sql and runs gsconf against it with
+# auto_explain logging EXPLAIN (ANALYZE, BUFFERS) of every statement. Fails
+# if a plan filters a big table with a sequential scan or if a statement
+# takes longer than the time budget.
+#
+# PGBIN               PostgreSQL binaries (default: pg_config --bindir)
+# PLANCHECK_MIN_ROWS  rows a sequential scan may throw away (default: 1000)
+# PLANCHECK_MAX_MS    time budget per statement in ms (default: 100)
+# PLANCHECK_PORT      port of the scratch cluster (default: 54329)
+# PLANCHECK_KEEP=1    keep the scratch directory for inspection
+
+set -e
+cd "$(dirname "$0")/.."
+
+if [ -z "$PGBIN" ]; then
+	if ! PGBIN=$(pg_config --bindir 2>/dev/null); then
+		echo "pg_config not found; set PGBIN to the directory of initdb, pg_ctl and psql"
+		exit 1
+	fi
+fi
+for bin in initdb pg_ctl psql; do
+	if [ ! -x "$PGBIN/$bin" ]; then
+		echo "$PGBIN/$bin not found; set PGBIN to the PostgreSQL server binaries"
+		exit 1
+	fi
+done
+MIN_ROWS=${PLANCHECK_MIN_ROWS:-1000}
+MAX_MS=${PLANCHECK_MAX_MS:-100}
+PORT=${PLANCHECK_PORT:-54329}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/gsconf-plancheck.XXXXXX")
+
+cleanup()
+{
+	"$PGBIN/pg_ctl" -D "$DIR/db" -m immediate stop >/dev/null 2>&1 || true
+	if [ -n "$PLANCHECK_KEEP" ]; then
+		echo "Scratch directory kept: $DIR"
+	else
+		rm -rf "$DIR"
+	fi
+}
+trap cleanup EXIT
+
+psql()
+{
+	"$PGBIN/psql" -h "$DIR" -p "$PORT" -U postgres -v ON_ERROR_STOP=1 -q -X "$@"
+}
+
+echo "Creating scratch cluster in $DIR"
+"$PGBIN/initdb" -D "$DIR/db" -U postgres -A trust >/dev/null
+"$PGBIN/pg_ctl" -D "$DIR/db" -l "$DIR/postgres.log" -w \
+	-o "-p $PORT -k $DIR -c listen_addresses= -c shared_preload_libraries=auto_explain" start >/dev/null
+
+psql -d postgres -c "CREATE ROLE gsdev" -c "CREATE DATABASE gsdev OWNER gsdev"
+psql -d gsdev -f gsconf.sql >/dev/null
+psql -d gsdev -f bench/plancheck.sql
+
+# Only gsconf's own connection explains its statements
+OPTIONS="-c auto_explain.log_min_duration=0 -c auto_explain.log_analyze=on -c auto_explain.log_buffers=on -c auto_explain.log_nested_statements=on"
+mkdir -p "$DIR/work/configs"
+sed -e "s|^\"pg_conn\" = .*|\"pg_conn\" = \"host=$DIR port=$PORT user=postgres dbname=gsdev options='$OPTIONS'\";|" \
+	gsconf.cfg.example > "$DIR/work/gsconf.cfg"
+
+HUB=$(psql -d gsdev -At -c "SELECT name FROM servers WHERE type = 'HUB' ORDER BY \"numeric\" LIMIT 1 OFFSET 1")
+LEAF=$(psql -d gsdev -At -c "SELECT name FROM servers WHERE type = 'LEAF' ORDER BY \"numeric\" LIMIT 1")
+STAFF=$(psql -d gsdev -At -c "SELECT name FROM servers WHERE type = 'STAFF' ORDER BY \"numeric\" LIMIT 1")
+BOTS=$(psql -d gsdev -At -c "SELECT name FROM servers WHERE type = 'BOTS' ORDER BY \"numeric\" LIMIT 1")
+
+# Builder queries for each server type and every list query, both for the
+# whole network and for a single server
+set --
+for server in "$HUB" "$LEAF" "$STAFF" "$BOTS"; do
+	set -- "$@" -b "buildconfs $server" -b "serverinfo $server"
+done
+for list in clients jupes opers webircs; do
+	set -- "$@" -b "$list --limit 100" -b "$list $LEAF" -b "$list $HUB"
+done
+for list in servers links classes features forwards pseudos services topology spof orphans; do
+	set -- "$@" -b "$list"
+done
+
+echo "Running gsconf"
+if ! ./gsconf --workdir "$DIR/work" -c "$@" > "$DIR/gsconf.log" 2>&1; then
+	cat "$DIR/gsconf.log"
+	echo "gsconf failed"
+	exit 1
+fi
+
+echo "Checking plans"
+awk -v min_rows="$MIN_ROWS" -v max_ms="$MAX_MS" '
+function report(msg)
+{
+	print "  " msg
+	failed++
+}
+
+# A sequential scan is only reported once all its lines have been seen
+function end_scan()
+{
+	if(scan != "" && removed > rows && removed >= min_rows)
+		report("sequential scan on " scan " discards " removed " of " (rows + removed) " rows" (loops > 1 ? " (" loops " loops)" : ""))
+	scan = ""
+}
+
+function end_plan()
+{
+	if(!in_plan)
+		return
+	end_scan()
+	if(failed > failed_before)
+		print "in: " query "\n"
+	in_plan = 0
+}
+
+/LOG:  duration: [0-9.]+ ms  plan:/ {
+	end_plan()
+	match($0, /duration: [0-9.]+/)
+	duration = substr($0, RSTART + 10, RLENGTH - 10) + 0
+	failed_before = failed
+	query = ""
+	statements++
+	in_plan = 1
+	next
+}
+
+!in_plan { next }
+
+# Any other message ends the plan
+/^[^ \t]/ { end_plan(); next }
+
+/Query Text:/ {
+	query = $0
+	sub(/^[ \t]*Query Text: /, "", query)
+	gsub(/[ \t]+/, " ", query)
+	if(length(query) > 160)
+		query = substr(query, 1, 160) "..."
+	if(duration > max_ms)
+		report("took " duration " ms (budget: " max_ms " ms)")
+	next
+}
+
+/Seq Scan on / {
+	end_scan()
+	scan = $0
+	sub(/.*Seq Scan on /, "", scan)
+	sub(/ +\(.*/, "", scan)
+	rows = loops = 0
+	removed = 0
+	if(match($0, /actual time=[0-9.]+\.\.[0-9.]+ rows=[0-9]+ loops=[0-9]+/))
+	{
+		split(substr($0, RSTART, RLENGTH), parts, /[ =]/)
+		rows = parts[5] + 0
+		loops = parts[7] + 0
+	}
+	next
+}
+
+/->/ { end_scan(); next }
+
+/Rows Removed by Filter:/ {
+	if(scan != "")
+		removed = $NF + 0
+	next
+}
+
+END {
+	end_plan()
+	if(!statements)
+	{
+		print "No plans were logged; is auto_explain available?"
+		exit 1
+	}
+
+	printf "%d statements checked, %d problems\n", statements, failed
+	exit (failed > 0)
+}
+' "$DIR/postgres.log"
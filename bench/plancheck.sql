@@ -0,0 +1,122 @@
+-- Synthetic network for `make plancheck', loaded on top of gsconf.sql.
+-- 1000 servers (40 hubs) with enough links, ports, clients, opers and
+-- webirc blocks per server that a query filtering one of these tables
+-- without an index shows up as a sequential scan.
+
+SET client_min_messages = warning;
+
+INSERT INTO servers (name, type, description, irc_ip_priv, irc_ip_priv_local, irc_ip_pub, "numeric", ssh_user, ssh_host, link_pass, server_port)
+SELECT	lower(t.type) || lpad(n::text, 4, '0') || '.example.net',
+	t.type,
+	'Server ' || n,
+	'10.0.0.0'::inet + n,
+	CASE WHEN n % 2 = 0 THEN set_masklen('172.16.0.0'::inet + n, 20) END,
+	'198.18.0.0'::inet + n,
+	n,
+	'ircd',
+	'host' || n || '.example.net',
+	md5('link' || n),
+	4400
+FROM	generate_series(1, 1000) n,
+	LATERAL (SELECT CASE WHEN n <= 40 THEN 'HUB'
+			     WHEN n <= 60 THEN 'STAFF'
+			     WHEN n <= 80 THEN 'BOTS'
+			     ELSE 'LEAF' END AS type) t;
+
+INSERT INTO ports (server, port, ip, flag_server, flag_hidden, flag_webirc)
+SELECT	s.name, p.port, NULL, p.port = 4400, p.port = 4400, p.port = 7000
+FROM	servers s,
+	(VALUES (4400), (6667), (6668), (6669), (7000)) p (port);
+
+-- Every hub links to all hubs with a lower numeric, every other server to
+-- three hubs; some links use a specific port of the hub
+INSERT INTO links (server, hub, autoconnect, port)
+SELECT	s.name, h.name, h."numeric" = 1, NULL
+FROM	servers s
+JOIN	servers h ON (h.type = 'HUB' AND h."numeric" < s."numeric")
+WHERE	s.type = 'HUB';
+
+INSERT INTO links (server, hub, autoconnect, port)
+SELECT	s.name, h.name, k = 0,
+	CASE WHEN s."numeric" % 4 = 0 THEN (SELECT id FROM ports WHERE server = h.name AND port = 4400) END
+FROM	servers s,
+	generate_series(0, 2) k
+JOIN	servers h ON (h.type = 'HUB')
+WHERE	s.type <> 'HUB' AND
+	h."numeric" = (s."numeric" + k * 13) % 40 + 1;
+
+INSERT INTO services (name, ip, ip_local, link_pass, flag_hub, flag_uworld, "numeric")
+SELECT	'services' || n || '.example.net', '10.1.0.0'::inet + n, set_masklen('172.16.0.0'::inet + n * 2, 20), md5('service' || n), n = 1, true, 4000 + n
+FROM	generate_series(1, 5) n;
+
+INSERT INTO servicelinks (service, hub)
+SELECT	sv.name, h.name
+FROM	services sv
+JOIN	servers h ON (h.type = 'HUB' AND h."numeric" <= 4);
+
+INSERT INTO clientgroups (name, server, connclass, password, class_maxlinks)
+SELECT	'group' || g, s.name,
+	(ARRAY['Users', 'Staff', 'Bots', 'Bots-NoIdle'])[g % 4 + 1],
+	CASE WHEN g % 2 = 0 THEN md5(s.name || g) ELSE '' END,
+	CASE WHEN g % 3 = 0 THEN 10 * g END
+FROM	servers s,
+	generate_series(1, 10) g;
+
+INSERT INTO clients ("group", server, ident, ip, host)
+SELECT	cg.name, cg.server,
+	CASE WHEN c = 2 THEN 'bot' ELSE '*' END,
+	CASE WHEN c = 0 THEN set_masklen('10.128.0.0'::inet + (row_number() OVER ()) * 256, 24) END,
+	CASE WHEN c = 1 THEN '*.example.com' WHEN c = 2 THEN 'bot.example.org' END
+FROM	clientgroups cg,
+	generate_series(0, 2) c;
+
+INSERT INTO opers (name, username, password, connclass, active)
+SELECT	'oper' || n, 'oper' || n, md5('oper' || n), (ARRAY['Opers', 'SeniorOpers', 'NetOps'])[n % 3 + 1], n % 10 <> 0
+FROM	generate_series(1, 400) n;
+
+INSERT INTO operhosts (oper, mask)
+SELECT	'oper' || n, m || '@oper' || n || '.example.com'
+FROM	generate_series(1, 400) n,
+	(VALUES ('*'), ('ident')) h (m);
+
+-- Every oper is on every 10th server
+INSERT INTO opers2servers (oper, server)
+SELECT	'oper' || n, s.name
+FROM	generate_series(1, 400) n
+JOIN	servers s ON (s."numeric" % 10 = n % 10);
+
+INSERT INTO webirc (name, ip, password, ident, hmac, description)
+SELECT	'webirc' || n, '10.2.0.0'::inet + n, md5('webirc' || n), NULL, n % 2 = 0, 'Gateway ' || n
+FROM	generate_series(1, 100) n;
+
+INSERT INTO webirc2servers (webirc, server)
+SELECT	'webirc' || n, s.name
+FROM	generate_series(1, 100) n
+JOIN	servers s ON (s."numeric" % 10 = n % 10);
+
+INSERT INTO jupes2servers (jupe, server)
+SELECT	j.name, s.name
+FROM	jupes j,
+	servers s
+WHERE	s.type <> 'HUB';
+
+INSERT INTO pseudos (command, name, target, prepend, server)
+SELECT	'CMD' || n, 'Service' || n, 'service' || n || '@services1.example.net', NULL, NULL
+FROM	generate_series(1, 20) n;
+
+INSERT INTO pseudos (command, name, target, prepend, server)
+SELECT	'CMD1', 'Local', 'local@' || s.name, 'LOCAL ', s.name
+FROM	servers s
+WHERE	s."numeric" % 3 = 0;
+
+INSERT INTO forwards (prefix, target, server)
+VALUES	('!', 'services1.example.net', NULL),
+	('?', 'services2.example.net', NULL),
+	('.', 'services3.example.net', NULL);
+
+INSERT INTO forwards (prefix, target, server)
+SELECT	'!', 'services2.example.net', s.name
+FROM	servers s
+WHERE	s."numeric" % 3 = 0;
+
+ANALYZE;
@@ -14,6 +14,12 @@
 			fprintf(file, "\t%s = %s;\n", #PRIV, tmp ? "yes" : "no"); \
 	} while(0)
 
+// Same result as server_private_ip()/service_private_ip() but evaluated in
+// the join instead of two lookups per call: the local IP is used if both
+// sides have one in the same network (NULL never matches).
+#define SQL_PRIVATE_IP(IP, IP_LOCAL, OTHER_IP_LOCAL) \
+	"host(CASE WHEN network(" IP_LOCAL ") = network(" OTHER_IP_LOCAL ") THEN " IP_LOCAL " ELSE " IP " END)::inet"
+
 static void config_build_header(struct server_info *server, FILE *file)
 {
 	fprintf(file, "# GameSurge %s - %s\n", serverinfo_name_from_type(server), server->name);
@@ -294,12 +300,13 @@ static void config_build_connects(struct server_info *server, FILE *file)
 	fprintf(file, "# Uplinks\n");
 
 	res = pgsql_query("SELECT	s.name,\
-					COALESCE(p.ip, server_private_ip(l.server, l.hub, true)) AS irc_ip_priv,\
+					COALESCE(p.ip, " SQL_PRIVATE_IP("s.irc_ip_priv", "s.irc_ip_priv_local", "me.irc_ip_priv_local") ") AS irc_ip_priv,\
 					COALESCE(p.port, s.server_port) AS server_port,\
-					server_private_ip(l.server, l.hub, false) AS vhost,\
+					" SQL_PRIVATE_IP("me.irc_ip_priv", "me.irc_ip_priv_local", "s.irc_ip_priv_local") " AS vhost,\
 					l.autoconnect\
 			   FROM		links l\
 			   JOIN		servers s ON (s.name = l.hub)\
+			   JOIN		servers me ON (me.name = l.server)\
 			   LEFT JOIN	ports p ON (p.id = l.port)\
 			   WHERE	l.server = $1\
 			   ORDER BY	s.name ASC",
@@ -336,13 +343,14 @@ static void config_build_connects(struct server_info *server, FILE *file)
 
 	// Connect blocks for servers to connect to this hub
 	res = pgsql_query("SELECT	s.name,\
-					server_private_ip(l.server, l.hub, false) AS irc_ip_priv,\
+					" SQL_PRIVATE_IP("s.irc_ip_priv", "s.irc_ip_priv_local", "me.irc_ip_priv_local") " AS irc_ip_priv,\
 					s.link_pass,\
 					s.server_port,\
 					s.type,\
-					COALESCE(p.ip, server_private_ip(l.server, l.hub, true)) AS vhost\
+					COALESCE(p.ip, " SQL_PRIVATE_IP("me.irc_ip_priv", "me.irc_ip_priv_local", "s.irc_ip_priv_local") ") AS vhost\
 			   FROM		links l\
 			   JOIN		servers s ON (s.name = l.server)\
+			   JOIN		servers me ON (me.name = l.hub)\
 			   LEFT JOIN	ports p ON (p.id = l.port)\
 			   WHERE	l.hub = $1\
 			   ORDER BY	s.name ASC",
@@ -382,12 +390,13 @@ static void config_build_connects(struct server_info *server, FILE *file)
 
 	// Connect blocks for services to connect to this hub
 	res = pgsql_query("SELECT	s.name,\
-					service_private_ip(sl.service, sl.hub, false) AS ip,\
+					" SQL_PRIVATE_IP("s.ip", "s.ip_local", "me.irc_ip_priv_local") " AS ip,\
 					s.link_pass,\
 					s.flag_hub,\
-					service_private_ip(sl.service, sl.hub, true) AS vhost\
+					" SQL_PRIVATE_IP("me.irc_ip_priv", "me.irc_ip_priv_local", "s.ip_local") " AS vhost\
 			   FROM		servicelinks sl\
 			   JOIN		services s ON (s.name = sl.service)\
+			   JOIN		servers me ON (me.name = sl.hub)\
 			   WHERE	sl.hub = $1\
 			   ORDER BY	s.name ASC",
 			  1, stringlist_build(server->name, NULL));
@@ -745,6 +754,15 @@ int config_build(struct server_info *server)
 	}
 
 	out("Building config for %s `%s'", serverinfo_name_from_type(server), server->name);
+	config_build_file(server, file);
+	fclose(file);
+	rename(config_filename(server, CONFIG_TEMP), config_filename(server, CONFIG_NEW));
+	return 0;
+}
+
+// Writes the whole config of a server to file
+void config_build_file(struct server_info *server, FILE *file)
+{
 	config_build_header(server, file);
 	fputc('\n', file);
 	config_build_general(server, file);
@@ -776,8 +794,4 @@ int config_build(struct server_info *server)
 	fputc('\n', file);
 	config_build_features(server, file);
 	fputc('\n', file);
-
-	fclose(file);
-	rename(config_filename(server, CONFIG_TEMP), config_filename(server, CONFIG_NEW));
-	return 0;
 }
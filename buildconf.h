@@ -4,5 +4,6 @@
 struct server_info;
 
 int config_build(struct server_info *server);
+void config_build_file(struct server_info *server, FILE *file);
 
 #endif
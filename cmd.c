@@ -6,19 +6,29 @@
 #include "stringlist.h"
 #include "stringbuffer.h"
 #include "table.h"
+#include "arena.h"
+#include "memstats.h"
+#include "ssh.h"
 
 static void cmd_free_subcmds(struct command *cmd);
 static char *cmd_generator(const char *text, int state);
 static struct command *cmd_find(const char *name, struct dict *list);
+static void cmd_run(struct command *cmd, const char *line, int argc, char **argv);
 
 CMD_FUNC(help);
 CMD_TAB_FUNC(help);
 CMD_FUNC(quit);
 CMD_FUNC(commands);
+CMD_FUNC(memstats);
+CMD_FUNC(connstats);
 
 
 static struct dict *command_list;
 static struct dict *cmd_generator_list = NULL;
+static struct arena cmd_arena;
+static unsigned int cmd_depth = 0;
+// First per-server command run by the current command; re-run by `retry'
+static char *cmd_retry_line = NULL;
 // Yay, global variables needed because we can't pass custom args to our rl_compentry_func
 char *tc_argv_base[32] = { 0 };
 char **tc_argv = NULL;
@@ -29,12 +39,15 @@ static struct command commands[] = {
 	CMD_TC("help", help, "Display help"),
 	CMD("quit", quit, "Exit the program"),
 	CMD("commands", commands, "Display all available commands"),
+	CMD("memstats", memstats, "Show allocation statistics"),
+	CMD("connstats", connstats, "Show connection setup times"),
 	CMD_LIST_END
 };
 
 
 void cmd_init()
 {
+	arena_init(&cmd_arena, 8192);
 	command_list = dict_create();
 	dict_set_free_funcs(command_list, NULL, (dict_free_f *)cmd_free_subcmds);
 
@@ -54,11 +67,18 @@ void cmd_init()
 	cmd_pseudo_init();
 	cmd_client_init();
 	cmd_webirc_init();
+	cmd_job_init();
+	cmd_topology_init();
+	cmd_snapshot_init();
+	cmd_import_init();
+	cmd_lint_init();
 }
 
 void cmd_fini()
 {
 	dict_free(command_list);
+	arena_fini(&cmd_arena);
+	xfree(cmd_retry_line);
 }
 
 static void cmd_free_subcmds(struct command *cmd)
@@ -107,6 +127,49 @@ void cmd_alias(const char *name, const char *cmd_name, const char *subcmd_name)
 	stringlist_add(cmd->aliases, strdup(alias->name));
 }
 
+void cmd_background(const char *cmd_name, const char *subcmd_name, unsigned int flags)
+{
+	struct command *cmd;
+	assert(cmd = cmd_find(cmd_name, command_list));
+	assert(!subcmd_name || (cmd->subcommands && (cmd = cmd_find(subcmd_name, cmd->subcommands))));
+	cmd->job_flags = flags | CMD_JOB;
+
+	// Aliases are copies so they need the flags, too
+	dict_iter(node, command_list)
+	{
+		struct command *alias = node->data;
+		if(alias->alias && alias->func == cmd->func)
+			alias->job_flags = cmd->job_flags;
+	}
+}
+
+// Returns the command argv refers to; words is set to the number of argv
+// elements making up the command name (e.g. 2 for "conf sync").
+struct command *cmd_lookup(int argc, char **argv, int *words)
+{
+	struct dict *list = command_list;
+	struct command *cmd = NULL;
+
+	for(int i = 0; i < argc; i++)
+	{
+		if(!(cmd = cmd_find(argv[i], list)))
+			return NULL;
+		if(!cmd->subcommands)
+		{
+			*words = i + 1;
+			return cmd->func ? cmd : NULL;
+		}
+		list = cmd->subcommands;
+	}
+
+	return NULL;
+}
+
+int cmd_running()
+{
+	return cmd_depth > 0;
+}
+
 void cmd_handle(const char *line, int argc, char **argv, struct command *parent)
 {
 	struct command *cmd;
@@ -149,10 +212,38 @@ void cmd_handle(const char *line, int argc, char **argv, struct command *parent)
 			argv[0] = cmdbuf;
 		}
 
-		cmd->func(line, argc, argv);
+		cmd_run(cmd, line, argc, argv);
 	}
 }
 
+// Transient allocations of a command (query parameters, server records, ...)
+// come from the command arena and are released at once when it returns.
+// Nested commands (e.g. in job children) simply continue in the same arena.
+// Servers which failed during a command are offered for `retry' afterwards.
+static void cmd_run(struct command *cmd, const char *line, int argc, char **argv)
+{
+	struct arena *prev = arena_current;
+	struct arena_mark mark = arena_mark(&cmd_arena);
+
+	if(!cmd_depth++)
+	{
+		ssh_failed_reset();
+		xfree(cmd_retry_line);
+		cmd_retry_line = NULL;
+	}
+
+	if((cmd->job_flags & CMD_JOB_SERVER) && !cmd_retry_line)
+		cmd_retry_line = strdup(line);
+
+	arena_current = &cmd_arena;
+	cmd->func(line, argc, argv);
+	arena_release(&cmd_arena, mark);
+	arena_current = prev;
+
+	if(!--cmd_depth && cmd_retry_line && ssh_failed()->count)
+		cmd_job_stragglers(cmd_retry_line, ssh_failed());
+}
+
 char **cmd_tabcomp(const char *text, int start, int end)
 {
 	char **list;
@@ -301,6 +392,31 @@ CMD_FUNC(quit)
 	quit = 1;
 }
 
+CMD_FUNC(memstats)
+{
+	unsigned int top_sites = 15;
+
+	if(argc > 1 && !strcasecmp(argv[1], "reset"))
+	{
+		memstats_reset();
+		out("Allocation statistics have been reset");
+		return;
+	}
+	else if(argc > 1 && (top_sites = atoi(argv[1])) < 1)
+	{
+		out("Usage: memstats [reset|<call sites>]");
+		return;
+	}
+
+	out("Command arena: %lu allocations (%zu bytes) in %lu chunks", cmd_arena.allocs, cmd_arena.bytes, cmd_arena.chunks);
+	memstats_show(top_sites);
+}
+
+CMD_FUNC(connstats)
+{
+	ssh_show_stats();
+}
+
 static void list_command(struct table *table, unsigned int row, struct command *cmd, const char *parent_cmd_name)
 {
 	struct stringbuffer *buf = stringbuffer_create();
@@ -14,15 +14,25 @@ struct command
 	struct dict *subcommands;
 	int alias;
 	struct stringlist *aliases;
+	unsigned int job_flags;
 };
 
+// Flags for commands that can be run as background jobs (see job.h)
+#define CMD_JOB			0x01 // command can run in the background
+#define CMD_JOB_SERVER		0x02 // first non-option argument is a server; one unit per server
+#define CMD_JOB_SERVER_STAR	0x04 // "*" as server means all servers
+#define CMD_JOB_SERVER_OPTIONAL	0x08 // no server means all servers
+
 void cmd_init();
 void cmd_fini();
 
 void cmd_register(struct command *cmd, const char *parent_name);
 void cmd_register_list(struct command *cmd, const char *parent_name);
 void cmd_alias(const char *name, const char *cmd_name, const char *subcmd_name);
+void cmd_background(const char *cmd_name, const char *subcmd_name, unsigned int flags);
 void cmd_handle(const char *line, int argc, char **argv, struct command *parent);
+struct command *cmd_lookup(int argc, char **argv, int *words);
+int cmd_running();
 char **cmd_tabcomp(const char *text, int start, int end);
 
 // cmd_*.c
@@ -38,6 +48,12 @@ void cmd_class_init();
 void cmd_pseudo_init();
 void cmd_client_init();
 void cmd_webirc_init();
+void cmd_job_init();
+void cmd_topology_init();
+void cmd_snapshot_init();
+void cmd_import_init();
+void cmd_lint_init();
+void cmd_job_stragglers(const char *line, struct stringlist *servers);
 
 // Global vars, macros, etc.
 extern char **tc_argv;
@@ -46,10 +62,10 @@ extern int tc_argc;
 #define CMD_FUNC(FUNC)		static void cmd_func_ ## FUNC(const char *cmd_line, int argc, char **argv)
 #define CMD_TAB_FUNC(FUNC)	static char* cmd_tabfunc_ ## FUNC(const char *text, int state)
 
-#define CMD(NAME, FUNC, DOC)	{ NAME, cmd_func_ ## FUNC, NULL, DOC, NULL, 0, NULL }
-#define CMD_TC(NAME, FUNC, DOC)	{ NAME, cmd_func_ ## FUNC, cmd_tabfunc_ ## FUNC, DOC, NULL, 0, NULL }
-#define CMD_STUB(NAME, DOC)	{ NAME, NULL, NULL, DOC, NULL, 0, NULL }
-#define CMD_LIST_END		{ NULL, NULL, NULL, NULL, NULL, 0, NULL }
+#define CMD(NAME, FUNC, DOC)	{ NAME, cmd_func_ ## FUNC, NULL, DOC, NULL, 0, NULL, 0 }
+#define CMD_TC(NAME, FUNC, DOC)	{ NAME, cmd_func_ ## FUNC, cmd_tabfunc_ ## FUNC, DOC, NULL, 0, NULL, 0 }
+#define CMD_STUB(NAME, DOC)	{ NAME, NULL, NULL, DOC, NULL, 0, NULL, 0 }
+#define CMD_LIST_END		{ NULL, NULL, NULL, NULL, NULL, 0, NULL, 0 }
 
 // An argument can be completed if:
 // a) it's completely empty and there's a space after the previous argument
@@ -4,6 +4,8 @@
 #include "stringlist.h"
 #include "input.h"
 #include "table.h"
+#include "main.h"
+#include "format.h"
 #include <search.h>
 
 static char *classmod_arg_generator(const char *text, int state);
@@ -101,6 +103,7 @@ CMD_FUNC(class_info)
 	int priv_class, local;
 	int rows;
 	const char *tmp, *typestr;
+	const char *query;
 
 	if(argc < 2)
 	{
@@ -108,7 +111,7 @@ CMD_FUNC(class_info)
 		return;
 	}
 
-	res = pgsql_query("SELECT	name,\
+	query = "SELECT	name,\
 					pingfreq,\
 					maxlinks,\
 					sendq,\
@@ -127,8 +130,17 @@ CMD_FUNC(class_info)
 					priv_die,\
 					priv_restart\
 			   FROM		connclasses_users\
-			   WHERE	lower(name) = lower($1)",
-			1, stringlist_build(argv[1], NULL));
+			   WHERE	lower(name) = lower($1)";
+
+	// Machine-readable output is a single row with the privileges as stored
+	if(output_format != FORMAT_TABLE)
+	{
+		if(!format_query(query, stringlist_build(argv[1], NULL)))
+			error("A connclass named `%s' does not exist", argv[1]);
+		return;
+	}
+
+	res = pgsql_query(query, 1, stringlist_build(argv[1], NULL));
 
 	if(!pgsql_num_rows(res))
 	{
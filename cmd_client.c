@@ -6,8 +6,13 @@
 #include "input.h"
 #include "table.h"
 #include "conf.h"
+#include "listquery.h"
+#include "main.h"
+#include "format.h"
+#include "stringbuffer.h"
 
 static void show_clientgroup_clients(const char *group, const char *server);
+static void edit_clients_editor(const char *group, const char *server);
 static char *clientgroupmod_arg_generator(const char *text, int state);
 static char *clientgroup_generator(const char *text, int state);
 static char *clientgroup_server_generator(const char *text, int state);
@@ -50,13 +55,29 @@ void cmd_client_init()
 	cmd_alias("editclients", "client", "editclients");
 }
 
+static const struct listquery_column client_columns[] = {
+	LISTQUERY_COLUMN("name", "cg.name"),
+	LISTQUERY_COLUMN("server", "cg.server"),
+	LISTQUERY_COLUMN("connclass", "cg.connclass"),
+	LISTQUERY_COLUMN("classmax", "cg.class_maxlinks"),
+	LISTQUERY_COLUMN("host", "cl.host"),
+	LISTQUERY_COLUMN("ip", "cl.ip"),
+	LISTQUERY_COLUMN("ident", "cl.ident"),
+	LISTQUERY_COLUMN_END
+};
+
 CMD_FUNC(client_list)
 {
 	PGresult *res;
 	int rows;
 	struct table *table;
+	struct listquery lq = { .columns = client_columns, .match_expr = "cg.name", .server_cond = "cg.server = %s", .default_order = "cg.server ASC, cg.name ASC" };
+	char *query;
+
+	if(listquery_parse(&lq, argc, argv) != 0)
+		return;
 
-	res = pgsql_query("SELECT	cg.name,\
+	asprintf(&query, "SELECT	cg.name,\
 					cg.server,\
 					cg.connclass,\
 					cg.password,\
@@ -67,9 +88,20 @@ CMD_FUNC(client_list)
 					(cl.group IS NOT NULL) AS has_clients\
 			   FROM		clientgroups cg\
 			   LEFT JOIN	clients cl ON (cl.group = cg.name AND cl.server = cg.server)\
-			   ORDER BY	cg.server ASC,\
-					cg.name ASC",
-			  1, NULL);
+			   %s%s%s",
+		 lq.where, lq.order, lq.limit);
+	if(output_format != FORMAT_TABLE)
+	{
+		// Rows are written as they arrive; no table is built at all
+		format_query(query, listquery_params(&lq));
+		free(query);
+		listquery_free(&lq);
+		return;
+	}
+
+	res = pgsql_query(query, 1, listquery_params(&lq));
+	free(query);
+	listquery_free(&lq);
 	rows = pgsql_num_rows(res);
 	table = table_create(8, 0);
 	table->field_len = table_strlen_colors;
@@ -80,10 +112,6 @@ CMD_FUNC(client_list)
 		char buf[128];
 		int has_clients = !strcasecmp(pgsql_nvalue(res, i, "has_clients"), "t");
 
-		// Hack to filter by server without modifying the query
-		if(argc > 1 && strcasecmp(argv[1], pgsql_nvalue(res, i, "server")))
-			continue;
-
 		if(has_clients)
 			snprintf(buf, sizeof(buf), "%s", pgsql_nvalue(res, i, "name"));
 		else
@@ -473,12 +501,19 @@ CMD_FUNC(client_editclients)
 {
 	char group[32], server[63];
 	PGresult *res;
-	int rows;
+	int rows, use_editor = 0;
 	const char *line;
 
+	if(argc > 1 && !strcmp(argv[1], "--editor"))
+	{
+		use_editor = 1;
+		argc--;
+		argv++;
+	}
+
 	if(argc < 3)
 	{
-		out("Usage: editclients <groupname> <server>");
+		out("Usage: editclients [--editor] <groupname> <server>");
 		return;
 	}
 
@@ -502,6 +537,12 @@ CMD_FUNC(client_editclients)
 	strlcpy(server, pgsql_nvalue(res, 0, "server"), sizeof(server));
 	pgsql_free(res);
 
+	if(use_editor)
+	{
+		edit_clients_editor(group, server);
+		return;
+	}
+
 	show_clientgroup_clients(group, server);
 	while(1)
 	{
@@ -606,6 +647,275 @@ cancel_add:
 	}
 }
 
+struct edit_client
+{
+	char *ident; // NULL disables the identd lookup
+	char *ip; // NULL matches any IP
+	char *host; // NULL matches any host
+	const char *id; // only set for the clients from the database
+	unsigned int line;
+};
+
+static int strcmp_null(const char *a, const char *b)
+{
+	if(!a || !b)
+		return !!a - !!b;
+	return strcmp(a, b);
+}
+
+static int edit_client_cmp(const void *a_, const void *b_)
+{
+	const struct edit_client *a = a_, *b = b_;
+	int rc;
+
+	if((rc = strcmp_null(a->ident, b->ident)) || (rc = strcmp_null(a->ip, b->ip)))
+		return rc;
+	return strcmp_null(a->host, b->host);
+}
+
+static void edit_clients_free(struct edit_client *clients, unsigned int count)
+{
+	for(unsigned int i = 0; i < count; i++)
+	{
+		xfree(clients[i].ident);
+		xfree(clients[i].ip);
+		xfree(clients[i].host);
+	}
+	free(clients);
+}
+
+static void edit_client_out(const char *color, char prefix, const struct edit_client *client)
+{
+	out_color(color, "%c %-10s %-20s %s", prefix, client->ident ? client->ident : ".", client->ip ? client->ip : "*", client->host ? client->host : "*");
+}
+
+// Parses the edited file; returns NULL and reports the invalid lines if there are any
+static struct edit_client *edit_clients_read(const char *filename, unsigned int *count)
+{
+	struct edit_client *clients = NULL;
+	unsigned int size = 0, line_num = 0, errors = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *fp;
+
+	*count = 0;
+	if(!(fp = fopen(filename, "r")))
+	{
+		error("Could not open `%s': %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	while(getline(&line, &line_size, fp) > 0)
+	{
+		char *ident, *ip, *host, *extra, *saveptr, *str = trim(line);
+		const char *msg = NULL;
+
+		line_num++;
+		if(!*str || *str == '#')
+			continue;
+
+		ident = strtok_r(str, " \t", &saveptr);
+		ip = strtok_r(NULL, " \t", &saveptr);
+		host = strtok_r(NULL, " \t", &saveptr);
+		extra = strtok_r(NULL, " \t", &saveptr);
+
+		if(!host || extra)
+			msg = "Expected <ident> <ip> <host>";
+		else if(strlen(ident) > 10)
+			msg = "Ident length cannot exceed 10 characters";
+		else if(strcmp(ip, "*") && !valid_inet(ip))
+			msg = "This IP doesn't look like a valid IP mask";
+		else if(strlen(host) > 63)
+			msg = "Host length cannot exceed 63 characters";
+
+		if(msg)
+		{
+			error("Line %u: %s", line_num, msg);
+			errors++;
+			continue;
+		}
+
+		if(*count == size)
+		{
+			size = size ? size * 2 : 32;
+			clients = realloc(clients, size * sizeof(struct edit_client));
+		}
+
+		clients[*count].ident = strcmp(ident, ".") ? strdup(ident) : NULL;
+		clients[*count].ip = strcmp(ip, "*") ? strdup(ip) : NULL;
+		clients[*count].host = strcmp(host, "*") ? strdup(host) : NULL;
+		clients[*count].id = NULL;
+		clients[*count].line = line_num;
+		(*count)++;
+	}
+
+	xfree(line);
+	fclose(fp);
+
+	if(errors)
+	{
+		edit_clients_free(clients, *count);
+		*count = 0;
+		return NULL;
+	}
+
+	// An empty file is a valid result, too
+	return clients ? clients : calloc(1, sizeof(struct edit_client));
+}
+
+// Dumps the clients of the group into a file, opens it in the editor and
+// applies the difference between the old and the new set of clients in a
+// single transaction
+static void edit_clients_editor(const char *group, const char *server)
+{
+	char filename[] = "/tmp/gsconf-clients.XXXXXX", cmd[PATH_MAX + 256];
+	struct edit_client *old_clients, *new_clients = NULL, **inserts;
+	struct stringbuffer *deletes;
+	unsigned int old_count, new_count, insert_count = 0, delete_count = 0;
+	const char *editor;
+	PGresult *res;
+	FILE *fp;
+	int fd;
+
+	if(batch_mode)
+	{
+		error("--editor needs an interactive terminal");
+		return;
+	}
+
+	res = pgsql_query("SELECT id, ident, ip, host FROM clients WHERE \"group\" = $1 AND server = $2 ORDER BY id ASC",
+			  1, stringlist_build(group, server, NULL));
+	old_count = pgsql_num_rows(res);
+	old_clients = calloc(old_count + 1, sizeof(struct edit_client));
+	for(unsigned int i = 0; i < old_count; i++)
+	{
+		old_clients[i].ident = xstrdup(pgsql_nvalue(res, i, "ident"));
+		old_clients[i].ip = xstrdup(pgsql_nvalue(res, i, "ip"));
+		old_clients[i].host = xstrdup(pgsql_nvalue(res, i, "host"));
+		old_clients[i].id = pgsql_nvalue(res, i, "id");
+	}
+
+	if((fd = mkstemp(filename)) == -1 || !(fp = fdopen(fd, "w")))
+	{
+		error("Could not create a temporary file: %s", strerror(errno));
+		if(fd != -1)
+		{
+			close(fd);
+			unlink(filename);
+		}
+		edit_clients_free(old_clients, old_count);
+		pgsql_free(res);
+		return;
+	}
+
+	fprintf(fp, "# Client authorizations of `%s' on `%s'\n", group, server);
+	fprintf(fp, "# One client per line: <ident> <ip> <host>\n");
+	fprintf(fp, "# Use * for any IP/host and a single dot to disable the identd lookup.\n");
+	fprintf(fp, "# Removed lines are deleted, new lines are added.\n");
+	for(unsigned int i = 0; i < old_count; i++)
+		fprintf(fp, "%-10s %-20s %s\n", old_clients[i].ident ? old_clients[i].ident : ".", old_clients[i].ip ? old_clients[i].ip : "*", old_clients[i].host ? old_clients[i].host : "*");
+	fclose(fp);
+
+	if(!(editor = conf_str("editor")) && !(editor = getenv("VISUAL")) && !(editor = getenv("EDITOR")))
+		editor = "vi";
+	snprintf(cmd, sizeof(cmd), "%s %s", editor, filename);
+
+	while(1)
+	{
+		int status = system(cmd);
+		if(status == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+		{
+			error("Editor `%s' failed; client authorizations have not been changed", editor);
+			goto out;
+		}
+
+		if((new_clients = edit_clients_read(filename, &new_count)))
+			break;
+		if(!readline_yesno("Edit the file again?", "Yes"))
+		{
+			out("Client authorizations have not been changed");
+			goto out;
+		}
+	}
+
+	// Both lists are sorted so the difference is a single merge pass; equal
+	// lines keep their database row
+	qsort(old_clients, old_count, sizeof(struct edit_client), edit_client_cmp);
+	qsort(new_clients, new_count, sizeof(struct edit_client), edit_client_cmp);
+	inserts = malloc((new_count + 1) * sizeof(struct edit_client *));
+	deletes = stringbuffer_create();
+	stringbuffer_append_char(deletes, '{');
+	for(unsigned int i = 0, j = 0; i < old_count || j < new_count; )
+	{
+		int cmp = (i == old_count) ? 1 : (j == new_count) ? -1 : edit_client_cmp(&old_clients[i], &new_clients[j]);
+		if(!cmp)
+		{
+			i++;
+			j++;
+		}
+		else if(cmp < 0)
+		{
+			edit_client_out(COLOR_LIGHT_RED, '-', &old_clients[i]);
+			if(delete_count++)
+				stringbuffer_append_char(deletes, ',');
+			stringbuffer_append_string(deletes, old_clients[i++].id);
+		}
+		else
+		{
+			edit_client_out(COLOR_LIME, '+', &new_clients[j]);
+			inserts[insert_count++] = &new_clients[j++];
+		}
+	}
+	stringbuffer_append_char(deletes, '}');
+
+	if(!insert_count && !delete_count)
+		out("No changes were made");
+	else if(readline_yesno("Apply these changes?", "Yes"))
+	{
+		pgsql_begin();
+		if(delete_count)
+		{
+			pgsql_query("DELETE FROM clients WHERE \"group\" = $1 AND server = $2 AND id = ANY($3::int[])",
+				    0, stringlist_build(group, server, deletes->string, NULL));
+		}
+
+		// Multi-row inserts; chunked to stay far below the parameter limit
+		for(unsigned int i = 0; i < insert_count; i += 1000)
+		{
+			struct stringbuffer *query = stringbuffer_create();
+			struct stringlist *params = stringlist_create();
+
+			stringbuffer_append_string(query, "INSERT INTO clients (\"group\", server, ident, ip, host) VALUES ");
+			stringlist_add(params, strdup(group));
+			stringlist_add(params, strdup(server));
+			for(unsigned int j = i; j < insert_count && j < i + 1000; j++)
+			{
+				stringbuffer_append_printf(query, "%s($1, $2, $%u, $%u, $%u)", (j > i) ? ", " : "", params->count + 1, params->count + 2, params->count + 3);
+				stringlist_add(params, xstrdup(inserts[j]->ident));
+				stringlist_add(params, xstrdup(inserts[j]->ip));
+				stringlist_add(params, xstrdup(inserts[j]->host));
+			}
+
+			pgsql_query(query->string, 0, params);
+			stringbuffer_free(query);
+		}
+		pgsql_commit();
+		out_color(COLOR_LIME, "Client authorizations have been updated: %u added, %u deleted", insert_count, delete_count);
+		show_clientgroup_clients(group, server);
+	}
+	else
+		out("Client authorizations have not been changed");
+
+	free(inserts);
+	stringbuffer_free(deletes);
+out:
+	unlink(filename);
+	if(new_clients)
+		edit_clients_free(new_clients, new_count);
+	edit_clients_free(old_clients, old_count);
+	pgsql_free(res);
+}
+
 // Tab completion stuff
 CMD_TAB_FUNC(client_list)
 {
@@ -667,11 +977,13 @@ CMD_TAB_FUNC(client_modgroup)
 
 CMD_TAB_FUNC(client_editclients)
 {
-	if(CAN_COMPLETE_ARG(1))
+	int offset = (tc_argc > 1 && !strcmp(tc_argv[1], "--editor"));
+
+	if(CAN_COMPLETE_ARG(1 + offset))
 		return clientgroup_generator(text, state);
-	else if(CAN_COMPLETE_ARG(2))
+	else if(CAN_COMPLETE_ARG(2 + offset))
 	{
-		tc_clientgroup = tc_argv[1];
+		tc_clientgroup = tc_argv[1 + offset];
 		return clientgroup_server_generator(text, state);
 	}
 
@@ -24,6 +24,8 @@ CMD_TAB_FUNC(conf_build);
 CMD_FUNC(conf_quicksync);
 CMD_TAB_FUNC(conf_quicksync);
 CMD_FUNC(conf_get_missing);
+CMD_FUNC(conf_stage);
+CMD_TAB_FUNC(conf_stage);
 
 static struct command commands[] = {
 	CMD_STUB("conf", "Config Management"),
@@ -40,6 +42,7 @@ static struct command subcommands[] = {
 	CMD_TC("build", conf_build, "Generate local config files"),
 	CMD_TC("quicksync", conf_quicksync, "Generate local config files and then upload them to the servers"),
 	CMD("get-missing", conf_get_missing, "Fetch missing configs from remote"),
+	CMD_TC("stage", conf_stage, "Upload a new config next to the live one and verify it"),
 	CMD_LIST_END
 };
 
@@ -57,6 +60,11 @@ void cmd_conf_init()
 	cmd_alias("buildconfs", "conf", "build");
 	cmd_alias("quicksync", "conf", "quicksync");
 	cmd_alias("commit", "conf", "quicksync");
+	cmd_background("conf", "check", CMD_JOB_SERVER | CMD_JOB_SERVER_OPTIONAL);
+	cmd_background("conf", "sync", CMD_JOB_SERVER | CMD_JOB_SERVER_OPTIONAL);
+	cmd_background("conf", "quicksync", CMD_JOB_SERVER | CMD_JOB_SERVER_OPTIONAL);
+	cmd_background("conf", "get-missing", 0);
+	cmd_background("conf", "stage", CMD_JOB_SERVER);
 }
 
 CMD_FUNC(conf_get)
@@ -193,6 +201,8 @@ CMD_FUNC(conf_sync)
 	int check_remote = 0;
 	int auto_update = 0;
 	int auto_rehash = 0;
+	int two_phase = 0;
+	int rolling = 0;
 	const char *server = NULL;
 
 	for(int i = 1; i < argc; i++)
@@ -205,11 +215,26 @@ CMD_FUNC(conf_sync)
 			auto_rehash = 1;
 		else if(!strcmp(argv[i], "--no-rehash"))
 			auto_rehash = -1;
+		else if(!strcmp(argv[i], "--two-phase"))
+			two_phase = 1;
+		else if(!strcmp(argv[i], "--rolling"))
+			rolling = 1;
 		else if(!server)
 			server = argv[i];
 	}
 
-	config_check_local(server, check_remote, auto_update, auto_rehash);
+	if(two_phase && rolling)
+	{
+		error("--two-phase and --rolling cannot be combined");
+		return;
+	}
+
+	if(two_phase)
+		config_commit_two_phase(server, check_remote, auto_update, auto_rehash);
+	else if(rolling)
+		config_commit_rolling(server, check_remote, auto_update, auto_rehash);
+	else
+		config_check_local(server, check_remote, auto_update, auto_rehash);
 }
 
 CMD_FUNC(conf_build)
@@ -223,6 +248,8 @@ CMD_FUNC(conf_quicksync)
 	int check_remote = 0;
 	int auto_update = 0;
 	int auto_rehash = 0;
+	int two_phase = 0;
+	int rolling = 0;
 	const char *server = NULL;
 
 	for(int i = 1; i < argc; i++)
@@ -235,12 +262,27 @@ CMD_FUNC(conf_quicksync)
 			auto_rehash = 1;
 		else if(!strcmp(argv[i], "--no-rehash"))
 			auto_rehash = -1;
+		else if(!strcmp(argv[i], "--two-phase"))
+			two_phase = 1;
+		else if(!strcmp(argv[i], "--rolling"))
+			rolling = 1;
 		else if(!server)
 			server = argv[i];
 	}
 
+	if(two_phase && rolling)
+	{
+		error("--two-phase and --rolling cannot be combined");
+		return;
+	}
+
 	config_generate(server);
-	config_check_local(server, check_remote, auto_update, auto_rehash);
+	if(two_phase)
+		config_commit_two_phase(server, check_remote, auto_update, auto_rehash);
+	else if(rolling)
+		config_commit_rolling(server, check_remote, auto_update, auto_rehash);
+	else
+		config_check_local(server, check_remote, auto_update, auto_rehash);
 }
 
 CMD_FUNC(conf_get_missing)
@@ -248,6 +290,26 @@ CMD_FUNC(conf_get_missing)
 	config_get_missing();
 }
 
+CMD_FUNC(conf_stage)
+{
+	struct server_info *server;
+
+	if(argc < 2)
+	{
+		out("Usage: conf stage <server>");
+		return;
+	}
+
+	if(!(server = serverinfo_load(argv[1])))
+	{
+		error("A server named `%s' does not exist", argv[1]);
+		return;
+	}
+
+	config_stage(server);
+	serverinfo_free(server);
+}
+
 // Tab completion stuff
 CMD_TAB_FUNC(conf_get)
 {
@@ -270,6 +332,13 @@ CMD_TAB_FUNC(conf_rehash)
 	return NULL;
 }
 
+CMD_TAB_FUNC(conf_stage)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return server_generator(text, state);
+	return NULL;
+}
+
 CMD_TAB_FUNC(conf_sync)
 {
 	return conf_sync_arg_generator(text, state);
@@ -292,7 +361,7 @@ CMD_TAB_FUNC(conf_quicksync)
 
 static char *conf_sync_arg_generator(const char *text, int state)
 {
-	static const char *values[] = { "--check-remote", "--update", "--rehash", "--no-rehash", NULL };
+	static const char *values[] = { "--check-remote", "--update", "--rehash", "--no-rehash", "--two-phase", "--rolling", NULL };
 	static int idx, chain_state;
 	static size_t len;
 	const char *val;
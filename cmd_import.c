@@ -0,0 +1,584 @@
+#include "common.h"
+#include "cmd.h"
+#include "pgsql.h"
+#include "stringlist.h"
+#include "stringbuffer.h"
+#include "tokenize.h"
+
+enum import_type
+{
+	IMPORT_VARCHAR,
+	IMPORT_INTEGER,
+	IMPORT_BOOLEAN,
+	IMPORT_INET,
+	IMPORT_PRIV // ircd_oper_priv_status
+};
+
+struct import_column
+{
+	const char *name;
+	enum import_type type;
+	unsigned int max_len; // IMPORT_VARCHAR only
+	unsigned int flags;
+	const char *invalid; // value rejected by a CHECK constraint
+};
+
+struct import_table
+{
+	const char *name;
+	const struct import_column *columns;
+	const char *order;
+	// Column containing the server a row belongs to or a query returning the
+	// servers using the values in key_column ($1 is an array of them)
+	const char *server_column;
+	const char *key_column;
+	const char *servers_query;
+};
+
+// Flags of import_column
+#define IMPORT_NOT_NULL		0x01 // may be omitted (default), but not empty
+#define IMPORT_REQUIRED		0x03 // must be present and not empty
+
+#define IMPORT_COLUMN(NAME, TYPE, LEN, FLAGS)			{ NAME, TYPE, LEN, FLAGS, NULL }
+#define IMPORT_COLUMN_CHECK(NAME, TYPE, LEN, FLAGS, INVALID)	{ NAME, TYPE, LEN, FLAGS, INVALID }
+#define IMPORT_COLUMN_END					{ NULL, 0, 0, 0, NULL }
+
+static const struct import_column clientgroup_columns[] = {
+	IMPORT_COLUMN("name", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("server", IMPORT_VARCHAR, 63, IMPORT_REQUIRED),
+	IMPORT_COLUMN("connclass", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("password", IMPORT_VARCHAR, 32, 0),
+	IMPORT_COLUMN("class_maxlinks", IMPORT_INTEGER, 0, 0),
+	IMPORT_COLUMN_END
+};
+
+static const struct import_column client_columns[] = {
+	IMPORT_COLUMN("group", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("server", IMPORT_VARCHAR, 63, IMPORT_REQUIRED),
+	IMPORT_COLUMN_CHECK("ident", IMPORT_VARCHAR, 10, 0, ""),
+	IMPORT_COLUMN("ip", IMPORT_INET, 0, 0),
+	IMPORT_COLUMN_CHECK("host", IMPORT_VARCHAR, 63, 0, "*"),
+	IMPORT_COLUMN_END
+};
+
+static const struct import_column oper_columns[] = {
+	IMPORT_COLUMN("name", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("username", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("password", IMPORT_VARCHAR, 64, IMPORT_REQUIRED),
+	IMPORT_COLUMN("connclass", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("active", IMPORT_BOOLEAN, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_local", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_umode_nochan", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_umode_noidle", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_umode_chserv", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_notargetlimit", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_flood", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_pseudoflood", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_gline_immune", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_die", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN("priv_restart", IMPORT_PRIV, 0, IMPORT_NOT_NULL),
+	IMPORT_COLUMN_END
+};
+
+static const struct import_column operhost_columns[] = {
+	IMPORT_COLUMN("oper", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("mask", IMPORT_VARCHAR, 74, IMPORT_REQUIRED),
+	IMPORT_COLUMN_END
+};
+
+static const struct import_column oper2server_columns[] = {
+	IMPORT_COLUMN("oper", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("server", IMPORT_VARCHAR, 63, IMPORT_REQUIRED),
+	IMPORT_COLUMN_END
+};
+
+static const struct import_column jupe_columns[] = {
+	IMPORT_COLUMN("name", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("nicks", IMPORT_VARCHAR, 256, IMPORT_REQUIRED),
+	IMPORT_COLUMN_END
+};
+
+static const struct import_column jupe2server_columns[] = {
+	IMPORT_COLUMN("jupe", IMPORT_VARCHAR, 32, IMPORT_REQUIRED),
+	IMPORT_COLUMN("server", IMPORT_VARCHAR, 63, IMPORT_REQUIRED),
+	IMPORT_COLUMN_END
+};
+
+static const struct import_table import_tables[] = {
+	{ "clientgroups", clientgroup_columns, "server, name", "server", NULL, NULL },
+	{ "clients", client_columns, "server, \"group\", id", "server", NULL, NULL },
+	{ "opers", oper_columns, "name", NULL, "name", "SELECT DISTINCT server FROM opers2servers WHERE oper = ANY($1::varchar[])" },
+	{ "operhosts", operhost_columns, "oper, mask", NULL, "oper", "SELECT DISTINCT server FROM opers2servers WHERE oper = ANY($1::varchar[])" },
+	{ "opers2servers", oper2server_columns, "oper, server", "server", NULL, NULL },
+	{ "jupes", jupe_columns, "name", NULL, "name", "SELECT DISTINCT server FROM jupes2servers WHERE jupe = ANY($1::varchar[])" },
+	{ "jupes2servers", jupe2server_columns, "jupe, server", "server", NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+static const struct import_table *import_table_find(const char *name);
+static char *import_table_generator(const char *text, int state);
+static char *import_read_file(const char *filename, size_t *len);
+static int import_next_record(const char **pos, const char *end, unsigned int *line, struct stringlist *fields);
+static const char *import_check_value(const struct import_column *column, const char *value);
+static char *import_array(struct stringlist *values);
+CMD_FUNC(import);
+CMD_TAB_FUNC(import);
+CMD_FUNC(export);
+CMD_TAB_FUNC(export);
+
+static struct command commands[] = {
+	CMD_TC("import", import, "Import rows from a CSV file"),
+	CMD_TC("export", export, "Export a table as CSV"),
+	CMD_LIST_END
+};
+
+
+
+void cmd_import_init()
+{
+	cmd_register_list(commands, NULL);
+}
+
+static const struct import_table *import_table_find(const char *name)
+{
+	for(const struct import_table *table = import_tables; table->name; table++)
+	{
+		if(!strcasecmp(table->name, name))
+			return table;
+	}
+
+	error("Unknown table `%s'; use clientgroups, clients, opers, operhosts, opers2servers, jupes or jupes2servers", name);
+	return NULL;
+}
+
+static char *import_table_generator(const char *text, int state)
+{
+	static int idx;
+	static size_t len;
+	const char *name;
+
+	if(!state) // New word
+	{
+		len = strlen(text);
+		idx = 0;
+	}
+	else if(state == -1) // Cleanup
+	{
+		return NULL;
+	}
+
+	// Return the next name which partially matches from the table list.
+	while((name = import_tables[idx].name))
+	{
+		idx++;
+		if(!strncasecmp(name, text, len))
+			return strdup(name);
+	}
+
+	return NULL;
+}
+
+static char *import_read_file(const char *filename, size_t *len)
+{
+	struct stringbuffer *buf;
+	char chunk[65536], *data;
+	size_t res;
+	FILE *fp;
+
+	if(!(fp = fopen(filename, "r")))
+	{
+		error("Could not open `%s': %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	buf = stringbuffer_create();
+	while((res = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+		stringbuffer_append_string_n(buf, chunk, res);
+
+	if(ferror(fp))
+	{
+		error("Could not read `%s': %s", filename, strerror(errno));
+		fclose(fp);
+		stringbuffer_free(buf);
+		return NULL;
+	}
+
+	fclose(fp);
+	*len = buf->len;
+	data = malloc(buf->len + 1);
+	memcpy(data, buf->string, buf->len + 1);
+	stringbuffer_free(buf);
+	return data;
+}
+
+// Parses one CSV record like COPY ... WITH CSV does: an unquoted empty
+// field is NULL, a quoted one an empty string and "" inside quotes is a
+// quote. Returns 1 for a record, 0 at the end and -1 for a missing quote.
+static int import_next_record(const char **pos, const char *end, unsigned int *line, struct stringlist *fields)
+{
+	const char *p = *pos;
+	struct stringbuffer *value;
+
+	if(p >= end)
+		return 0;
+
+	value = stringbuffer_create();
+	while(1)
+	{
+		int quoted = 0;
+
+		stringbuffer_erase(value, 0, value->len);
+		if(p < end && *p == '"')
+		{
+			quoted = 1;
+			for(p++; ; p++)
+			{
+				if(p >= end)
+				{
+					stringbuffer_free(value);
+					return -1;
+				}
+				else if(*p == '"' && p + 1 < end && p[1] == '"')
+					stringbuffer_append_char(value, *p++);
+				else if(*p == '"')
+				{
+					p++;
+					break;
+				}
+				else
+				{
+					if(*p == '\n')
+						(*line)++;
+					stringbuffer_append_char(value, *p);
+				}
+			}
+		}
+
+		// Anything after the closing quote belongs to the value, too
+		for(; p < end && *p != ',' && *p != '\n'; p++)
+		{
+			if(*p != '\r' || (p + 1 < end && p[1] != '\n'))
+				stringbuffer_append_char(value, *p);
+		}
+
+		stringlist_add(fields, (quoted || value->len) ? strdup(value->string) : NULL);
+		if(p >= end || *p == '\n')
+			break;
+		p++; // ,
+	}
+
+	if(p < end)
+	{
+		p++; // \n
+		(*line)++;
+	}
+
+	*pos = p;
+	stringbuffer_free(value);
+	return 1;
+}
+
+// Returns an error message if the value is not valid for the column
+static const char *import_check_value(const struct import_column *column, const char *value)
+{
+	static char msg[64];
+	char *end;
+	long num;
+
+	if(!value)
+		return (column->flags & IMPORT_NOT_NULL) ? "must not be empty" : NULL;
+	if(column->invalid && !strcmp(value, column->invalid))
+		return "is not allowed";
+
+	switch(column->type)
+	{
+		case IMPORT_VARCHAR:
+			if(strlen(value) > column->max_len)
+			{
+				snprintf(msg, sizeof(msg), "is longer than %u characters", column->max_len);
+				return msg;
+			}
+
+			return NULL;
+
+		case IMPORT_INTEGER:
+		case IMPORT_PRIV:
+			errno = 0;
+			num = strtol(value, &end, 10);
+			if(!*value || *end || errno)
+				return "is not a number";
+			else if(column->type == IMPORT_PRIV && (num < -1 || num > 1))
+				return "must be -1, 0 or 1";
+			return NULL;
+
+		case IMPORT_BOOLEAN:
+			if(!true_string(value) && !(false_string(value) && *value) && strcasecmp(value, "t") && strcasecmp(value, "f"))
+				return "is not a boolean";
+			return NULL;
+
+		case IMPORT_INET:
+			if(!valid_inet(value))
+				return "is not a valid IP address/netmask";
+			return NULL;
+	}
+
+	return NULL;
+}
+
+// Builds a PostgreSQL array literal
+static char *import_array(struct stringlist *values)
+{
+	struct stringbuffer *buf = stringbuffer_create();
+	char *str;
+
+	stringbuffer_append_char(buf, '{');
+	for(unsigned int i = 0; i < values->count; i++)
+	{
+		if(i)
+			stringbuffer_append_char(buf, ',');
+		stringbuffer_append_char(buf, '"');
+		for(const char *c = values->data[i]; *c; c++)
+		{
+			if(*c == '"' || *c == '\\')
+				stringbuffer_append_char(buf, '\\');
+			stringbuffer_append_char(buf, *c);
+		}
+		stringbuffer_append_char(buf, '"');
+	}
+	stringbuffer_append_char(buf, '}');
+
+	str = strdup(buf->string);
+	stringbuffer_free(buf);
+	return str;
+}
+
+CMD_FUNC(import)
+{
+	const struct import_table *table;
+	const struct import_column *columns[32];
+	struct stringlist *header, *fields, *keys, *servers;
+	struct stringbuffer *query;
+	const char *pos, *end;
+	char *data;
+	size_t len;
+	unsigned int line = 1, record_line, errors = 0, records = 0;
+	int server_col = -1, key_col = -1, ret, rows;
+
+	if(argc < 3)
+	{
+		out("Usage: import <table> <file.csv>");
+		return;
+	}
+
+	if(!(table = import_table_find(argv[1])) || !(data = import_read_file(argv[2], &len)))
+		return;
+
+	// The header decides which columns are imported
+	pos = data;
+	end = data + len;
+	header = stringlist_create();
+	if(import_next_record(&pos, end, &line, header) != 1)
+	{
+		error("`%s' does not start with a header line", argv[2]);
+		stringlist_free(header);
+		free(data);
+		return;
+	}
+
+	if(header->count > ArraySize(columns))
+	{
+		error("`%s' has too many columns", argv[2]);
+		errors++;
+	}
+
+	for(unsigned int i = 0; !errors && i < header->count; i++)
+	{
+		columns[i] = NULL;
+		for(const struct import_column *column = table->columns; header->data[i] && column->name; column++)
+		{
+			if(!strcasecmp(column->name, header->data[i]))
+				columns[i] = column;
+		}
+
+		if(!columns[i])
+		{
+			error("Column `%s' cannot be imported into %s", header->data[i] ? header->data[i] : "", table->name);
+			errors++;
+			break;
+		}
+		else if(stringlist_find(header, header->data[i]) != (int)i)
+		{
+			error("Column `%s' is used twice", header->data[i]);
+			errors++;
+			break;
+		}
+		else if(table->server_column && !strcmp(columns[i]->name, table->server_column))
+			server_col = i;
+		else if(table->key_column && !strcmp(columns[i]->name, table->key_column))
+			key_col = i;
+	}
+
+	for(const struct import_column *column = table->columns; !errors && column->name; column++)
+	{
+		if((column->flags & IMPORT_REQUIRED) == IMPORT_REQUIRED && stringlist_find(header, column->name) == -1)
+		{
+			error("Column `%s' is missing", column->name);
+			errors++;
+		}
+	}
+
+	// Check all rows before anything is sent to the database
+	keys = stringlist_create();
+	servers = stringlist_create();
+	while(!errors || (records && errors < 10))
+	{
+		unsigned int row_errors = 0;
+
+		fields = stringlist_create();
+		record_line = line;
+		if((ret = import_next_record(&pos, end, &line, fields)) != 1)
+		{
+			if(ret < 0)
+			{
+				error("Line %u: missing closing quote", record_line);
+				errors++;
+			}
+
+			stringlist_free(fields);
+			break;
+		}
+
+		records++;
+		if(fields->count != header->count)
+		{
+			error("Line %u: expected %u values, got %u", record_line, header->count, fields->count);
+			row_errors++;
+		}
+
+		for(unsigned int i = 0; !row_errors && i < fields->count; i++)
+		{
+			const char *msg = import_check_value(columns[i], fields->data[i]);
+			if(msg)
+			{
+				error("Line %u: %s `%s' %s", record_line, columns[i]->name, fields->data[i] ? fields->data[i] : "", msg);
+				row_errors++;
+			}
+		}
+
+		if(!row_errors && server_col >= 0 && stringlist_find(servers, fields->data[server_col]) == -1)
+			stringlist_add(servers, strdup(fields->data[server_col]));
+		else if(!row_errors && key_col >= 0)
+			stringlist_add(keys, strdup(fields->data[key_col]));
+		errors += row_errors;
+		stringlist_free(fields);
+	}
+
+	if(errors || !records)
+	{
+		if(!errors)
+			error("`%s' contains no rows", argv[2]);
+		else
+			error("Nothing has been imported");
+		stringlist_free(header);
+		stringlist_free(keys);
+		stringlist_free(servers);
+		free(data);
+		return;
+	}
+
+	query = stringbuffer_create();
+	stringbuffer_append_printf(query, "COPY %s (", table->name);
+	for(unsigned int i = 0; i < header->count; i++)
+		stringbuffer_append_printf(query, "%s\"%s\"", i ? ", " : "", columns[i]->name);
+	stringbuffer_append_string(query, ") FROM STDIN WITH CSV HEADER");
+
+	pgsql_begin();
+	rows = pgsql_copy_from(query->string, data, len);
+	stringbuffer_free(query);
+	stringlist_free(header);
+	free(data);
+	if(rows < 0)
+	{
+		pgsql_rollback();
+		error("Nothing has been imported");
+		stringlist_free(keys);
+		stringlist_free(servers);
+		return;
+	}
+
+	if(keys->count)
+	{
+		char *array = import_array(keys);
+		PGresult *res = pgsql_query(table->servers_query, 1, stringlist_build(array, NULL));
+		for(int i = 0; i < pgsql_num_rows(res); i++)
+			stringlist_add(servers, strdup(pgsql_value(res, i, 0)));
+		pgsql_free(res);
+		free(array);
+	}
+
+	pgsql_commit();
+	out_color(COLOR_LIME, "Imported %d %s into %s", rows, rows == 1 ? "row" : "rows", table->name);
+	if(servers->count)
+	{
+		stringlist_sort(servers);
+		char *list = untokenize(servers->count, servers->data, ", ");
+		out("Configs of %u %s need to be updated using `commit': %s", servers->count, servers->count == 1 ? "server" : "servers", list);
+		free(list);
+	}
+
+	stringlist_free(keys);
+	stringlist_free(servers);
+}
+
+CMD_TAB_FUNC(import)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return import_table_generator(text, state);
+	return NULL;
+}
+
+CMD_FUNC(export)
+{
+	const struct import_table *table;
+	struct stringbuffer *query;
+	FILE *fp = stdout;
+	int rows;
+
+	if(argc < 2)
+	{
+		out("Usage: export <table> [file.csv]");
+		return;
+	}
+
+	if(!(table = import_table_find(argv[1])))
+		return;
+
+	if(argc > 2 && !(fp = fopen(argv[2], "w")))
+	{
+		error("Could not open `%s' for writing: %s", argv[2], strerror(errno));
+		return;
+	}
+
+	// Same columns as accepted by import so the file can be imported again
+	query = stringbuffer_create();
+	stringbuffer_append_string(query, "COPY (SELECT ");
+	for(const struct import_column *column = table->columns; column->name; column++)
+		stringbuffer_append_printf(query, "%s\"%s\"", column == table->columns ? "" : ", ", column->name);
+	stringbuffer_append_printf(query, " FROM %s ORDER BY %s) TO STDOUT WITH CSV HEADER", table->name, table->order);
+	rows = pgsql_copy_to(query->string, fp);
+	stringbuffer_free(query);
+
+	if(fp == stdout)
+		fflush(stdout);
+	else if(fclose(fp) != 0)
+		error("Could not write `%s': %s", argv[2], strerror(errno));
+	else if(rows >= 0)
+		out_color(COLOR_LIME, "Exported %d %s of %s to `%s'", rows, rows == 1 ? "row" : "rows", table->name, argv[2]);
+}
+
+CMD_TAB_FUNC(export)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return import_table_generator(text, state);
+	return NULL;
+}
@@ -0,0 +1,587 @@
+#include "common.h"
+#include "cmd.h"
+#include "job.h"
+#include "main.h"
+#include "pgsql.h"
+#include "input.h"
+#include "table.h"
+#include "ptrlist.h"
+#include "stringlist.h"
+#include "stringbuffer.h"
+#include "tokenize.h"
+#include "ssh.h"
+
+static const char *skip_token(const char *str);
+static const char *skip_args(const char *str, int count);
+static int job_server_arg(int words, const char *line, int argc, char **argv, const char **start, const char **end);
+static char *job_unit_line(const char *line, const char *start, const char *end, const char *server);
+static struct job *job_arg(const char *arg);
+static void job_show_units(struct job *job);
+static char *job_id_generator(const char *text, int state);
+CMD_FUNC(job_bg);
+CMD_FUNC(job_list);
+CMD_TAB_FUNC(job_list);
+CMD_FUNC(job_wait);
+CMD_TAB_FUNC(job_wait);
+CMD_FUNC(job_cancel);
+CMD_TAB_FUNC(job_cancel);
+CMD_FUNC(job_log);
+CMD_TAB_FUNC(job_log);
+CMD_FUNC(job_timeout);
+CMD_FUNC(job_retry);
+
+// Command line and servers of the last command which had stragglers
+static char *retry_line = NULL;
+static struct stringlist *retry_servers = NULL;
+
+static struct command commands[] = {
+	CMD("bg", job_bg, "Run a command in the background"),
+	CMD_TC("jobs", job_list, "Show background jobs"),
+	CMD_TC("wait", job_wait, "Wait for a background job to finish"),
+	CMD_TC("cancel", job_cancel, "Cancel a background job"),
+	CMD_TC("joblog", job_log, "Show the output of a background job"),
+	CMD("timeout", job_timeout, "Run a command with different ssh timeouts"),
+	CMD("retry", job_retry, "Run the last command again on the servers which failed"),
+	CMD_LIST_END
+};
+
+void cmd_job_init()
+{
+	cmd_register_list(commands, NULL);
+}
+
+// Returns the position right after the (possibly quoted) token starting at str
+static const char *skip_token(const char *str)
+{
+	char quote = '\0';
+
+	for(; *str; str++)
+	{
+		if(quote)
+		{
+			if(*str == quote)
+				quote = '\0';
+		}
+		else if(*str == '"' || *str == '\'')
+			quote = *str;
+		else if(*str == '\\' && *(str + 1))
+			str++;
+		else if(*str == ' ')
+			break;
+	}
+
+	return str;
+}
+
+// Skips count tokens and the spaces following them
+static const char *skip_args(const char *str, int count)
+{
+	while(*str == ' ')
+		str++;
+	for(int i = 0; i < count; i++)
+	{
+		str = skip_token(str);
+		while(*str == ' ')
+			str++;
+	}
+
+	return str;
+}
+
+// Finds the server argument of a command taking one; argv/line start with
+// the command name which consists of words elements. Returns the index of
+// the server in argv (argc if there is none) and sets start/end to its
+// position in the raw line so everything else can be passed on unchanged.
+static int job_server_arg(int words, const char *line, int argc, char **argv, const char **start, const char **end)
+{
+	int idx;
+
+	// The server is the first non-option argument after the command name
+	for(idx = words; idx < argc; idx++)
+	{
+		if(strncmp(argv[idx], "--", 2))
+			break;
+	}
+
+	*start = *end = NULL;
+	if(idx < argc)
+	{
+		*start = skip_args(line, idx);
+		*end = skip_token(*start);
+	}
+
+	return idx;
+}
+
+static char *job_unit_line(const char *line, const char *start, const char *end, const char *server)
+{
+	char *unit_line;
+
+	if(start)
+		asprintf(&unit_line, "%.*s%s%s", (int)(start - line), line, server, end);
+	else
+		asprintf(&unit_line, "%s %s", line, server);
+	return unit_line;
+}
+
+static struct job *job_arg(const char *arg)
+{
+	struct job *job;
+	char *end;
+	unsigned long id;
+
+	if(*arg == '%')
+		arg++;
+	id = strtoul(arg, &end, 10);
+	if(*end || !(job = job_find(id)))
+	{
+		error("A job with the id `%s' does not exist", arg);
+		return NULL;
+	}
+
+	return job;
+}
+
+CMD_FUNC(job_bg)
+{
+	struct command *cmd;
+	struct stringlist *servers = NULL, *lines;
+	struct job *job;
+	const char *line, *start = NULL, *end = NULL;
+	int words, server_idx = 0;
+
+	if(argc < 2)
+	{
+		out("Usage: bg <command> [args...]");
+		return;
+	}
+
+	if(!(cmd = cmd_lookup(argc - 1, argv + 1, &words)))
+	{
+		error("%s: command not found", argv[1]);
+		return;
+	}
+
+	if(!(cmd->job_flags & CMD_JOB))
+	{
+		error("%s cannot be run in the background", argv[1]);
+		return;
+	}
+
+	// The command line without the leading "bg"
+	line = skip_args(cmd_line, 1);
+
+	lines = stringlist_create();
+	if(cmd->job_flags & CMD_JOB_SERVER)
+	{
+		PGresult *res;
+		int rows;
+
+		server_idx = 1 + job_server_arg(words, line, argc - 1, argv + 1, &start, &end);
+		if(server_idx == argc && !(cmd->job_flags & CMD_JOB_SERVER_OPTIONAL))
+		{
+			error("%s requires a server", argv[1]);
+			stringlist_free(lines);
+			return;
+		}
+		else if(server_idx == argc || ((cmd->job_flags & CMD_JOB_SERVER_STAR) && !strcmp(argv[server_idx], "*")))
+		{
+			res = pgsql_query("SELECT name FROM servers ORDER BY name ASC", 1, NULL);
+			if(server_idx < argc && !readline_yesno("Really execute this command on all servers?", NULL))
+			{
+				pgsql_free(res);
+				stringlist_free(lines);
+				return;
+			}
+		}
+		else
+			res = pgsql_query("SELECT name FROM servers WHERE lower(name) = lower($1)", 1, stringlist_build(argv[server_idx], NULL));
+
+		rows = pgsql_num_rows(res);
+		if(!rows)
+		{
+			if(server_idx < argc)
+				error("A server named `%s' does not exist", argv[server_idx]);
+			else
+				error("There are no servers");
+			pgsql_free(res);
+			stringlist_free(lines);
+			return;
+		}
+
+		servers = stringlist_create();
+		for(int i = 0; i < rows; i++)
+		{
+			const char *name = pgsql_value(res, i, 0);
+			stringlist_add(servers, strdup(name));
+			stringlist_add(lines, job_unit_line(line, start, end, name));
+		}
+
+		pgsql_free(res);
+	}
+	else
+	{
+		stringlist_add(lines, strdup(line));
+	}
+
+	job = job_create(line, servers, lines);
+	out_color(COLOR_LIME, "[job %u] started: %s (%u %s)", job->id, line, job->count, servers ? "servers" : "unit");
+	if(servers)
+		stringlist_free(servers);
+	stringlist_free(lines);
+}
+
+CMD_FUNC(job_list)
+{
+	struct ptrlist *jobs = job_list();
+	struct table *table;
+	time_t now = time(NULL);
+	unsigned int row = 0;
+
+	if(argc > 1 && !strcmp(argv[1], "--clear"))
+	{
+		unsigned int removed = 0;
+		for(unsigned int i = 0; i < jobs->count; )
+		{
+			struct job *job = jobs->data[i]->ptr;
+			if(job_state(job) != JOB_RUNNING && job_state(job) != JOB_PENDING)
+			{
+				job_remove(job);
+				removed++;
+				continue;
+			}
+			i++;
+		}
+
+		out("Removed %u finished jobs", removed);
+		return;
+	}
+	else if(argc > 1)
+	{
+		struct job *job;
+		if((job = job_arg(argv[1])))
+			job_show_units(job);
+		return;
+	}
+
+	if(!jobs->count)
+	{
+		out("There are no background jobs");
+		return;
+	}
+
+	table = table_create(6, jobs->count);
+	table_set_header(table, "ID", "State", "Done", "Failed", "Time", "Command");
+	table_ralign_column(table, 0, 1);
+	table_ralign_column(table, 2, 1);
+	table_ralign_column(table, 3, 1);
+	table_ralign_column(table, 4, 1);
+	table_free_column(table, 0, 1);
+	table_free_column(table, 2, 1);
+	table_free_column(table, 3, 1);
+	table_free_column(table, 4, 1);
+
+	for(unsigned int i = 0; i < jobs->count; i++)
+	{
+		struct job *job = jobs->data[i]->ptr;
+		table_col_num(table, row, 0, job->id);
+		table_col_str(table, row, 1, (char *)job_state_name(job_state(job)));
+		table_col_fmt(table, row, 2, "%u/%u", job->count - job->pending - job->running, job->count);
+		table_col_num(table, row, 3, job->failed);
+		table_col_fmt(table, row, 4, "%lus", (unsigned long)((job->finished ? job->finished : now) - job->started));
+		table_col_str(table, row, 5, job->cmd_line);
+		row++;
+	}
+
+	table_sort(table, 0);
+	table_send(table);
+	table_free(table);
+}
+
+static void job_show_units(struct job *job)
+{
+	struct table *table;
+	time_t now = time(NULL);
+
+	out("Job %u: %s", job->id, job->cmd_line);
+	table = table_create(4, job->count);
+	table_set_header(table, "Server", "State", "Exit", "Time");
+	table_ralign_column(table, 2, 1);
+	table_ralign_column(table, 3, 1);
+	table_free_column(table, 2, 1);
+	table_free_column(table, 3, 1);
+
+	for(unsigned int i = 0; i < job->count; i++)
+	{
+		struct job_unit *unit = &job->units[i];
+		table_col_str(table, i, 0, unit->server ? unit->server : "-");
+		table_col_str(table, i, 1, (char *)job_state_name(unit->state));
+		if(unit->state == JOB_PENDING || unit->state == JOB_RUNNING || !unit->started)
+			table_col_str(table, i, 2, strdup(""));
+		else
+			table_col_num(table, i, 2, unit->exitcode);
+		if(unit->started)
+			table_col_fmt(table, i, 3, "%lus", (unsigned long)((unit->finished ? unit->finished : now) - unit->started));
+		else
+			table_col_str(table, i, 3, strdup(""));
+	}
+
+	table_send(table);
+	table_free(table);
+}
+
+CMD_FUNC(job_wait)
+{
+	struct ptrlist *jobs = job_list();
+
+	if(argc > 1)
+	{
+		struct job *job;
+
+		if(!(job = job_arg(argv[1])))
+			return;
+
+		if(job_wait(job) != 0)
+		{
+			out_color(COLOR_YELLOW, "Stopped waiting; job %u keeps running in the background", job->id);
+			return;
+		}
+
+		job_show_units(job);
+		out_color(job->failed ? COLOR_LIGHT_RED : COLOR_LIME, "[job %u] %s: %u/%u ok, %u failed, %u cancelled",
+			  job->id, job_state_name(job_state(job)), job->count - job->failed - job->cancelled, job->count,
+			  job->failed, job->cancelled);
+		return;
+	}
+
+	// Wait for all jobs
+	for(unsigned int i = 0; i < jobs->count; i++)
+	{
+		if(job_wait(jobs->data[i]->ptr) != 0)
+		{
+			out_color(COLOR_YELLOW, "Stopped waiting; the jobs keep running in the background");
+			return;
+		}
+	}
+
+	out("All background jobs have finished");
+}
+
+CMD_FUNC(job_cancel)
+{
+	struct job *job;
+
+	if(argc < 2)
+	{
+		out("Usage: cancel <id>");
+		return;
+	}
+
+	if(!(job = job_arg(argv[1])))
+		return;
+
+	if(job_state(job) != JOB_RUNNING && job_state(job) != JOB_PENDING)
+	{
+		error("Job %u has already finished", job->id);
+		return;
+	}
+
+	job_cancel(job);
+	out_color(COLOR_YELLOW, "Job %u has been cancelled", job->id);
+}
+
+CMD_FUNC(job_log)
+{
+	struct job *job;
+
+	if(argc < 2)
+	{
+		out("Usage: joblog <id> [server]");
+		return;
+	}
+
+	if(!(job = job_arg(argv[1])))
+		return;
+
+	for(unsigned int i = 0; i < job->count; i++)
+	{
+		struct job_unit *unit = &job->units[i];
+		char *output, *line, *next;
+
+		if(argc > 2 && (!unit->server || strcasecmp(unit->server, argv[2])))
+			continue;
+
+		out_color(COLOR_BROWN, "[%s] %s: %s", unit->server ? unit->server : "-", job_state_name(unit->state), unit->cmd_line);
+		if(!unit->output->len)
+			continue;
+
+		output = strdup(unit->output->string);
+		for(line = output; line && *line; line = next)
+		{
+			if((next = strchr(line, '\n')))
+				*next++ = '\0';
+			out("%s", line);
+		}
+		free(output);
+	}
+}
+
+CMD_FUNC(job_timeout)
+{
+	char *end;
+	long seconds;
+	int prev;
+
+	if(argc < 3)
+	{
+		out("Usage: timeout <seconds> <command> [args...]");
+		return;
+	}
+
+	seconds = strtol(argv[1], &end, 10);
+	if(*end || seconds < 0 || seconds > INT_MAX / 1000)
+	{
+		error("Invalid timeout `%s'", argv[1]);
+		return;
+	}
+
+	prev = ssh_set_timeout(seconds);
+	handle_line(skip_args(cmd_line, 2));
+	ssh_set_timeout(prev);
+}
+
+// Called after a command if some servers could not be reached or timed out
+void cmd_job_stragglers(const char *line, struct stringlist *servers)
+{
+	struct stringbuffer *names = stringbuffer_create();
+
+	xfree(retry_line);
+	if(retry_servers)
+		stringlist_free(retry_servers);
+	retry_line = strdup(line);
+	retry_servers = stringlist_copy(servers);
+
+	for(unsigned int i = 0; i < servers->count; i++)
+	{
+		if(i)
+			stringbuffer_append_string(names, ", ");
+		stringbuffer_append_string(names, servers->data[i]);
+	}
+
+	out_color(COLOR_YELLOW, "%u %s failed or timed out: %s", servers->count, servers->count == 1 ? "server" : "servers", names->string);
+	out("Use `retry' to run `%s' on %s again", line, servers->count == 1 ? "it" : "them");
+	stringbuffer_free(names);
+}
+
+CMD_FUNC(job_retry)
+{
+	struct command *cmd;
+	struct stringlist *servers, *lines;
+	const char *start, *end;
+	char *line, *dup, *line_argv[32];
+	int line_argc, words, background = (argc > 1 && !strcmp(argv[1], "--bg"));
+
+	if(!retry_line)
+	{
+		out("There is nothing to retry");
+		return;
+	}
+
+	// Taken over; running the command again records new stragglers
+	line = retry_line;
+	servers = retry_servers;
+	retry_line = NULL;
+	retry_servers = NULL;
+
+	dup = strdup(line);
+	line_argc = tokenize_quoted(dup, line_argv, 32);
+	if(!(cmd = cmd_lookup(line_argc, line_argv, &words)))
+	{
+		error("%s: command not found", line_argv[0]);
+		free(dup);
+		free(line);
+		stringlist_free(servers);
+		return;
+	}
+
+	job_server_arg(words, line, line_argc, line_argv, &start, &end);
+	lines = stringlist_create();
+	for(unsigned int i = 0; i < servers->count; i++)
+		stringlist_add(lines, job_unit_line(line, start, end, servers->data[i]));
+
+	if(background)
+	{
+		struct job *job = job_create(line, servers, lines);
+		out_color(COLOR_LIME, "[job %u] started: %s (%u servers)", job->id, line, job->count);
+	}
+	else
+	{
+		for(unsigned int i = 0; i < lines->count && !sigint_received; i++)
+		{
+			out_color(COLOR_BROWN, "Retrying: %s", lines->data[i]);
+			handle_line(lines->data[i]);
+		}
+	}
+
+	stringlist_free(lines);
+	stringlist_free(servers);
+	free(dup);
+	free(line);
+}
+
+// Tab completion stuff
+static char *job_id_generator(const char *text, int state)
+{
+	static unsigned int idx;
+	static size_t len;
+	struct ptrlist *jobs = job_list();
+
+	if(!state) // New word
+	{
+		idx = 0;
+		len = strlen(text);
+	}
+	else if(state == -1) // Cleanup
+		return NULL;
+
+	while(idx < jobs->count)
+	{
+		char buf[16];
+		struct job *job = jobs->data[idx++]->ptr;
+		snprintf(buf, sizeof(buf), "%u", job->id);
+		if(!strncmp(buf, text, len))
+			return strdup(buf);
+	}
+
+	return NULL;
+}
+
+CMD_TAB_FUNC(job_list)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return job_id_generator(text, state);
+	return NULL;
+}
+
+CMD_TAB_FUNC(job_wait)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return job_id_generator(text, state);
+	return NULL;
+}
+
+CMD_TAB_FUNC(job_cancel)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return job_id_generator(text, state);
+	return NULL;
+}
+
+CMD_TAB_FUNC(job_log)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return job_id_generator(text, state);
+	else if(CAN_COMPLETE_ARG(2))
+		return server_generator(text, state);
+	return NULL;
+}
@@ -5,6 +5,9 @@
 #include "serverinfo.h"
 #include "input.h"
 #include "table.h"
+#include "listquery.h"
+#include "main.h"
+#include "format.h"
 
 static char *jupe_generator(const char *text, int state);
 CMD_FUNC(jupe_list);
@@ -40,13 +43,36 @@ void cmd_jupe_init()
 	cmd_alias("editjupe", "jupe", "edit");
 }
 
+static const struct listquery_column jupe_columns[] = {
+	LISTQUERY_COLUMN("name", "name"),
+	LISTQUERY_COLUMN("nicks", "nicks"),
+	LISTQUERY_COLUMN_END
+};
+
 CMD_FUNC(jupe_list)
 {
 	PGresult *res;
 	int rows;
 	struct table *table;
+	struct listquery lq = { .columns = jupe_columns, .match_expr = "name", .server_cond = "name IN (SELECT jupe FROM jupes2servers WHERE server = %s)", .default_order = "name ASC" };
+	char *query;
+
+	if(listquery_parse(&lq, argc, argv) != 0)
+		return;
+
+	asprintf(&query, "SELECT * FROM jupes%s%s%s", lq.where, lq.order, lq.limit);
+	if(output_format != FORMAT_TABLE)
+	{
+		// Rows are written as they arrive; no table is built at all
+		format_query(query, listquery_params(&lq));
+		free(query);
+		listquery_free(&lq);
+		return;
+	}
 
-	res = pgsql_query("SELECT * FROM jupes ORDER BY name ASC", 1, NULL);
+	res = pgsql_query(query, 1, listquery_params(&lq));
+	free(query);
+	listquery_free(&lq);
 	rows = pgsql_num_rows(res);
 
 	table = table_create(2, rows);
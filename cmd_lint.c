@@ -0,0 +1,232 @@
+#include "common.h"
+#include "cmd.h"
+#include "pgsql.h"
+#include "stringlist.h"
+#include "table.h"
+#include "topology.h"
+#include "event.h"
+
+// Server numerics are two base64 characters in P10
+#define MAX_NUMERIC	4095
+
+CMD_FUNC(lint);
+
+static struct command commands[] = {
+	CMD("lint", lint, "Check the whole network for inconsistencies"),
+	CMD_LIST_END
+};
+
+
+
+void cmd_lint_init()
+{
+	cmd_register_list(commands, NULL);
+}
+
+static void lint_finding(struct table *table, const char *category, const char *object, const char *fmt, ...) PRINTF_LIKE(4,5);
+static void lint_finding(struct table *table, const char *category, const char *object, const char *fmt, ...)
+{
+	unsigned int row = table->rows;
+	va_list args;
+
+	table_col_str(table, row, 0, (char *)category);
+	table_col_str(table, row, 1, strdup(object));
+	va_start(args, fmt);
+	vasprintf(&table->data[row][2], fmt, args);
+	va_end(args);
+}
+
+// Every (ip, port) pair a server listens on, resolved the same way as in
+// the config builder. Sorted so duplicates are next to each other.
+static void lint_ports(struct table *table)
+{
+	PGresult *res;
+	int rows;
+
+	res = pgsql_query("SELECT	name AS server,\
+					server_port AS port,\
+					host(irc_ip_priv) AS ip,\
+					'default server port' AS source\
+			   FROM		servers\
+			   UNION ALL\
+			   SELECT	name,\
+					server_port,\
+					host(irc_ip_priv_local),\
+					'default server port (local IP)'\
+			   FROM		servers\
+			   WHERE	irc_ip_priv_local IS NOT NULL\
+			   UNION ALL\
+			   SELECT	p.server,\
+					p.port,\
+					host(COALESCE(p.ip, CASE WHEN p.flag_server THEN s.irc_ip_priv ELSE s.irc_ip_pub END)),\
+					'port #' || p.id\
+			   FROM		ports p\
+			   JOIN		servers s ON (s.name = p.server)\
+			   ORDER BY	server ASC,\
+					port ASC,\
+					ip ASC,\
+					source ASC",
+			  1, NULL);
+	rows = pgsql_num_rows(res);
+	for(int i = 1; i < rows; i++)
+	{
+		if(strcmp(pgsql_value(res, i, 0), pgsql_value(res, i - 1, 0)) ||
+		   strcmp(pgsql_value(res, i, 1), pgsql_value(res, i - 1, 1)) ||
+		   strcmp(pgsql_value(res, i, 2), pgsql_value(res, i - 1, 2)))
+			continue;
+		lint_finding(table, "Ports", pgsql_value(res, i, 0), "%s:%s is used by %s and %s",
+			     pgsql_value(res, i, 2), pgsql_value(res, i, 1), pgsql_value(res, i - 1, 3), pgsql_value(res, i, 3));
+	}
+
+	pgsql_free(res);
+}
+
+// Servers and services share the numeric space; the numeric is the index
+static void lint_numerics(struct table *table)
+{
+	const char *owners[MAX_NUMERIC + 1];
+	PGresult *res;
+	int rows;
+
+	memset(owners, 0, sizeof(owners));
+	res = pgsql_query("SELECT name, \"numeric\" FROM servers\
+			   UNION ALL\
+			   SELECT name, \"numeric\" FROM services\
+			   ORDER BY 2 ASC, 1 ASC",
+			  1, NULL);
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
+	{
+		const char *name = pgsql_value(res, i, 0);
+		long numeric = atol(pgsql_value(res, i, 1));
+
+		if(numeric < 0 || numeric > MAX_NUMERIC)
+			lint_finding(table, "Numerics", name, "Numeric %ld is not between 0 and %d", numeric, MAX_NUMERIC);
+		else if(owners[numeric])
+			lint_finding(table, "Numerics", name, "Numeric %ld is also used by %s", numeric, owners[numeric]);
+		else
+			owners[numeric] = name;
+	}
+
+	pgsql_free(res);
+}
+
+static void lint_links(struct table *table)
+{
+	struct topology *topo = topology_load();
+	PGresult *res;
+	int rows;
+
+	for(unsigned int i = 0; i < topo->count; i++)
+	{
+		const char *problem = topology_orphan_problem(&topo->nodes[i]);
+		if(problem)
+			lint_finding(table, "Links", topo->nodes[i].name, "%s", problem);
+	}
+
+	topology_free(topo);
+
+	res = pgsql_query("SELECT	l.server,\
+					l.hub,\
+					p.id,\
+					p.server,\
+					p.flag_server\
+			   FROM		links l\
+			   JOIN		ports p ON (p.id = l.port)\
+			   WHERE	p.server <> l.hub OR\
+					NOT p.flag_server\
+			   ORDER BY	l.server ASC,\
+					l.hub ASC",
+			  1, NULL);
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
+	{
+		if(strcmp(pgsql_value(res, i, 1), pgsql_value(res, i, 3)))
+			lint_finding(table, "Links", pgsql_value(res, i, 0), "Link to %s uses port #%s of %s",
+				     pgsql_value(res, i, 1), pgsql_value(res, i, 2), pgsql_value(res, i, 3));
+		else
+			lint_finding(table, "Links", pgsql_value(res, i, 0), "Link to %s uses port #%s which is not a server port",
+				     pgsql_value(res, i, 1), pgsql_value(res, i, 2));
+	}
+
+	pgsql_free(res);
+}
+
+static void lint_clientgroups(struct table *table)
+{
+	PGresult *res;
+	int rows;
+
+	res = pgsql_query("SELECT	cg.server,\
+					cg.name\
+			   FROM		clientgroups cg\
+			   WHERE	NOT EXISTS (SELECT 1 FROM clients cl WHERE cl.\"group\" = cg.name AND cl.server = cg.server)\
+			   ORDER BY	cg.server ASC,\
+					cg.name ASC",
+			  1, NULL);
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
+		lint_finding(table, "Client authorizations", pgsql_value(res, i, 0), "Group %s has no clients", pgsql_value(res, i, 1));
+	pgsql_free(res);
+}
+
+// Opers, jupes and webirc blocks which do not end up in any config
+static const struct {
+	const char *category;
+	const char *problem;
+	const char *query;
+} lint_assignment_rules[] = {
+	{ "Opers", "Not assigned to any server", "SELECT o.name FROM opers o WHERE NOT EXISTS (SELECT 1 FROM opers2servers o2s WHERE o2s.oper = o.name) ORDER BY o.name ASC" },
+	{ "Opers", "No hosts", "SELECT o.name FROM opers o WHERE NOT EXISTS (SELECT 1 FROM operhosts oh WHERE oh.oper = o.name) ORDER BY o.name ASC" },
+	{ "Jupes", "Not assigned to any server", "SELECT j.name FROM jupes j WHERE NOT EXISTS (SELECT 1 FROM jupes2servers j2s WHERE j2s.jupe = j.name) ORDER BY j.name ASC" },
+	{ "WebIRC", "Not assigned to any server", "SELECT w.name FROM webirc w WHERE NOT EXISTS (SELECT 1 FROM webirc2servers w2s WHERE w2s.webirc = w.name) ORDER BY w.name ASC" },
+	{ NULL, NULL, NULL }
+};
+
+static void lint_assignments(struct table *table)
+{
+	for(unsigned int i = 0; lint_assignment_rules[i].category; i++)
+	{
+		PGresult *res = pgsql_query(lint_assignment_rules[i].query, 1, NULL);
+		int rows = pgsql_num_rows(res);
+
+		for(int j = 0; j < rows; j++)
+			lint_finding(table, lint_assignment_rules[i].category, pgsql_value(res, j, 0), "%s", lint_assignment_rules[i].problem);
+		pgsql_free(res);
+	}
+}
+
+CMD_FUNC(lint)
+{
+	unsigned long long start = event_now();
+	struct table *table;
+	int nested;
+
+	// All rules see the same state of the database
+	nested = pgsql_transaction_depth();
+	pgsql_begin();
+	if(!nested)
+		pgsql_query("SET TRANSACTION ISOLATION LEVEL REPEATABLE READ, READ ONLY", 0, NULL);
+
+	table = table_create(3, 0);
+	table_set_header(table, "Category", "Object", "Problem");
+	table_free_column(table, 1, 1);
+	table_free_column(table, 2, 1);
+
+	lint_ports(table);
+	lint_numerics(table);
+	lint_links(table);
+	lint_clientgroups(table);
+	lint_assignments(table);
+	pgsql_commit();
+
+	if(!table->rows)
+		out_color(COLOR_LIME, "No problems found (%llums)", event_now() - start);
+	else
+	{
+		table_send(table);
+		out_color(COLOR_LIGHT_RED, "%u problems found (%llums)", table->rows, event_now() - start);
+	}
+
+	table_free(table);
+}
@@ -7,6 +7,9 @@
 #include "ircd_crypt_smd5.h"
 #include "table.h"
 #include "stringbuffer.h"
+#include "listquery.h"
+#include "main.h"
+#include "format.h"
 #include <search.h>
 
 static const char *prompt_operpass(int allow_none);
@@ -59,6 +62,13 @@ void cmd_oper_init()
 	cmd_alias("opermod", "oper", "mod");
 }
 
+static const struct listquery_column oper_columns[] = {
+	LISTQUERY_COLUMN("name", "lower(o.name)"),
+	LISTQUERY_COLUMN("username", "o.username"),
+	LISTQUERY_COLUMN("connclass", "o.connclass"),
+	LISTQUERY_COLUMN_END
+};
+
 CMD_FUNC(oper_list)
 {
 	struct table *table;
@@ -66,19 +76,41 @@ CMD_FUNC(oper_list)
 	int rows;
 	struct stringbuffer *serverlist = stringbuffer_create();
 	int oper_start_row, oper_table_row;
+	struct listquery lq = { .columns = oper_columns, .match_expr = "o.name", .server_cond = "o.name IN (SELECT oper FROM opers2servers WHERE server = %s)", .default_order = "lower(o.name) ASC" };
+	char *query;
 
-	res = pgsql_query("SELECT	o.name,\
+	if(listquery_parse(&lq, argc, argv) != 0)
+	{
+		stringbuffer_free(serverlist);
+		return;
+	}
+
+	// Filter and paginate the opers themselves, not their server rows
+	asprintf(&query, "SELECT	o.name,\
 					o.username,\
 					o.connclass,\
 					o.priv_local AS oper_local,\
 					c.priv_local AS class_local,\
 					split_part(o2s.server, '.', 1) AS server\
-			   FROM		opers o\
+			   FROM		(SELECT * FROM opers o%s%s%s) o\
 			   JOIN		connclasses_users c ON (c.name = o.connclass)\
 			   LEFT JOIN	opers2servers o2s ON (o2s.oper = o.name)\
-			   ORDER BY	lower(o.name) ASC,\
+			   %s,\
 			   		o2s.server ASC",
-			  1, NULL);
+		 lq.where, lq.order, lq.limit, lq.order);
+	if(output_format != FORMAT_TABLE)
+	{
+		// Rows are written as they arrive; no table is built at all
+		format_query(query, listquery_params(&lq));
+		free(query);
+		listquery_free(&lq);
+		stringbuffer_free(serverlist);
+		return;
+	}
+
+	res = pgsql_query(query, 1, listquery_params(&lq));
+	free(query);
+	listquery_free(&lq);
 	rows = pgsql_num_rows(res);
 
 	table = table_create(5, 0);
@@ -157,6 +189,33 @@ CMD_FUNC(oper_info)
 		return;
 	}
 
+	// Machine-readable output is a single row with the privileges as stored (-1 = inherited)
+	if(output_format != FORMAT_TABLE)
+	{
+		if(!format_query("SELECT	o.name,\
+						o.username,\
+						split_part(o.password, '$', 2) AS encryption,\
+						o.connclass,\
+						o.active,\
+						o.priv_local,\
+						o.priv_umode_nochan,\
+						o.priv_umode_noidle,\
+						o.priv_umode_chserv,\
+						o.priv_notargetlimit,\
+						o.priv_flood,\
+						o.priv_pseudoflood,\
+						o.priv_gline_immune,\
+						o.priv_die,\
+						o.priv_restart,\
+						(SELECT string_agg(mask, ',' ORDER BY mask) FROM operhosts WHERE oper = o.name) AS hostmasks,\
+						(SELECT string_agg(server, ',' ORDER BY server) FROM opers2servers WHERE oper = o.name) AS servers\
+				 FROM	opers o\
+				 WHERE	lower(o.name) = lower($1)",
+				 stringlist_build(argv[1], NULL)))
+			error("An oper named `%s' does not exist", argv[1]);
+		return;
+	}
+
 	res = pgsql_query("SELECT	o.name,\
 					o.username,\
 					split_part(o.password, '$', 2) AS encryption,\
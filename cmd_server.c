@@ -2,10 +2,14 @@
 #include "cmd.h"
 #include "pgsql.h"
 #include "stringlist.h"
+#include "arena.h"
 #include "serverinfo.h"
 #include "stringbuffer.h"
 #include "input.h"
 #include "table.h"
+#include "listquery.h"
+#include "main.h"
+#include "format.h"
 #include "conf.h"
 #include "ssh.h"
 #include "configs.h"
@@ -91,6 +95,9 @@ void cmd_server_init()
 	cmd_alias("install", "server", "install");
 	cmd_alias("addport", "server", "addport");
 	cmd_alias("delport", "server", "delport");
+	cmd_background("server", "install", CMD_JOB_SERVER);
+	cmd_background("exec", NULL, CMD_JOB_SERVER | CMD_JOB_SERVER_STAR);
+	cmd_background("putfile", NULL, CMD_JOB_SERVER | CMD_JOB_SERVER_STAR);
 }
 
 CMD_FUNC(server_info)
@@ -112,6 +119,24 @@ CMD_FUNC(server_info)
 		return;
 	}
 
+	// Machine-readable output is a single row; related objects are comma-separated
+	if(output_format != FORMAT_TABLE)
+	{
+		format_query("SELECT	s.*,\
+					(SELECT string_agg(hub, ',' ORDER BY hub) FROM links WHERE server = s.name) AS hubs,\
+					(SELECT string_agg(server, ',' ORDER BY server) FROM links WHERE hub = s.name) AS hub_for,\
+					(SELECT string_agg(port || COALESCE('@' || host(ip), ''), ',' ORDER BY port, ip) FROM ports WHERE server = s.name) AS ports,\
+					(SELECT string_agg(oper, ',' ORDER BY oper) FROM opers2servers WHERE server = s.name) AS opers,\
+					(SELECT string_agg(name, ',' ORDER BY name) FROM clientgroups WHERE server = s.name) AS clientgroups,\
+					(SELECT string_agg(jupe, ',' ORDER BY jupe) FROM jupes2servers WHERE server = s.name) AS jupes,\
+					(SELECT string_agg(webirc, ',' ORDER BY webirc) FROM webirc2servers WHERE server = s.name) AS webirc\
+			     FROM	servers s\
+			     WHERE	s.name = $1",
+			     stringlist_build(server->name, NULL));
+		serverinfo_free(server);
+		return;
+	}
+
 	// Common information
 	serverinfo_show(server);
 	putc('\n', stdout);
@@ -247,22 +272,49 @@ CMD_FUNC(server_info)
 	serverinfo_free(server);
 }
 
+static const struct listquery_column server_columns[] = {
+	LISTQUERY_COLUMN("name", "s.name"),
+	LISTQUERY_COLUMN("type", "s.type"),
+	LISTQUERY_COLUMN("numeric", "s.numeric"),
+	LISTQUERY_COLUMN("contact", "s.contact"),
+	LISTQUERY_COLUMN("uplinks", "COUNT(l.server)"),
+	LISTQUERY_COLUMN_END
+};
+
 CMD_FUNC(server_list)
 {
 	struct table *table;
 	PGresult *res;
 	int rows;
+	struct listquery lq = { .columns = server_columns, .match_expr = "s.name", .default_order = "s.name ASC" };
+	char *query;
 
-	res = pgsql_query("SELECT	s.name,\
+	if(listquery_parse(&lq, argc, argv) != 0)
+		return;
+
+	asprintf(&query, "SELECT	s.name,\
 					s.type,\
 					s.numeric,\
 					s.contact,\
 					COUNT(l.server) AS uplinks\
 			   FROM		servers s\
 			   LEFT JOIN	links l ON (l.server = s.name)\
+			   %s\
 			   GROUP BY	s.name, s.type, s.numeric, s.contact\
-			   ORDER BY	s.name ASC",
-			  1, NULL);
+			   %s%s",
+		 lq.where, lq.order, lq.limit);
+	if(output_format != FORMAT_TABLE)
+	{
+		// Rows are written as they arrive; no table is built at all
+		format_query(query, listquery_params(&lq));
+		free(query);
+		listquery_free(&lq);
+		return;
+	}
+
+	res = pgsql_query(query, 1, listquery_params(&lq));
+	free(query);
+	listquery_free(&lq);
 	rows = pgsql_num_rows(res);
 
 	table = table_create(5, rows);
@@ -1172,8 +1224,11 @@ CMD_FUNC(exec)
 		return;
 	}
 
+	ssh_prefetch_servers(res);
+	struct arena_mark mark = arena_mark(arena_current);
 	for(int i = 0; i < rows; i++)
 	{
+		arena_release(arena_current, mark);
 		struct server_info *server = serverinfo_load_pg(res, i);
 		out_color(COLOR_BROWN, "[%s] %s", server->name, tmp[2]);
 		if(!(session = ssh_open(server)))
@@ -1229,8 +1284,11 @@ CMD_FUNC(putfile)
 		return;
 	}
 
+	ssh_prefetch_servers(res);
+	struct arena_mark mark = arena_mark(arena_current);
 	for(int i = 0; i < rows; i++)
 	{
+		arena_release(arena_current, mark);
 		struct server_info *server = serverinfo_load_pg(res, i);
 		out_color(COLOR_BROWN, "Uploading to %s", server->name);
 		if(!(session = ssh_open(server)))
@@ -1272,8 +1330,11 @@ CMD_FUNC(connect)
 		return;
 	}
 
+	ssh_prefetch_servers(res);
+	struct arena_mark mark = arena_mark(arena_current);
 	for(int i = 0; i < rows; i++)
 	{
+		arena_release(arena_current, mark);
 		struct server_info *server = serverinfo_load_pg(res, i);
 		out_color(COLOR_BROWN, "Opening SSH connection to %s", server->name);
 		if((session = ssh_open(server)))
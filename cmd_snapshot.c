@@ -0,0 +1,125 @@
+#include "common.h"
+#include "cmd.h"
+#include "main.h"
+#include "pgsql.h"
+#include "stringlist.h"
+#include "serverinfo.h"
+#include "buildconf.h"
+#include "snapshot.h"
+#include "format.h"
+#include "arena.h"
+
+CMD_FUNC(snapshot_export);
+
+// Read-only commands whose queries are recorded; the ones taking a server
+// are run for every server, too
+static const char *snapshot_commands[] = {
+	"servers", "links", "classes", "clients", "features", "forwards", "jupes",
+	"opers", "pseudos", "services", "webircs", "topology", "lint", NULL
+};
+
+static const char *snapshot_server_commands[] = {
+	"serverinfo", "clients", "jupes", "opers", "webircs", NULL
+};
+
+static struct command commands[] = {
+	CMD_STUB("snapshot", "Offline Snapshots"),
+	CMD_LIST_END
+};
+
+static struct command subcommands[] = {
+	// "snapshot" subcommands
+	CMD("export", snapshot_export, "Write a snapshot for --offline"),
+	CMD_LIST_END
+};
+
+
+
+void cmd_snapshot_init()
+{
+	cmd_register_list(commands, NULL);
+	cmd_register_list(subcommands, "snapshot");
+}
+
+CMD_FUNC(snapshot_export)
+{
+	PGresult *res;
+	FILE *devnull;
+	int rows, count, nested, saved_stdout, saved_format = output_format;
+
+	if(argc < 2)
+	{
+		out("Usage: snapshot export <file>");
+		return;
+	}
+
+	if(snapshot_offline())
+	{
+		error("Snapshots can only be exported from the database");
+		return;
+	}
+
+	if(!(devnull = fopen("/dev/null", "w")))
+	{
+		error("Could not open /dev/null: %s", strerror(errno));
+		return;
+	}
+
+	// All queries see the same state of the database; inside a script the
+	// transaction of the script is used
+	nested = pgsql_transaction_depth();
+	pgsql_begin();
+	if(!nested)
+		pgsql_query("SET TRANSACTION ISOLATION LEVEL REPEATABLE READ, READ ONLY", 0, NULL);
+	snapshot_record_start();
+
+	// The commands are only run for their queries
+	out("Recording the read-only commands and config builds...");
+	fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	dup2(fileno(devnull), STDOUT_FILENO);
+	output_format = FORMAT_TABLE;
+
+	for(unsigned int i = 0; snapshot_commands[i]; i++)
+		handle_line(snapshot_commands[i]);
+	pgsql_free(pgsql_query(SNAPSHOT_SERVERS_QUERY, 1, NULL));
+
+	res = pgsql_query("SELECT * FROM servers ORDER BY name ASC", 1, NULL);
+	rows = pgsql_num_rows(res);
+	struct arena_mark mark = arena_mark(arena_current);
+	for(int i = 0; i < rows; i++)
+	{
+		char line[256];
+
+		arena_release(arena_current, mark);
+		for(unsigned int j = 0; snapshot_server_commands[j]; j++)
+		{
+			snprintf(line, sizeof(line), "%s %s", snapshot_server_commands[j], pgsql_nvalue(res, i, "name"));
+			handle_line(line);
+		}
+
+		// serverinfo has a query of its own for --format tsv/jsonl
+		output_format = FORMAT_JSONL;
+		snprintf(line, sizeof(line), "serverinfo %s", pgsql_nvalue(res, i, "name"));
+		handle_line(line);
+		output_format = FORMAT_TABLE;
+
+		// Same lookup as `buildconfs <server>'
+		pgsql_query("SELECT * FROM servers WHERE lower(name) = lower($1)", 0, stringlist_build(pgsql_nvalue(res, i, "name"), NULL));
+		struct server_info *server = serverinfo_load_pg(res, i);
+		config_build_file(server, devnull);
+		serverinfo_free(server);
+	}
+
+	pgsql_free(res);
+	fflush(stdout);
+	fflush(devnull);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	fclose(devnull);
+	output_format = saved_format;
+	pgsql_commit();
+
+	if((count = snapshot_record_finish(argv[1])) >= 0)
+		out_color(COLOR_LIME, "Snapshot with %d query results written to `%s'", count, argv[1]);
+}
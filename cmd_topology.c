@@ -0,0 +1,267 @@
+#include "common.h"
+#include "cmd.h"
+#include "stringlist.h"
+#include "stringbuffer.h"
+#include "ptrlist.h"
+#include "serverinfo.h"
+#include "input.h"
+#include "table.h"
+#include "tokenize.h"
+#include "topology.h"
+
+static void topology_link_info(struct stringbuffer *buf, struct topo_link *link);
+static void topology_show_node(struct topology *topo, struct topo_node *node, struct topo_link *link, struct stringbuffer *prefix, int last, unsigned char *shown);
+CMD_FUNC(topology);
+CMD_TAB_FUNC(topology);
+CMD_FUNC(path);
+CMD_TAB_FUNC(path);
+CMD_FUNC(spof);
+CMD_FUNC(orphans);
+
+static struct command commands[] = {
+	CMD_TC("topology", topology, "Show the network as a tree"),
+	CMD_TC("path", path, "Show the route between two servers"),
+	CMD("spof", spof, "Show servers whose loss splits the network"),
+	CMD("orphans", orphans, "Show servers without an autoconnect uplink"),
+	CMD_LIST_END
+};
+
+
+
+void cmd_topology_init()
+{
+	cmd_register_list(commands, NULL);
+}
+
+static void topology_link_info(struct stringbuffer *buf, struct topo_link *link)
+{
+	if(link->ip)
+		stringbuffer_append_printf(buf, " (%s:%u)", link->ip, link->port);
+	else if(link->port)
+		stringbuffer_append_printf(buf, " (port %u)", link->port);
+	if(!link->autoconnect)
+		stringbuffer_append_string(buf, " [no autoconnect]");
+}
+
+// Servers are shown below their primary uplink; other uplinks are listed
+// next to their name. shown is indexed like topo->nodes and keeps cycles of
+// uplinks from being followed forever.
+static void topology_show_node(struct topology *topo, struct topo_node *node, struct topo_link *link, struct stringbuffer *prefix, int last, unsigned char *shown)
+{
+	struct stringbuffer *line = stringbuffer_create();
+	struct topo_node *children[max(node->link_count, 1)];
+	unsigned int count = 0, prefix_len = prefix->len;
+	const char *color = COLOR_WHITE;
+	int first_other = 1;
+
+	shown[node - topo->nodes] = 1;
+	stringbuffer_append_string(line, prefix->len ? prefix->string : "");
+	if(link)
+		stringbuffer_append_string(line, last ? "`- " : "|- ");
+	stringbuffer_append_string(line, node->name);
+	if(node->service)
+		stringbuffer_append_string(line, " (service)");
+	else if(node->type)
+	{
+		struct server_info info = { .type = node->type };
+		stringbuffer_append_printf(line, " (%s)", serverinfo_name_from_type(&info));
+	}
+
+	if(link)
+	{
+		topology_link_info(line, link);
+		color = link->autoconnect ? COLOR_CYAN : COLOR_GRAY;
+	}
+
+	for(unsigned int i = 0; i < node->link_count; i++)
+	{
+		struct topo_link *other = &node->links[i];
+
+		if(other->uplink && (!link || other->peer != link->peer))
+		{
+			stringbuffer_append_string(line, first_other ? ", also linked to " : ", ");
+			stringbuffer_append_string(line, other->peer->name);
+			first_other = 0;
+		}
+		else if(!other->uplink && !shown[other->peer - topo->nodes] && topology_primary_uplink(other->peer) == node)
+			children[count++] = other->peer;
+	}
+
+	out_color(color, "%s", line->string);
+	stringbuffer_free(line);
+
+	if(link)
+		stringbuffer_append_string(prefix, last ? "   " : "|  ");
+	for(unsigned int i = 0; i < count; i++)
+		topology_show_node(topo, children[i], topology_link(children[i], node), prefix, i == count - 1, shown);
+	if(prefix->len > prefix_len)
+		stringbuffer_erase(prefix, prefix_len, prefix->len - prefix_len);
+}
+
+CMD_FUNC(topology)
+{
+	struct topology *topo = topology_load();
+	struct stringbuffer *prefix = stringbuffer_create();
+	unsigned char *shown = calloc(max(topo->count, 1), 1);
+
+	if(argc > 1)
+	{
+		struct topo_node *node = topology_find(topo, argv[1]);
+		if(!node)
+			error("A server named `%s' does not exist", argv[1]);
+		else
+			topology_show_node(topo, node, NULL, prefix, 1, shown);
+	}
+	else
+	{
+		// The top of the network first, then servers whose uplinks form a cycle
+		for(int pass = 0; pass < 2; pass++)
+		{
+			for(unsigned int i = 0; i < topo->count; i++)
+			{
+				struct topo_node *node = &topo->nodes[i];
+				if(!shown[i] && !node->service && (pass || !topology_primary_uplink(node)))
+					topology_show_node(topo, node, NULL, prefix, 1, shown);
+			}
+		}
+	}
+
+	free(shown);
+	stringbuffer_free(prefix);
+	topology_free(topo);
+}
+
+CMD_TAB_FUNC(topology)
+{
+	if(CAN_COMPLETE_ARG(1))
+		return server_generator(text, state);
+	return NULL;
+}
+
+CMD_FUNC(path)
+{
+	struct topology *topo;
+	struct topo_node *from, *to, **path;
+	unsigned int count;
+
+	if(argc < 3)
+	{
+		out("Usage: path <server> <server>");
+		return;
+	}
+
+	topo = topology_load();
+	if(!(from = topology_find(topo, argv[1])) || !(to = topology_find(topo, argv[2])))
+	{
+		error("A server named `%s' does not exist", from ? argv[2] : argv[1]);
+		topology_free(topo);
+		return;
+	}
+
+	path = malloc(max(topo->count, 1) * sizeof(struct topo_node *));
+	if(!(count = topology_path(topo, from, to, 1, path)))
+	{
+		if(!(count = topology_path(topo, from, to, 0, path)))
+		{
+			error("There is no route from `%s' to `%s'", from->name, to->name);
+			free(path);
+			topology_free(topo);
+			return;
+		}
+
+		out_color(COLOR_YELLOW, "There is no route using autoconnect links only");
+	}
+
+	out("Route from %s to %s (%u %s):", from->name, to->name, count - 1, count == 2 ? "hop" : "hops");
+	out_color(COLOR_WHITE, "  %s", path[0]->name);
+	for(unsigned int i = 1; i < count; i++)
+	{
+		struct stringbuffer *line = stringbuffer_create();
+		struct topo_link *link = topology_link(path[i - 1], path[i]);
+
+		// -> goes up to a hub, <- down to a server linked to it
+		stringbuffer_append_printf(line, "  %s %s", link->uplink ? "->" : "<-", path[i]->name);
+		topology_link_info(line, link);
+		out_color(link->autoconnect ? COLOR_CYAN : COLOR_GRAY, "%s", line->string);
+		stringbuffer_free(line);
+	}
+
+	free(path);
+	topology_free(topo);
+}
+
+CMD_TAB_FUNC(path)
+{
+	if(CAN_COMPLETE_ARG(1) || CAN_COMPLETE_ARG(2))
+		return server_generator(text, state);
+	return NULL;
+}
+
+CMD_FUNC(spof)
+{
+	struct topology *topo = topology_load();
+	struct ptrlist *spofs = topology_spof(topo);
+	struct table *table;
+
+	if(!spofs->count)
+	{
+		out_color(COLOR_LIME, "The loss of a single server does not split the network");
+		ptrlist_free(spofs);
+		topology_free(topo);
+		return;
+	}
+
+	table = table_create(3, spofs->count);
+	table_set_header(table, "Server", "Split off", "Servers");
+	table_free_column(table, 1, 1);
+	table_ralign_column(table, 1, 1);
+	table_free_column(table, 2, 1);
+	for(unsigned int i = 0; i < spofs->count; i++)
+	{
+		struct topo_spof *spof = spofs->data[i]->ptr;
+		table_col_str(table, i, 0, spof->node->name);
+		table_col_num(table, i, 1, spof->cut_off->count);
+		table_col_str(table, i, 2, untokenize(spof->cut_off->count, spof->cut_off->data, ", "));
+	}
+
+	table_send(table);
+	table_free(table);
+	ptrlist_free(spofs);
+	topology_free(topo);
+}
+
+CMD_FUNC(orphans)
+{
+	struct topology *topo = topology_load();
+	struct table *table;
+	unsigned int count = 0, row = 0;
+
+	for(unsigned int i = 0; i < topo->count; i++)
+	{
+		if(topology_orphan_problem(&topo->nodes[i]))
+			count++;
+	}
+
+	if(!count)
+	{
+		out_color(COLOR_LIME, "All servers have an autoconnect uplink");
+		topology_free(topo);
+		return;
+	}
+
+	table = table_create(2, count);
+	table_set_header(table, "Server", "Problem");
+	for(unsigned int i = 0; i < topo->count; i++)
+	{
+		const char *problem = topology_orphan_problem(&topo->nodes[i]);
+		if(!problem)
+			continue;
+		table_col_str(table, row, 0, topo->nodes[i].name);
+		table_col_str(table, row, 1, (char *)problem);
+		row++;
+	}
+
+	table_send(table);
+	table_free(table);
+	topology_free(topo);
+}
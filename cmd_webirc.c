@@ -5,6 +5,9 @@
 #include "serverinfo.h"
 #include "input.h"
 #include "table.h"
+#include "listquery.h"
+#include "main.h"
+#include "format.h"
 
 static char *webirc_generator(const char *text, int state);
 CMD_FUNC(webirc_list);
@@ -39,13 +42,38 @@ void cmd_webirc_init()
 	cmd_alias("editwebirc", "webirc", "edit");
 }
 
+static const struct listquery_column webirc_columns[] = {
+	LISTQUERY_COLUMN("name", "name"),
+	LISTQUERY_COLUMN("ip", "ip"),
+	LISTQUERY_COLUMN("ident", "ident"),
+	LISTQUERY_COLUMN("description", "description"),
+	LISTQUERY_COLUMN_END
+};
+
 CMD_FUNC(webirc_list)
 {
 	PGresult *res;
 	int rows;
 	struct table *table;
+	struct listquery lq = { .columns = webirc_columns, .match_expr = "name", .server_cond = "name IN (SELECT webirc FROM webirc2servers WHERE server = %s)", .default_order = "name ASC" };
+	char *query;
+
+	if(listquery_parse(&lq, argc, argv) != 0)
+		return;
+
+	asprintf(&query, "SELECT * FROM webirc%s%s%s", lq.where, lq.order, lq.limit);
+	if(output_format != FORMAT_TABLE)
+	{
+		// Rows are written as they arrive; no table is built at all
+		format_query(query, listquery_params(&lq));
+		free(query);
+		listquery_free(&lq);
+		return;
+	}
 
-	res = pgsql_query("SELECT * FROM webirc ORDER BY name ASC", 1, NULL);
+	res = pgsql_query(query, 1, listquery_params(&lq));
+	free(query);
+	listquery_free(&lq);
 	rows = pgsql_num_rows(res);
 
 	table = table_create(6, rows);
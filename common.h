@@ -66,6 +66,7 @@
 #define ArraySize(ARRAY)		(sizeof((ARRAY)) / sizeof((ARRAY)[0]))
 #define xfree(PTR)	do { if(PTR) free(PTR); } while(0)
 
+#include "memstats.h"
 #include "tools.h"
 #include "dict.h"
 
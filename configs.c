@@ -8,8 +8,20 @@
 #include "input.h"
 #include "buildconf.h"
 #include "stringlist.h"
+#include "arena.h"
+#include "event.h"
+#include "job.h"
+#include "topology.h"
+#include "ptrlist.h"
+#include "tokenize.h"
+
+// Name of the staged config next to the live one (two-phase commit)
+#define CONFIG_STAGED	"ircd.conf.staged"
 
 static int config_generate_server(struct server_info *server);
+static const char *config_ircd_path();
+static void config_unstage(struct stringlist *servers);
+static int config_switch(struct stringlist *servers, int rehash);
 
 // Note: This function may only use server->name since config_rename()
 // passes a struct server_info which has only this field set!
@@ -107,7 +119,14 @@ int config_download(struct server_info *server, struct ssh_session *session)
 	return 0;
 }
 
-int config_upload(struct server_info *server, struct ssh_session *session, enum config_type type)
+static const char *config_ircd_path()
+{
+	const char *ircd_path = conf_str("ircd_path");
+	return ircd_path ? ircd_path : "ircu";
+}
+
+// Uploads a config as ircd_path/lib/<remote_name>
+static int config_upload_as(struct server_info *server, struct ssh_session *session, enum config_type type, const char *remote_name)
 {
 	int close_session = 0;
 	char *ircd_path, path[PATH_MAX];
@@ -132,7 +151,7 @@ int config_upload(struct server_info *server, struct ssh_session *session, enum
 	}
 
 	debug("Uploading config to `%s'", server->name);
-	snprintf(path, sizeof(path), "%s/lib/ircd.conf", ircd_path);
+	snprintf(path, sizeof(path), "%s/lib/%s", ircd_path, remote_name);
 	if(ssh_scp_put(session, config_filename(server, type), path, 0600) != 0)
 	{
 		if(close_session)
@@ -145,6 +164,165 @@ int config_upload(struct server_info *server, struct ssh_session *session, enum
 	return 0;
 }
 
+int config_upload(struct server_info *server, struct ssh_session *session, enum config_type type)
+{
+	return config_upload_as(server, session, type, "ircd.conf");
+}
+
+// Uploads the new config next to the live one and verifies its checksum;
+// config_switch() moves it into place later
+int config_stage(struct server_info *server)
+{
+	struct ssh_session *session;
+	unsigned long long size, remote_size;
+	unsigned int crc, remote_crc;
+	char cmd[PATH_MAX], *output = NULL;
+	int ret = 1;
+
+	if(file_cksum(config_filename(server, CONFIG_NEW), &crc, &size) != 0)
+	{
+		error("Could not read new ircd.conf for `%s': %s (%d)", server->name, strerror(errno), errno);
+		return 1;
+	}
+
+	if(!(session = ssh_open(server)))
+		return 1;
+
+	snprintf(cmd, sizeof(cmd), "cksum < ~/%s/lib/%s", config_ircd_path(), CONFIG_STAGED);
+	if(config_upload_as(server, session, CONFIG_NEW, CONFIG_STAGED) != 0)
+		error("Could not stage ircd.conf on `%s'", server->name);
+	else if(ssh_exec(session, cmd, &output) != 0 || sscanf(output, "%u %llu", &remote_crc, &remote_size) != 2)
+		error("Could not verify the staged ircd.conf on `%s'", server->name);
+	else if(remote_crc != crc || remote_size != size)
+		error("Staged ircd.conf on `%s' is corrupt: checksum %u/%llu bytes, expected %u/%llu bytes", server->name, remote_crc, remote_size, crc, size);
+	else
+	{
+		out_color(COLOR_LIME, "ircd.conf staged on `%s' (checksum %u)", server->name, crc);
+		ret = 0;
+	}
+
+	xfree(output);
+	ssh_close(session);
+	return ret;
+}
+
+// Removes the staged configs after a failed two-phase commit
+static void config_unstage(struct stringlist *servers)
+{
+	char cmd[PATH_MAX];
+
+	snprintf(cmd, sizeof(cmd), "rm -f ~/%s/lib/%s", config_ircd_path(), CONFIG_STAGED);
+	for(unsigned int i = 0; i < servers->count; i++)
+	{
+		struct server_info *server;
+		struct ssh_session *session;
+
+		if(!(server = serverinfo_load(servers->data[i])))
+			continue;
+		if((session = ssh_open(server)))
+		{
+			ssh_exec(session, cmd, NULL);
+			ssh_close(session);
+		}
+		serverinfo_free(server);
+	}
+}
+
+static int config_switch_line(const char *line, size_t len, void *ctx)
+{
+	out("%s", line);
+	return 0;
+}
+
+// Moves the staged configs into place (and rehashes) on all servers at the
+// same time. All sessions are opened first so the commands are started
+// right after each other. Returns the number of servers which failed.
+static int config_switch(struct stringlist *servers, int rehash)
+{
+	struct server_info *infos[servers->count];
+	struct ssh_session *sessions[servers->count];
+	struct ssh_exec *execs[servers->count];
+	unsigned int count = servers->count, failed = 0;
+	unsigned long long started;
+	char cmd[PATH_MAX];
+
+	memset(infos, 0, sizeof(infos));
+	memset(sessions, 0, sizeof(sessions));
+	memset(execs, 0, sizeof(execs));
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if((infos[i] = serverinfo_load(servers->data[i])))
+			ssh_prefetch(infos[i]->ssh_host);
+	}
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(!infos[i] || !(sessions[i] = ssh_open(infos[i])))
+		{
+			error("Could not connect to `%s'; no server has been switched", servers->data[i]);
+			failed = count;
+			goto out;
+		}
+	}
+
+	// Exit code 3: switched, but the ircd does not seem to be running
+	if(rehash)
+		snprintf(cmd, sizeof(cmd), "cd ~/%s/lib && mv -f %s ircd.conf && if [ -f ircd.pid ]; then kill -HUP `cat ircd.pid`; else exit 3; fi", config_ircd_path(), CONFIG_STAGED);
+	else
+		snprintf(cmd, sizeof(cmd), "cd ~/%s/lib && mv -f %s ircd.conf", config_ircd_path(), CONFIG_STAGED);
+
+	// Start the command everywhere before reading any output
+	started = event_now();
+	for(unsigned int i = 0; i < count; i++)
+		execs[i] = ssh_exec_async(sessions[i], cmd);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		int res;
+
+		if(!execs[i])
+		{
+			error("Could not switch ircd.conf on `%s'", servers->data[i]);
+			failed++;
+			continue;
+		}
+
+		out_prefix("\033[" COLOR_BROWN "m[%s]\033[0m ", servers->data[i]);
+		ssh_exec_lines(execs[i], config_switch_line, NULL);
+		out_prefix(NULL);
+		res = ssh_exec_close(execs[i]);
+		if(res == 0 || res == 3)
+		{
+			if(rename(config_filename(infos[i], CONFIG_NEW), config_filename(infos[i], CONFIG_LIVE)) != 0)
+				error("Could not rename new config file: %s (%d)", strerror(errno), errno);
+		}
+
+		if(res == 0)
+			out_color(COLOR_LIME, "[%s] ircd.conf switched%s", servers->data[i], rehash ? " and rehashed" : "");
+		else if(res == 3)
+			out_color(COLOR_YELLOW, "[%s] ircd.conf switched; ircd.pid not found, use `rehash %s' to rehash the server", servers->data[i], servers->data[i]);
+		else
+		{
+			error("[%s] Could not switch ircd.conf (exit code %d)", servers->data[i], res);
+			failed++;
+		}
+	}
+
+	out("Switched %u/%u servers in %llums", count - failed, count, event_now() - started);
+
+out:
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(sessions[i])
+			ssh_close(sessions[i]);
+		if(infos[i])
+			serverinfo_free(infos[i]);
+	}
+
+	return failed;
+}
+
 // Regenerate local configs
 void config_generate(const char *server)
 {
@@ -156,8 +334,11 @@ void config_generate(const char *server)
 	else
 		res = pgsql_query("SELECT * FROM servers ORDER BY name ASC", 1, NULL);
 	rows = pgsql_num_rows(res);
+	struct arena_mark mark = arena_mark(arena_current);
 	for(int i = 0; i < rows; i++)
 	{
+		// Release the previous server's records and query parameters
+		arena_release(arena_current, mark);
 		struct server_info *server = serverinfo_load_pg(res, i);
 		config_build(server);
 		serverinfo_free(server);
@@ -213,8 +394,11 @@ void config_check_remote(const char *server)
 	else
 		res = pgsql_query("SELECT * FROM servers ORDER BY name ASC", 1, NULL);
 	rows = pgsql_num_rows(res);
+	ssh_prefetch_servers(res);
+	struct arena_mark mark = arena_mark(arena_current);
 	for(int i = 0; i < rows; i++)
 	{
+		arena_release(arena_current, mark);
 		struct server_info *server = serverinfo_load_pg(res, i);
 		config_check_remote_server(server, CONFIG_LIVE, 0, 0, NULL);
 		serverinfo_free(server);
@@ -234,8 +418,11 @@ void config_check_local(const char *server, int check_remote, int auto_update, i
 	else
 		res = pgsql_query("SELECT * FROM servers ORDER BY name ASC", 1, NULL);
 	rows = pgsql_num_rows(res);
+	ssh_prefetch_servers(res);
+	struct arena_mark mark = arena_mark(arena_current);
 	for(int i = 0; i < rows; i++)
 	{
+		arena_release(arena_current, mark);
 		struct server_info *server = serverinfo_load_pg(res, i);
 		struct ssh_session *session = NULL;
 		int rehash_manually = 1;
@@ -333,6 +520,232 @@ void config_check_local(const char *server, int check_remote, int auto_update, i
 	pgsql_free(res);
 }
 
+// Shows the differences of all new configs and returns the servers which
+// need to be updated; the new configs of the others are removed
+static struct stringlist *config_find_changed(const char *server, int check_remote)
+{
+	struct stringlist *changed = stringlist_create();
+	PGresult *res;
+	int rows;
+
+	if(server)
+		res = pgsql_query("SELECT * FROM servers WHERE lower(name) = lower($1)", 1, stringlist_build(server, NULL));
+	else
+		res = pgsql_query("SELECT * FROM servers ORDER BY name ASC", 1, NULL);
+	rows = pgsql_num_rows(res);
+	ssh_prefetch_servers(res);
+	struct arena_mark mark = arena_mark(arena_current);
+	for(int i = 0; i < rows; i++)
+	{
+		arena_release(arena_current, mark);
+		struct server_info *server = serverinfo_load_pg(res, i);
+		struct ssh_session *session;
+		int update_conf = 1;
+
+		out_prefix("\033[" COLOR_BROWN "m[%s]\033[0m ", server->name);
+
+		if(!file_exists(config_filename(server, CONFIG_NEW)))
+		{
+			out_color(COLOR_LIME, "New ircd.conf does not exist");
+			serverinfo_free(server);
+			continue;
+		}
+
+		if(file_exists(config_filename(server, CONFIG_LIVE)) &&
+		   diff(config_filename(server, CONFIG_LIVE), config_filename(server, CONFIG_NEW), 1) == 0)
+			update_conf = 0;
+
+		if(!update_conf && check_remote)
+		{
+			if(!(session = ssh_open(server)))
+			{
+				serverinfo_free(server);
+				continue;
+			}
+
+			if(!config_check_remote_server(server, CONFIG_NEW, 1, 1, session))
+			{
+				out_color(COLOR_YELLOW, "ircd.conf needs to be updated");
+				diff(config_filename(server, CONFIG_REMOTE), config_filename(server, CONFIG_NEW), 0);
+				update_conf = 1;
+			}
+
+			unlink(config_filename(server, CONFIG_REMOTE));
+			ssh_close(session);
+		}
+		else if(update_conf)
+		{
+			out_color(COLOR_YELLOW, "ircd.conf needs to be updated");
+			diff(config_filename(server, CONFIG_LIVE), config_filename(server, CONFIG_NEW), 0);
+		}
+
+		if(!update_conf)
+		{
+			out_color(COLOR_LIME, "ircd.conf matches the old version");
+			unlink(config_filename(server, CONFIG_NEW));
+		}
+		else
+			stringlist_add(changed, strdup(server->name));
+
+		serverinfo_free(server);
+	}
+
+	out_prefix(NULL);
+	pgsql_free(res);
+	return changed;
+}
+
+// Two-phase commit: the changed configs are staged on all servers in
+// parallel (one `conf stage' job unit per server) and only if that worked
+// everywhere they are switched at once, so the network does not run mixed
+// config versions (e.g. link passwords) for longer than necessary.
+void config_commit_two_phase(const char *server, int check_remote, int auto_update, int auto_rehash)
+{
+	struct stringlist *changed, *lines;
+	struct job *job;
+	int rehash;
+
+	if(job_child)
+	{
+		error("--two-phase cannot be used in a background job");
+		return;
+	}
+
+	changed = config_find_changed(server, check_remote);
+	lines = stringlist_create();
+	for(unsigned int i = 0; i < changed->count; i++)
+	{
+		char *line;
+		asprintf(&line, "conf stage %s", changed->data[i]);
+		stringlist_add(lines, line);
+	}
+
+	if(!changed->count)
+	{
+		out("No config needs to be updated");
+		goto out;
+	}
+
+	if(!auto_update && !readline_yesno("Stage the new configs now?", "Yes"))
+		goto out;
+
+	// Phase 1: upload and verify everywhere; nothing is live yet
+	job = job_create("conf stage", changed, lines);
+	out("Staging ircd.conf on %u servers (job %u)", changed->count, job->id);
+	if(job_wait(job) != 0)
+	{
+		job_cancel(job);
+		error("Interrupted; the configs have not been switched");
+		config_unstage(changed);
+		goto out;
+	}
+
+	if(job->failed || job->cancelled)
+	{
+		for(unsigned int i = 0; i < job->count; i++)
+		{
+			if(job->units[i].state != JOB_DONE)
+				error("Staging failed on `%s'", job->units[i].server);
+		}
+
+		error("Aborted; no server has been switched. Use `joblog %u' for details", job->id);
+		config_unstage(changed);
+		goto out;
+	}
+
+	// Phase 2: switch all servers at once
+	if(auto_rehash)
+		rehash = (auto_rehash == 1);
+	else
+		rehash = readline_yesno("Rehash the ircds after switching the configs?", "Yes");
+
+	config_switch(changed, rehash);
+	if(!rehash)
+		out_color(COLOR_YELLOW, "Use `rehash <server>' to rehash the servers");
+
+out:
+	stringlist_free(changed);
+	stringlist_free(lines);
+}
+
+// Rolling update: servers are updated and rehashed in waves following the
+// link graph, hubs before the servers linked to them, with at most
+// "rollout/max_per_hub" servers of the same hub per wave. A failed wave
+// stops the rollout.
+void config_commit_rolling(const char *server, int check_remote, int auto_update, int auto_rehash)
+{
+	struct stringlist *changed;
+	struct topology *topo;
+	struct ptrlist *waves;
+	const char *str;
+	unsigned int max_per_hub = 2;
+
+	if(job_child)
+	{
+		error("--rolling cannot be used in a background job");
+		return;
+	}
+
+	if((str = conf_str("rollout/max_per_hub")))
+		max_per_hub = max(atoi(str), 0);
+
+	changed = config_find_changed(server, check_remote);
+	if(!changed->count)
+	{
+		out("No config needs to be updated");
+		stringlist_free(changed);
+		return;
+	}
+
+	topo = topology_load();
+	waves = topology_waves(topo, changed, max_per_hub);
+	topology_free(topo);
+	stringlist_free(changed);
+
+	for(unsigned int i = 0; i < waves->count; i++)
+	{
+		struct stringlist *wave = waves->data[i]->ptr;
+		char *names = untokenize(wave->count, wave->data, ", ");
+		out("Wave %u: %s", i + 1, names);
+		free(names);
+	}
+
+	if(!auto_update && !readline_yesno("Roll out the new configs in this order?", "Yes"))
+	{
+		ptrlist_free(waves);
+		return;
+	}
+
+	for(unsigned int i = 0; i < waves->count; i++)
+	{
+		struct stringlist *wave = waves->data[i]->ptr;
+		struct stringlist *lines = stringlist_create();
+		struct job *job;
+		int failed;
+
+		for(unsigned int j = 0; j < wave->count; j++)
+		{
+			char *line;
+			asprintf(&line, "conf sync --update %s %s", auto_rehash == -1 ? "--no-rehash" : "--rehash", wave->data[j]);
+			stringlist_add(lines, line);
+		}
+
+		job = job_create("conf sync", wave, lines);
+		stringlist_free(lines);
+		out_color(COLOR_BROWN, "Wave %u/%u: updating %u %s (job %u)", i + 1, waves->count, wave->count, wave->count == 1 ? "server" : "servers", job->id);
+		if((failed = job_wait(job)) != 0)
+			job_cancel(job);
+
+		if(failed || job->failed || job->cancelled)
+		{
+			error("Wave %u did not complete; the remaining waves have been skipped. Use `joblog %u' for details", i + 1, job->id);
+			break;
+		}
+	}
+
+	ptrlist_free(waves);
+}
+
 // Get remote configs if local config is missing
 void config_get_missing()
 {
@@ -341,8 +754,11 @@ void config_get_missing()
 
 	res = pgsql_query("SELECT * FROM servers ORDER BY name ASC", 1, NULL);
 	rows = pgsql_num_rows(res);
+	ssh_prefetch_servers(res);
+	struct arena_mark mark = arena_mark(arena_current);
 	for(int i = 0; i < rows; i++)
 	{
+		arena_release(arena_current, mark);
 		struct server_info *server = serverinfo_load_pg(res, i);
 		out_prefix("\033[" COLOR_BROWN "m[%s]\033[0m ", server->name);
 		if(file_exists(config_filename(server, CONFIG_LIVE)))
@@ -18,10 +18,13 @@ void config_rename(const char *old, const char *new);
 void config_delete(struct server_info *server);
 int config_download(struct server_info *server, struct ssh_session *session);
 int config_upload(struct server_info *server, struct ssh_session *session, enum config_type type);
+int config_stage(struct server_info *server);
 void config_generate(const char *server);
 int config_check_remote_server(struct server_info *server, enum config_type local_conf, int silent, int keep_remote, struct ssh_session *session);
 void config_check_remote(const char *server);
 void config_check_local(const char *server, int check_remote, int auto_update, int auto_rehash);
+void config_commit_two_phase(const char *server, int check_remote, int auto_update, int auto_rehash);
+void config_commit_rolling(const char *server, int check_remote, int auto_update, int auto_rehash);
 void config_get_missing();
 
 #endif
@@ -0,0 +1,403 @@
+#include "common.h"
+#include "daemon.h"
+#include "main.h"
+#include "conf.h"
+#include "pgsql.h"
+#include "ssh.h"
+#include "event.h"
+#include "stringlist.h"
+#include "format.h"
+
+// Daemon mode keeps the config, the database connection and all ssh sessions
+// open and executes commands received on a unix socket.
+//
+// Protocol (one command per connection):
+//   client -> daemon: "<flags>\t<command>\n" sent together with the client's
+//                     stdout and stderr (SCM_RIGHTS); flags are 'c' (no colors),
+//                     'd' (debug output), 't'/'j' (tsv/jsonl format) or '-' for none
+//   daemon -> client: "<exitcode>\n" once the command has finished
+// All output of the command is written directly to the client's descriptors.
+
+#define DAEMON_KEEPALIVE	30000
+#define DAEMON_TIMEOUT		5
+
+static const char *daemon_socket();
+static int daemon_listen(const char *path);
+static void daemon_sigterm(int n);
+static void daemon_accept(int fd, unsigned int events, void *ctx);
+static void daemon_hangup(int fd, unsigned int events, void *ctx);
+static void daemon_keepalive(void *ctx);
+static int daemon_recv(int fd, int fds[2], char *buf, size_t size);
+static void daemon_serve(int fd);
+
+static int listen_fd = -1;
+static struct event_timer *keepalive_timer = NULL;
+
+static const char *daemon_socket()
+{
+	const char *path = conf_str("daemon/socket");
+	return path ? path : "gsconf.sock";
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un sa;
+	mode_t mask;
+	int fd, ret;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(sa.sun_path))
+	{
+		error("Socket path `%s' is too long", path);
+		return -1;
+	}
+
+	strcpy(sa.sun_path, path);
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+	{
+		error("Could not create socket: %s (%d)", strerror(errno), errno);
+		return -1;
+	}
+
+	// Remove a stale socket unless another daemon is still using it
+	if(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+	{
+		error("Another daemon is already listening on `%s'", path);
+		close(fd);
+		return -1;
+	}
+
+	// The daemon runs commands with our privileges; only we may talk to it.
+	// The socket must not be accessible for others even for a moment.
+	unlink(path);
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	umask(mask);
+	if(ret != 0 || chmod(path, 0600) != 0 || listen(fd, 16) != 0)
+	{
+		error("Could not listen on `%s': %s (%d)", path, strerror(errno), errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void daemon_sigterm(int n)
+{
+	quit = 1;
+}
+
+int daemon_run()
+{
+	const char *path = daemon_socket();
+	struct sigaction sa;
+	int devnull;
+
+	if((listen_fd = daemon_listen(path)) < 0)
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = daemon_sigterm;
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	// Commands must never wait for input; readline() simply gets EOF
+	if((devnull = open("/dev/null", O_RDONLY)) >= 0)
+	{
+		dup2(devnull, STDIN_FILENO);
+		close(devnull);
+	}
+
+	// Output should reach the clients while a command is still running
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	ssh_persist_all(1);
+	keepalive_timer = event_timer_add(DAEMON_KEEPALIVE, daemon_keepalive, NULL);
+	event_add(listen_fd, EV_READ, daemon_accept, NULL);
+	out("Listening on %s", path);
+
+	while(!quit)
+	{
+		sigint_received = 0;
+		if(event_run_once(-1) < 0 && sigint_received)
+			break;
+	}
+
+	out("Shutting down");
+	event_timer_del(keepalive_timer);
+	event_del(listen_fd);
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
+
+static void daemon_keepalive(void *ctx)
+{
+	ssh_keepalive();
+	keepalive_timer = event_timer_add(DAEMON_KEEPALIVE, daemon_keepalive, NULL);
+}
+
+static void daemon_accept(int fd, unsigned int events, void *ctx)
+{
+	struct timeval tv = { DAEMON_TIMEOUT, 0 };
+	struct ucred cred = { .uid = -1 };
+	socklen_t cred_len = sizeof(cred);
+	int client;
+
+	if((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+	{
+		if(errno != EAGAIN && errno != EINTR)
+			error("Could not accept connection: %s (%d)", strerror(errno), errno);
+		return;
+	}
+
+	// Only accept our own user even if the socket permissions were changed
+	if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != geteuid())
+	{
+		error("Rejected a connection from uid %d", (int)cred.uid);
+		close(client);
+		return;
+	}
+
+	// Reading the request must not block the daemon forever
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	// Commands are executed one at a time; nested event loops (e.g. while
+	// waiting for the database) must not accept further clients.
+	event_del(listen_fd);
+	daemon_serve(client);
+	close(client);
+	if(!quit)
+		event_add(listen_fd, EV_READ, daemon_accept, NULL);
+}
+
+// The client went away; abort the running command just like Ctrl+C would
+static void daemon_hangup(int fd, unsigned int events, void *ctx)
+{
+	char c;
+
+	if(read(fd, &c, 1) == 1)
+		return;
+
+	debug("Client disconnected");
+	sigint_received = 1;
+	event_del(fd);
+}
+
+static int daemon_recv(int fd, int fds[2], char *buf, size_t size)
+{
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t len;
+	size_t pos;
+	char *end;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = size - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	fds[0] = fds[1] = -1;
+	if((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+		return -1;
+
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+		   cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+			memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+	}
+
+	if(fds[0] < 0 || fds[1] < 0 || (msg.msg_flags & MSG_CTRUNC))
+	{
+		error("Received a request without output descriptors");
+		return -1;
+	}
+
+	// The rest of the line (if any) arrives without descriptors
+	pos = len;
+	while(!(end = memchr(buf, '\n', pos)))
+	{
+		if(pos == size - 1 || (len = read(fd, buf + pos, size - 1 - pos)) <= 0)
+		{
+			error("Received an invalid request");
+			return -1;
+		}
+
+		pos += len;
+	}
+
+	*end = '\0';
+	return 0;
+}
+
+static void daemon_serve(int fd)
+{
+	char buf[4096], status[16];
+	char *flags, *line;
+	int fds[2], saved_stdout, saved_stderr;
+	int saved_colors = no_colors, saved_debug = debug_output_enabled, saved_format = output_format;
+
+	if(daemon_recv(fd, fds, buf, sizeof(buf)) != 0)
+	{
+		if(fds[0] >= 0)
+			close(fds[0]);
+		if(fds[1] >= 0)
+			close(fds[1]);
+		return;
+	}
+
+	flags = buf;
+	if(!(line = strchr(buf, '\t')))
+	{
+		close(fds[0]);
+		close(fds[1]);
+		error("Received an invalid request");
+		return;
+	}
+
+	*line++ = '\0';
+	debug("Client command: %s", line);
+
+	// Redirect our output to the client
+	fflush(stdout);
+	fflush(stderr);
+	saved_stdout = dup(STDOUT_FILENO);
+	saved_stderr = dup(STDERR_FILENO);
+	dup2(fds[0], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	close(fds[0]);
+	close(fds[1]);
+
+	no_colors = (strchr(flags, 'c') != NULL);
+	debug_output_enabled = (strchr(flags, 'd') != NULL);
+	if(strchr(flags, 't'))
+		output_format = FORMAT_TSV;
+	else if(strchr(flags, 'j'))
+		output_format = FORMAT_JSONL;
+	else
+		output_format = FORMAT_TABLE;
+	event_add(fd, EV_READ, daemon_hangup, NULL);
+	sigint_received = 0;
+	error_count = 0;
+
+	if(pgsql_check() == 0)
+	{
+		out("Executing: %s", line);
+		handle_line(line);
+	}
+
+	if(event_watched(fd))
+		event_del(fd);
+	no_colors = saved_colors;
+	debug_output_enabled = saved_debug;
+	output_format = saved_format;
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved_stdout, STDOUT_FILENO);
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stdout);
+	close(saved_stderr);
+
+	snprintf(status, sizeof(status), "%d\n", error_count ? 1 : 0);
+	write(fd, status, strlen(status));
+}
+
+// Forwards the commands to a running daemon; returns the exit code
+int daemon_client(struct stringlist *commands)
+{
+	const char *path = daemon_socket();
+	struct sockaddr_un sa;
+	int ret = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strlcpy(sa.sun_path, path, sizeof(sa.sun_path));
+
+	for(unsigned int i = 0; i < commands->count; i++)
+	{
+		union
+		{
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE(2 * sizeof(int))];
+		} control;
+		int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+		struct iovec iov;
+		char *request, status[16];
+		size_t pos = 0;
+		ssize_t len;
+		int fd;
+
+		if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+		   connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+		{
+			error("Could not connect to the daemon at `%s': %s (%d)", path, strerror(errno), errno);
+			if(fd >= 0)
+				close(fd);
+			return 1;
+		}
+
+		asprintf(&request, "%s%s%s\t%s\n", no_colors ? "c" : "-", debug_output_enabled ? "d" : "",
+			 (output_format == FORMAT_TSV) ? "t" : (output_format == FORMAT_JSONL) ? "j" : "", commands->data[i]);
+		iov.iov_base = request;
+		iov.iov_len = strlen(request);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+		fflush(stdout);
+		if(sendmsg(fd, &msg, 0) != (ssize_t)iov.iov_len)
+		{
+			error("Could not send command to the daemon: %s (%d)", strerror(errno), errno);
+			free(request);
+			close(fd);
+			return 1;
+		}
+
+		free(request);
+
+		// The daemon writes the output directly to our stdout; we only get the exit code
+		while(pos < sizeof(status) - 1 && (len = read(fd, status + pos, sizeof(status) - 1 - pos)) > 0)
+		{
+			pos += len;
+			if(memchr(status, '\n', pos))
+				break;
+		}
+
+		close(fd);
+		status[pos] = '\0';
+		if(!pos || !strchr(status, '\n'))
+		{
+			error("Lost connection to the daemon");
+			return 1;
+		}
+
+		if(atoi(status))
+			ret = atoi(status);
+	}
+
+	return ret;
+}
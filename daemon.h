@@ -0,0 +1,9 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+struct stringlist;
+
+int daemon_run();
+int daemon_client(struct stringlist *commands);
+
+#endif
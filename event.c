@@ -0,0 +1,266 @@
+#include "common.h"
+#include "event.h"
+#include <sys/epoll.h>
+
+// Single-threaded epoll reactor. The interactive prompt, async PG queries,
+// ssh sessions and background jobs register their fds here; code that has
+// to wait for a specific fd uses event_wait_fd() which keeps dispatching
+// all other events in the meantime.
+
+struct event_watcher
+{
+	unsigned int events;
+	event_fd_f *func;
+	void *ctx;
+};
+
+struct event_timer
+{
+	unsigned long long expires;
+	event_timer_f *func;
+	void *ctx;
+	struct event_timer *next;
+};
+
+static unsigned int event_to_epoll(unsigned int events);
+
+static int epoll_fd = -1;
+static struct event_watcher **watchers = NULL;
+static unsigned int watchers_size = 0;
+static struct event_timer *timers = NULL;
+
+void event_init()
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	assert(epoll_fd >= 0);
+}
+
+void event_fini()
+{
+	for(unsigned int fd = 0; fd < watchers_size; fd++)
+		xfree(watchers[fd]);
+	xfree(watchers);
+	watchers = NULL;
+	watchers_size = 0;
+
+	while(timers)
+		event_timer_del(timers);
+
+	close(epoll_fd);
+	epoll_fd = -1;
+}
+
+// A forked child must not touch the parent's epoll set (it is shared)
+void event_after_fork()
+{
+	for(unsigned int fd = 0; fd < watchers_size; fd++)
+		xfree(watchers[fd]);
+	memset(watchers, 0, watchers_size * sizeof(struct event_watcher *));
+
+	while(timers)
+		event_timer_del(timers);
+
+	close(epoll_fd);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	assert(epoll_fd >= 0);
+}
+
+unsigned long long event_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int event_to_epoll(unsigned int events)
+{
+	unsigned int ev = 0;
+	if(events & EV_READ)
+		ev |= EPOLLIN;
+	if(events & EV_WRITE)
+		ev |= EPOLLOUT;
+	return ev;
+}
+
+void event_add(int fd, unsigned int events, event_fd_f *func, void *ctx)
+{
+	struct epoll_event ev;
+
+	assert(fd >= 0);
+	if((unsigned int)fd >= watchers_size)
+	{
+		unsigned int size = watchers_size ? watchers_size : 16;
+		while(size <= (unsigned int)fd)
+			size <<= 1; // double size
+		watchers = realloc(watchers, size * sizeof(struct event_watcher *));
+		memset(watchers + watchers_size, 0, (size - watchers_size) * sizeof(struct event_watcher *));
+		watchers_size = size;
+	}
+
+	assert(!watchers[fd]);
+	watchers[fd] = malloc(sizeof(struct event_watcher));
+	watchers[fd]->events = events;
+	watchers[fd]->func = func;
+	watchers[fd]->ctx = ctx;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = event_to_epoll(events);
+	ev.data.fd = fd;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		error("Could not watch fd %d: %s (%d)", fd, strerror(errno), errno);
+		free(watchers[fd]);
+		watchers[fd] = NULL;
+	}
+}
+
+void event_mod(int fd, unsigned int events)
+{
+	struct epoll_event ev;
+
+	assert(event_watched(fd));
+	watchers[fd]->events = events;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = event_to_epoll(events);
+	ev.data.fd = fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void event_del(int fd)
+{
+	if(!event_watched(fd))
+		return;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	free(watchers[fd]);
+	watchers[fd] = NULL;
+}
+
+int event_watched(int fd)
+{
+	return fd >= 0 && (unsigned int)fd < watchers_size && watchers[fd];
+}
+
+struct event_timer *event_timer_add(unsigned int ms, event_timer_f *func, void *ctx)
+{
+	struct event_timer *timer, **pp;
+
+	timer = malloc(sizeof(struct event_timer));
+	timer->expires = event_now() + ms;
+	timer->func = func;
+	timer->ctx = ctx;
+
+	// Keep the list sorted by expiry time
+	for(pp = &timers; *pp && (*pp)->expires <= timer->expires; pp = &(*pp)->next)
+		;
+	timer->next = *pp;
+	*pp = timer;
+	return timer;
+}
+
+void event_timer_del(struct event_timer *timer)
+{
+	for(struct event_timer **pp = &timers; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == timer)
+		{
+			*pp = timer->next;
+			free(timer);
+			return;
+		}
+	}
+}
+
+// Waits up to timeout_ms (-1 = forever) for events and dispatches them.
+// Returns the number of dispatched events/timers or -1 if interrupted by a signal.
+int event_run_once(int timeout_ms)
+{
+	struct epoll_event events[32];
+	unsigned long long now;
+	int count, dispatched = 0;
+
+	if(timers)
+	{
+		long long left = (long long)timers->expires - (long long)event_now();
+		if(left < 0)
+			left = 0;
+		if(timeout_ms < 0 || left < timeout_ms)
+			timeout_ms = left;
+	}
+
+	count = epoll_wait(epoll_fd, events, ArraySize(events), timeout_ms);
+	if(count < 0)
+	{
+		if(errno != EINTR)
+			error("epoll_wait() failed: %s (%d)", strerror(errno), errno);
+		return -1;
+	}
+
+	for(int i = 0; i < count; i++)
+	{
+		int fd = events[i].data.fd;
+		unsigned int revents = 0;
+		struct event_watcher *watcher;
+
+		// A previous callback may have removed this watcher
+		if(!event_watched(fd))
+			continue;
+
+		watcher = watchers[fd];
+		if(events[i].events & EPOLLIN)
+			revents |= EV_READ;
+		if(events[i].events & EPOLLOUT)
+			revents |= EV_WRITE;
+		if(events[i].events & (EPOLLERR | EPOLLHUP))
+			revents |= EV_ERROR;
+
+		watcher->func(fd, revents, watcher->ctx);
+		dispatched++;
+	}
+
+	now = event_now();
+	while(timers && timers->expires <= now)
+	{
+		struct event_timer *timer = timers;
+		timers = timer->next;
+		timer->func(timer->ctx);
+		free(timer);
+		dispatched++;
+	}
+
+	return dispatched;
+}
+
+static void event_wait_fd_cb(int fd, unsigned int events, void *ctx)
+{
+	*(unsigned int *)ctx = events;
+}
+
+// Waits until fd becomes ready while still dispatching all other events.
+// Returns the ready events or 0 on timeout or if a signal arrived.
+unsigned int event_wait_fd(int fd, unsigned int events, int timeout_ms)
+{
+	unsigned long long deadline = event_now() + (timeout_ms > 0 ? timeout_ms : 0);
+	unsigned int revents = 0;
+
+	event_add(fd, events, event_wait_fd_cb, &revents);
+	while(!revents)
+	{
+		int left = -1;
+
+		if(timeout_ms >= 0)
+		{
+			long long now = event_now();
+			if(now >= (long long)deadline)
+				break;
+			left = deadline - now;
+		}
+
+		if(event_run_once(left) < 0)
+			break;
+	}
+
+	event_del(fd);
+	return revents;
+}
@@ -0,0 +1,29 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#define EV_READ		0x01
+#define EV_WRITE	0x02
+#define EV_ERROR	0x04 // error/hangup; always reported
+
+typedef void (event_fd_f)(int fd, unsigned int events, void *ctx);
+typedef void (event_timer_f)(void *ctx);
+
+struct event_timer;
+
+void event_init();
+void event_fini();
+void event_after_fork();
+
+void event_add(int fd, unsigned int events, event_fd_f *func, void *ctx);
+void event_mod(int fd, unsigned int events);
+void event_del(int fd);
+int event_watched(int fd);
+
+struct event_timer *event_timer_add(unsigned int ms, event_timer_f *func, void *ctx);
+void event_timer_del(struct event_timer *timer);
+
+int event_run_once(int timeout_ms);
+unsigned int event_wait_fd(int fd, unsigned int events, int timeout_ms);
+unsigned long long event_now();
+
+#endif
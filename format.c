@@ -0,0 +1,100 @@
+#include "common.h"
+#include "format.h"
+#include "main.h"
+#include "pgsql.h"
+
+// Machine-readable output (--format). Rows are written as soon as they are
+// available: TSV uses the escaping of PostgreSQL's COPY text format, JSONL
+// writes one object per row.
+
+static void format_pg_row(PGresult *res, int row, void *ctx);
+
+int format_parse(const char *name)
+{
+	if(!strcasecmp(name, "table"))
+		return FORMAT_TABLE;
+	else if(!strcasecmp(name, "tsv"))
+		return FORMAT_TSV;
+	else if(!strcasecmp(name, "jsonl"))
+		return FORMAT_JSONL;
+	return -1;
+}
+
+static void format_pg_row(PGresult *res, int row, void *ctx)
+{
+	int cols = PQnfields(res);
+	int json_flags = ESCAPE_JSON | (pgsql_client_utf8() ? 0 : ESCAPE_LATIN1);
+
+	if(row == -1)
+	{
+		// JSON lines are self-describing; TSV gets a header line
+		if(output_format == FORMAT_TSV)
+		{
+			for(int col = 0; col < cols; col++)
+			{
+				if(col)
+					putc('\t', stdout);
+				out_escaped(PQfname(res, col), strlen(PQfname(res, col)), 0);
+			}
+			putc('\n', stdout);
+		}
+		return;
+	}
+
+	if(output_format == FORMAT_JSONL)
+		putc('{', stdout);
+
+	for(int col = 0; col < cols; col++)
+	{
+		const char *value = PQgetvalue(res, row, col);
+		int isnull = PQgetisnull(res, row, col);
+
+		if(output_format == FORMAT_TSV)
+		{
+			if(col)
+				putc('\t', stdout);
+			if(isnull)
+				fputs("\\N", stdout);
+			else
+				out_escaped(value, PQgetlength(res, row, col), 0);
+			continue;
+		}
+
+		if(col)
+			putc(',', stdout);
+		putc('"', stdout);
+		out_escaped(PQfname(res, col), strlen(PQfname(res, col)), json_flags);
+		fputs("\":", stdout);
+
+		// Type OIDs from pg_type.h
+		switch(isnull ? 0 : PQftype(res, col))
+		{
+			case 0:
+				fputs("null", stdout);
+				break;
+			case 16: // bool
+				fputs(*value == 't' ? "true" : "false", stdout);
+				break;
+			case 20: // int8
+			case 21: // int2
+			case 23: // int4
+				fputs(value, stdout);
+				break;
+			default:
+				putc('"', stdout);
+				out_escaped(value, PQgetlength(res, row, col), json_flags);
+				putc('"', stdout);
+				break;
+		}
+	}
+
+	fputs(output_format == FORMAT_JSONL ? "}\n" : "\n", stdout);
+}
+
+// Runs a query and writes the result rows in the current output format
+int format_query(const char *query, struct stringlist *params)
+{
+	int rows = pgsql_query_stream(query, params, format_pg_row, NULL);
+	fflush(stdout);
+	return rows;
+}
@@ -0,0 +1,19 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <libpq-fe.h>
+
+struct stringlist;
+
+// Values of output_format (see main.h)
+enum output_format
+{
+	FORMAT_TABLE,
+	FORMAT_TSV,
+	FORMAT_JSONL
+};
+
+int format_parse(const char *name);
+int format_query(const char *query, struct stringlist *params);
+
+#endif
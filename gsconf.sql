@@ -775,6 +775,13 @@ ALTER TABLE ONLY webirc
     ADD CONSTRAINT webirc_pkey PRIMARY KEY (name);
 
 
+--
+-- Name: clientgroups_server; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
+--
+
+CREATE INDEX clientgroups_server ON clientgroups USING btree (server);
+
+
 --
 -- Name: clients_cgroup_key; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
 --
@@ -817,6 +824,13 @@ CREATE INDEX forwards_server ON forwards USING btree (server);
 CREATE INDEX jupes2servers_server ON jupes2servers USING btree (server);
 
 
+--
+-- Name: links_hub; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
+--
+
+CREATE INDEX links_hub ON links USING btree (hub);
+
+
 --
 -- Name: opers2servers_server; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
 --
@@ -824,6 +838,13 @@ CREATE INDEX jupes2servers_server ON jupes2servers USING btree (server);
 CREATE INDEX opers2servers_server ON opers2servers USING btree (server);
 
 
+--
+-- Name: ports_server; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
+--
+
+CREATE INDEX ports_server ON ports USING btree (server);
+
+
 --
 -- Name: pseudos_command_server; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
 --
@@ -845,6 +866,13 @@ CREATE INDEX pseudos_server ON pseudos USING btree (server);
 CREATE UNIQUE INDEX servers_name_key ON servers USING btree (lower((name)::text));
 
 
+--
+-- Name: servicelinks_hub; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
+--
+
+CREATE INDEX servicelinks_hub ON servicelinks USING btree (hub);
+
+
 --
 -- Name: webirc2servers_server; Type: INDEX; Schema: public; Owner: gsdev; Tablespace:
 --
@@ -4,6 +4,7 @@
 #include "pgsql.h"
 #include "stringlist.h"
 #include "cmd.h"
+#include "job.h"
 #include <setjmp.h>
 #include <termios.h>
 
@@ -18,6 +19,7 @@ static const char *history_file = NULL;
 static int readline_custom_autocomplete = 0;
 static rl_compentry_func_t *readline_custom_autocomplete_func = NULL;
 const char *readline_default_text = NULL;
+static int completing = 0;
 
 void input_init(const char *readline_name, const char *history)
 {
@@ -65,6 +67,16 @@ char *readline_custom(const char *prompt, const char *default_line, rl_compentry
 	else
 		snprintf(buf, sizeof(buf), "%s: ", prompt);
 
+	// Background jobs cannot ask anything; they always use the default answer
+	if(job_child)
+	{
+		out("%s%s", buf, default_line ? default_line : "");
+		if(!default_line)
+			return NULL;
+		strlcpy(buf, default_line, sizeof(buf));
+		return trim(buf);
+	}
+
 	readline_custom_autocomplete = 1;
 	readline_custom_autocomplete_func = autocomplete_func;
 	sigsetjmp(sigint_jmp_buf, 1);
@@ -130,16 +142,26 @@ static char **input_tabcomp(const char *text, int start, int end)
 
 	rl_attempted_completion_over = 1;
 
+	completing = 1;
 	if(readline_custom_autocomplete)
 	{
-		if(!readline_custom_autocomplete_func)
-			return NULL;
-		list = rl_completion_matches(text, readline_custom_autocomplete_func);
-		readline_custom_autocomplete_func(NULL, -1);
-		return list;
+		if(readline_custom_autocomplete_func)
+		{
+			list = rl_completion_matches(text, readline_custom_autocomplete_func);
+			readline_custom_autocomplete_func(NULL, -1);
+		}
 	}
+	else
+		list = cmd_tabcomp(text, start, end);
+	completing = 0;
 
-	return cmd_tabcomp(text, start, end);
+	return list;
+}
+
+// Whether the current queries are made by a tab completion
+int input_completing()
+{
+	return completing;
 }
 
 // Some common generator functions
@@ -5,6 +5,7 @@
 
 void input_init(const char *readline_name, const char *history_file);
 void input_fini();
+int input_completing();
 
 char *readline_custom(const char *prompt, const char *default_line, rl_compentry_func_t *autocomplete_func);
 int readline_yesno(const char *prompt, const char *default_line);
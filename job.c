@@ -0,0 +1,413 @@
+#include "common.h"
+#include "job.h"
+#include "main.h"
+#include "conf.h"
+#include "event.h"
+#include "pgsql.h"
+#include "ssh.h"
+#include "ptrlist.h"
+#include "stringlist.h"
+#include "stringbuffer.h"
+
+static unsigned int job_max_parallel();
+static void job_schedule();
+static void job_unit_start(struct job_unit *unit);
+static void job_unit_readable(int fd, unsigned int events, void *ctx);
+static void job_unit_finish(struct job_unit *unit);
+static void job_finish(struct job *job);
+static void job_free(struct job *job);
+
+int job_child = 0;
+static struct ptrlist *jobs = NULL;
+static unsigned int next_id = 1;
+static unsigned int units_running = 0;
+static job_exec_f *job_exec = NULL;
+static struct job *waiting_for = NULL;
+
+void job_init(job_exec_f *exec_func)
+{
+	jobs = ptrlist_create();
+	ptrlist_set_free_func(jobs, (ptrlist_free_f *)job_free);
+	job_exec = exec_func;
+}
+
+void job_fini()
+{
+	// Don't leave orphaned children behind
+	for(unsigned int i = 0; i < jobs->count; i++)
+	{
+		struct job *job = jobs->data[i]->ptr;
+		if(job_state(job) == JOB_RUNNING || job_state(job) == JOB_PENDING)
+		{
+			job_cancel(job);
+			job_wait(job);
+		}
+	}
+
+	ptrlist_free(jobs);
+	jobs = NULL;
+}
+
+static unsigned int job_max_parallel()
+{
+	const char *str = conf_str("jobs/max_parallel");
+	int val = str ? atoi(str) : 0;
+	return val > 0 ? val : 4;
+}
+
+struct job *job_create(const char *cmd_line, struct stringlist *servers, struct stringlist *lines)
+{
+	struct job *job = malloc(sizeof(struct job));
+
+	memset(job, 0, sizeof(struct job));
+	job->id = next_id++;
+	job->cmd_line = strdup(cmd_line);
+	job->started = time(NULL);
+	job->count = lines->count;
+	job->pending = lines->count;
+	job->units = calloc(job->count, sizeof(struct job_unit));
+
+	for(unsigned int i = 0; i < job->count; i++)
+	{
+		struct job_unit *unit = &job->units[i];
+		unit->job = job;
+		unit->server = servers ? strdup(servers->data[i]) : NULL;
+		unit->cmd_line = strdup(lines->data[i]);
+		unit->state = JOB_PENDING;
+		unit->fd = -1;
+		unit->output = stringbuffer_create();
+	}
+
+	ptrlist_add(jobs, 0, job);
+	job_schedule();
+	return job;
+}
+
+static void job_free(struct job *job)
+{
+	for(unsigned int i = 0; i < job->count; i++)
+	{
+		xfree(job->units[i].server);
+		free(job->units[i].cmd_line);
+		stringbuffer_free(job->units[i].output);
+	}
+
+	free(job->units);
+	free(job->cmd_line);
+	free(job);
+}
+
+struct job *job_find(unsigned int id)
+{
+	for(unsigned int i = 0; i < jobs->count; i++)
+	{
+		struct job *job = jobs->data[i]->ptr;
+		if(job->id == id)
+			return job;
+	}
+
+	return NULL;
+}
+
+struct ptrlist *job_list()
+{
+	return jobs;
+}
+
+void job_remove(struct job *job)
+{
+	assert(job_state(job) != JOB_RUNNING && job_state(job) != JOB_PENDING);
+	ptrlist_del_ptr(jobs, job);
+}
+
+enum job_state job_state(const struct job *job)
+{
+	if(job->running)
+		return JOB_RUNNING;
+	else if(job->pending)
+		return JOB_PENDING;
+	else if(job->cancelled)
+		return JOB_CANCELLED;
+	else if(job->failed)
+		return JOB_FAILED;
+	return JOB_DONE;
+}
+
+const char *job_state_name(enum job_state state)
+{
+	switch(state)
+	{
+		case JOB_PENDING:
+			return "pending";
+		case JOB_RUNNING:
+			return "running";
+		case JOB_DONE:
+			return "done";
+		case JOB_FAILED:
+			return "failed";
+		case JOB_CANCELLED:
+			return "cancelled";
+	}
+
+	return "unknown";
+}
+
+// Starts pending units (oldest job first) until the parallel limit is reached
+static void job_schedule()
+{
+	unsigned int max_parallel = job_max_parallel();
+
+	for(unsigned int i = 0; i < jobs->count && units_running < max_parallel; i++)
+	{
+		struct job *job = jobs->data[i]->ptr;
+		for(unsigned int j = 0; j < job->count && job->pending && units_running < max_parallel; j++)
+		{
+			if(job->units[j].state == JOB_PENDING)
+				job_unit_start(&job->units[j]);
+		}
+	}
+}
+
+static void job_unit_start(struct job_unit *unit)
+{
+	struct job *job = unit->job;
+	int fds[2];
+	pid_t pid;
+
+	job->pending--;
+	unit->started = time(NULL);
+
+	if(pipe(fds) != 0)
+	{
+		stringbuffer_append_printf(unit->output, "Could not create pipe: %s (%d)\n", strerror(errno), errno);
+		unit->state = JOB_FAILED;
+		unit->finished = unit->started;
+		job->failed++;
+		if(!job->pending && !job->running)
+			job_finish(job);
+		return;
+	}
+
+	fflush(stdout);
+	if((pid = fork()) < 0)
+	{
+		stringbuffer_append_printf(unit->output, "Could not fork: %s (%d)\n", strerror(errno), errno);
+		close(fds[0]);
+		close(fds[1]);
+		unit->state = JOB_FAILED;
+		unit->finished = unit->started;
+		job->failed++;
+		if(!job->pending && !job->running)
+			job_finish(job);
+		return;
+	}
+	else if(pid == 0)
+	{
+		int devnull = open("/dev/null", O_RDWR);
+
+		setpgid(0, 0);
+		signal(SIGINT, SIG_IGN);
+		close(fds[0]);
+		dup2(devnull, STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		close(fds[1]);
+		close(devnull);
+		setvbuf(stdout, NULL, _IOLBF, 0);
+
+		// Nothing the parent owns may be used by the child
+		job_child = 1;
+		batch_mode = 1;
+		event_after_fork();
+		ssh_after_fork();
+		if(pgsql_after_fork() != 0)
+			_exit(1);
+
+		error_count = 0;
+		job_exec(unit->cmd_line);
+		fflush(stdout);
+		_exit(error_count ? 1 : 0);
+	}
+
+	setpgid(pid, pid);
+	close(fds[1]);
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	unit->pid = pid;
+	unit->fd = fds[0];
+	unit->state = JOB_RUNNING;
+	job->running++;
+	units_running++;
+	event_add(unit->fd, EV_READ, job_unit_readable, unit);
+}
+
+static void job_unit_readable(int fd, unsigned int events, void *ctx)
+{
+	struct job_unit *unit = ctx;
+	char buf[4096];
+	ssize_t len;
+
+	while((len = read(fd, buf, sizeof(buf))) > 0)
+		stringbuffer_append_string_n(unit->output, buf, len);
+
+	if(len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	// EOF (or read error): the child is done
+	job_unit_finish(unit);
+}
+
+static void job_unit_finish(struct job_unit *unit)
+{
+	struct job *job = unit->job;
+	int status;
+	pid_t res;
+
+	event_del(unit->fd);
+	close(unit->fd);
+	unit->fd = -1;
+
+	while((res = waitpid(unit->pid, &status, 0)) < 0 && errno == EINTR)
+		;
+
+	unit->exitcode = (res > 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : 127;
+	unit->finished = time(NULL);
+	if(unit->state == JOB_CANCELLED)
+		; // counted in job_cancel()
+	else if(unit->exitcode == 0)
+		unit->state = JOB_DONE;
+	else
+	{
+		unit->state = JOB_FAILED;
+		job->failed++;
+	}
+
+	job->running--;
+	units_running--;
+	if(!job->pending && !job->running)
+		job_finish(job);
+
+	job_schedule();
+}
+
+static void job_finish(struct job *job)
+{
+	int prompt_visible;
+	int saved_point = 0;
+	char *saved_line = NULL;
+
+	job->finished = time(NULL);
+
+	// job_wait() reports the result itself
+	if(job == waiting_for)
+		return;
+
+	// Print the notification above the prompt without destroying the line being edited
+	prompt_visible = !batch_mode && !job_child && RL_ISSTATE(RL_STATE_CALLBACK);
+	if(prompt_visible)
+	{
+		saved_point = rl_point;
+		saved_line = rl_copy_text(0, rl_end);
+		rl_save_prompt();
+		rl_replace_line("", 0);
+		rl_redisplay();
+	}
+
+	out_color(job->failed ? COLOR_LIGHT_RED : COLOR_LIME, "[job %u] %s: %u/%u ok, %u failed, %u cancelled (%s)",
+		  job->id, job_state_name(job_state(job)), job->count - job->failed - job->cancelled, job->count,
+		  job->failed, job->cancelled, job->cmd_line);
+
+	if(prompt_visible)
+	{
+		rl_restore_prompt();
+		rl_replace_line(saved_line, 0);
+		rl_point = saved_point;
+		rl_on_new_line();
+		rl_redisplay();
+		free(saved_line);
+	}
+}
+
+void job_cancel(struct job *job)
+{
+	for(unsigned int i = 0; i < job->count; i++)
+	{
+		struct job_unit *unit = &job->units[i];
+
+		if(unit->state == JOB_PENDING)
+		{
+			unit->state = JOB_CANCELLED;
+			unit->finished = time(NULL);
+			job->pending--;
+			job->cancelled++;
+		}
+		else if(unit->state == JOB_RUNNING)
+		{
+			// The unit is finished once its pipe is closed
+			kill(-unit->pid, SIGTERM);
+			unit->state = JOB_CANCELLED;
+			job->cancelled++;
+		}
+	}
+
+	if(!job->pending && !job->running && !job->finished)
+		job_finish(job);
+}
+
+// Runs the event loop until the job has finished. Returns -1 if interrupted.
+int job_wait(struct job *job)
+{
+	struct job *prev = waiting_for;
+
+	waiting_for = job;
+	while(job->pending || job->running)
+	{
+		if(event_run_once(-1) < 0 && sigint_received)
+		{
+			waiting_for = prev;
+			return -1;
+		}
+	}
+
+	waiting_for = prev;
+	return 0;
+}
+
+static unsigned int job_count_active()
+{
+	unsigned int count = 0;
+
+	for(unsigned int i = 0; i < jobs->count; i++)
+	{
+		struct job *job = jobs->data[i]->ptr;
+		if(job_state(job) == JOB_RUNNING || job_state(job) == JOB_PENDING)
+			count++;
+	}
+
+	return count;
+}
+
+// Returns the number of jobs which did not succeed or -1 if interrupted
+int job_wait_all()
+{
+	unsigned int count = job_count_active();
+	int failed = 0;
+
+	if(!count)
+		return 0;
+
+	out("Waiting for %u background job%s", count, count == 1 ? "" : "s");
+	sigint_received = 0;
+	while(job_count_active())
+	{
+		if(event_run_once(-1) < 0 && sigint_received)
+			return -1;
+	}
+
+	for(unsigned int i = 0; i < jobs->count; i++)
+	{
+		if(job_state(jobs->data[i]->ptr) != JOB_DONE)
+			failed++;
+	}
+
+	return failed;
+}
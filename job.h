@@ -0,0 +1,63 @@
+#ifndef JOB_H
+#define JOB_H
+
+struct stringbuffer;
+struct stringlist;
+struct ptrlist;
+
+enum job_state
+{
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+	JOB_CANCELLED
+};
+
+// A job consists of one unit per server (or a single unit for commands
+// not bound to a server). Every unit runs in its own child process.
+struct job_unit
+{
+	struct job *job;
+	char *server;
+	char *cmd_line;
+	enum job_state state;
+	pid_t pid;
+	int fd;
+	int exitcode;
+	time_t started;
+	time_t finished;
+	struct stringbuffer *output;
+};
+
+struct job
+{
+	unsigned int id;
+	char *cmd_line;
+	time_t started;
+	time_t finished;
+	unsigned int count;
+	unsigned int pending;
+	unsigned int running;
+	unsigned int failed;
+	unsigned int cancelled;
+	struct job_unit *units;
+};
+
+typedef void (job_exec_f)(const char *cmd_line);
+
+extern int job_child;
+
+void job_init(job_exec_f *exec_func);
+void job_fini();
+struct job *job_create(const char *cmd_line, struct stringlist *servers, struct stringlist *lines);
+struct job *job_find(unsigned int id);
+struct ptrlist *job_list();
+enum job_state job_state(const struct job *job);
+const char *job_state_name(enum job_state state);
+void job_cancel(struct job *job);
+int job_wait(struct job *job);
+int job_wait_all();
+void job_remove(struct job *job);
+
+#endif
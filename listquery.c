@@ -0,0 +1,182 @@
+#include "common.h"
+#include "listquery.h"
+#include "stringlist.h"
+#include "stringbuffer.h"
+
+static char *listquery_param(struct listquery *lq, char *value);
+static char *listquery_pattern(const char *mask);
+static const struct listquery_column *listquery_column(struct listquery *lq, const char *name);
+
+// Adds a query parameter and returns its placeholder
+static char *listquery_param(struct listquery *lq, char *value)
+{
+	static char buf[16];
+
+	stringlist_add(lq->params, value);
+	snprintf(buf, sizeof(buf), "$%u", lq->params->count);
+	return buf;
+}
+
+// Converts a wildcard mask into an ILIKE pattern
+static char *listquery_pattern(const char *mask)
+{
+	struct stringbuffer *sbuf = stringbuffer_create();
+	char *pattern;
+
+	for(const char *c = mask; *c; c++)
+	{
+		if(*c == '*')
+			stringbuffer_append_char(sbuf, '%');
+		else if(*c == '?')
+			stringbuffer_append_char(sbuf, '_');
+		else
+		{
+			if(*c == '%' || *c == '_' || *c == '\\')
+				stringbuffer_append_char(sbuf, '\\');
+			stringbuffer_append_char(sbuf, *c);
+		}
+	}
+
+	pattern = strdup(sbuf->len ? sbuf->string : "");
+	stringbuffer_free(sbuf);
+	return pattern;
+}
+
+static const struct listquery_column *listquery_column(struct listquery *lq, const char *name)
+{
+	for(const struct listquery_column *col = lq->columns; col && col->name; col++)
+	{
+		if(!strcasecmp(col->name, name))
+			return col;
+	}
+
+	return NULL;
+}
+
+int listquery_parse(struct listquery *lq, int argc, char **argv)
+{
+	const char *server = NULL, *mask = NULL, *sort = NULL;
+	const char *limit = NULL, *offset = NULL;
+	const struct listquery_column *sort_col = NULL;
+	struct stringbuffer *where;
+
+	lq->where = lq->order = lq->limit = NULL;
+	lq->params = stringlist_create();
+
+	for(int i = 1; i < argc; i++)
+	{
+		const char **opt = NULL;
+
+		if(!strcmp(argv[i], "--server") && lq->server_cond)
+			opt = &server;
+		else if(!strcmp(argv[i], "--match") && lq->match_expr)
+			opt = &mask;
+		else if(!strcmp(argv[i], "--sort"))
+			opt = &sort;
+		else if(!strcmp(argv[i], "--limit"))
+			opt = &limit;
+		else if(!strcmp(argv[i], "--offset"))
+			opt = &offset;
+		else if(*argv[i] != '-' && lq->server_cond && !server)
+		{
+			server = argv[i];
+			continue;
+		}
+		else
+		{
+			error("Unexpected argument `%s'", argv[i]);
+			goto fail;
+		}
+
+		if(++i >= argc)
+		{
+			error("%s requires an argument", argv[i - 1]);
+			goto fail;
+		}
+
+		*opt = argv[i];
+	}
+
+	if(sort && !(sort_col = listquery_column(lq, (*sort == '-') ? sort + 1 : sort)))
+	{
+		struct stringbuffer *names = stringbuffer_create();
+		for(const struct listquery_column *col = lq->columns; col && col->name; col++)
+		{
+			if(names->len)
+				stringbuffer_append_string(names, ", ");
+			stringbuffer_append_string(names, col->name);
+		}
+
+		error("Cannot sort by `%s'; valid columns: %s", sort, names->len ? names->string : "none");
+		stringbuffer_free(names);
+		goto fail;
+	}
+
+	if((limit && (!*limit || strspn(limit, "0123456789") != strlen(limit))) ||
+	   (offset && (!*offset || strspn(offset, "0123456789") != strlen(offset))))
+	{
+		error("--limit and --offset require a number");
+		goto fail;
+	}
+
+	where = stringbuffer_create();
+	if(server)
+	{
+		char *cond, *subquery;
+
+		// Resolve the name case-insensitively once so the column itself is compared directly
+		asprintf(&subquery, "(SELECT name FROM servers WHERE lower(name) = lower(%s))", listquery_param(lq, strdup(server)));
+		asprintf(&cond, lq->server_cond, subquery);
+		stringbuffer_append_printf(where, " WHERE %s", cond);
+		free(subquery);
+		free(cond);
+	}
+
+	if(mask)
+	{
+		stringbuffer_append_printf(where, " %s %s ILIKE ", where->len ? "AND" : "WHERE", lq->match_expr);
+		stringbuffer_append_string(where, listquery_param(lq, listquery_pattern(mask)));
+	}
+
+	lq->where = strdup(where->len ? where->string : "");
+	stringbuffer_free(where);
+
+	if(sort_col)
+		asprintf(&lq->order, " ORDER BY %s %s, %s", sort_col->expr, (*sort == '-') ? "DESC" : "ASC", lq->default_order);
+	else
+		asprintf(&lq->order, " ORDER BY %s", lq->default_order);
+
+	if(limit && offset)
+		asprintf(&lq->limit, " LIMIT %s OFFSET %s", limit, offset);
+	else if(limit)
+		asprintf(&lq->limit, " LIMIT %s", limit);
+	else if(offset)
+		asprintf(&lq->limit, " OFFSET %s", offset);
+	else
+		lq->limit = strdup("");
+
+	return 0;
+
+fail:
+	listquery_free(lq);
+	return -1;
+}
+
+// Returns the query parameters; they are owned by the caller (i.e. pgsql_query) afterwards
+struct stringlist *listquery_params(struct listquery *lq)
+{
+	struct stringlist *params = lq->params;
+	lq->params = NULL;
+	return params;
+}
+
+void listquery_free(struct listquery *lq)
+{
+	xfree(lq->where);
+	xfree(lq->order);
+	xfree(lq->limit);
+	if(lq->params)
+		stringlist_free(lq->params);
+	lq->where = lq->order = lq->limit = NULL;
+	lq->params = NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef LISTQUERY_H
+#define LISTQUERY_H
+
+struct stringlist;
+
+// Column that may be used with --sort
+struct listquery_column
+{
+	const char *name;
+	const char *expr;
+};
+
+#define LISTQUERY_COLUMN(NAME, EXPR)	{ NAME, EXPR }
+#define LISTQUERY_COLUMN_END		{ NULL, NULL }
+
+// Turns the common list options into SQL clauses:
+//   --server <name>	server_cond (a format string; %s is the server name)
+//   --match <mask>	match_expr ILIKE <mask> (* and ? wildcards)
+//   --sort [-]<col>	ORDER BY <column expr> [DESC], default_order
+//   --limit <n>	LIMIT <n>
+//   --offset <n>	OFFSET <n>
+// A plain argument is used as the server if the list supports it.
+struct listquery
+{
+	const struct listquery_column *columns;
+	const char *match_expr;
+	const char *server_cond;
+	const char *default_order;
+
+	// Set by listquery_parse(); empty strings if not used
+	char *where;
+	char *order;
+	char *limit;
+	struct stringlist *params;
+};
+
+int listquery_parse(struct listquery *lq, int argc, char **argv);
+struct stringlist *listquery_params(struct listquery *lq);
+void listquery_free(struct listquery *lq);
+
+#endif
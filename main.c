@@ -13,27 +13,39 @@
 #include "ssh.h"
 #include "mtrand.h"
 #include "input.h"
+#include "event.h"
+#include "job.h"
+#include "daemon.h"
+#include "format.h"
+#include "snapshot.h"
+#include "script.h"
 #include <getopt.h>
 #include <setjmp.h>
 
 static void sig_int(int n);
 static void signal_init();
-static void handle_line(const char *line);
+static void input_readable(int fd, unsigned int events, void *ctx);
+static void input_line(char *line);
 
 int quit = 0;
 static char *history_file = NULL;
+static const char *prompt = NULL;
+static int prompt_active = 0;
 sigjmp_buf sigint_jmp_buf;
 volatile int sigint_jmp_on = 0;
 volatile int sigint_received = 0;
 int debug_output_enabled = 1;
 int batch_mode = 0;
 int no_colors = 0;
+int output_format = FORMAT_TABLE;
 
 int main(int argc, char **argv)
 {
 	struct stringlist *batch_commands = NULL;
 	const char *home;
-	out("Welcome to the \033[38;5;34mGame\033[38;5;214mSurge\033[0m config management tool.");
+	int daemon_mode = 0, client_mode = 0, ret = 0;
+	char workdir[256] = "";
+	const char *snapshot_file = NULL, *script_file = NULL;
 
 #ifdef DEBUG_OUTPUT
 	debug_output_enabled = 1;
@@ -55,7 +67,7 @@ int main(int argc, char **argv)
 				trim(buf);
 				if(*buf)
 				{
-					out("Working directory: %s", buf);
+					strlcpy(workdir, buf, sizeof(workdir));
 					chdir(buf);
 				}
 			}
@@ -71,10 +83,15 @@ int main(int argc, char **argv)
 		{ "debug", 0, 0, 'd' },
 		{ "batch", 1, 0, 'b' },
 		{ "no-colors", 1, 0, 'c' },
+		{ "daemon", 0, 0, 'D' },
+		{ "client", 0, 0, 'C' },
+		{ "format", 1, 0, 'f' },
+		{ "offline", 1, 0, 'o' },
+		{ "script", 1, 0, 'S' },
 		{ NULL, 0, 0, 0 }
 	};
 
-	while((c = getopt_long(argc, argv, "s::db:c", options, NULL)) != -1)
+	while((c = getopt_long(argc, argv, "s::db:cDCf:o:S:", options, NULL)) != -1)
 	{
 		switch(c)
 		{
@@ -137,25 +154,77 @@ int main(int argc, char **argv)
 			case 'c':
 				no_colors = 1;
 				break;
+
+			case 'D':
+				daemon_mode = 1;
+				batch_mode = 1;
+				break;
+
+			case 'C':
+				client_mode = 1;
+				break;
+
+			case 'f':
+				if((output_format = format_parse(optarg)) < 0)
+				{
+					error("Unknown output format `%s'; use table, tsv or jsonl", optarg);
+					return 1;
+				}
+
+				break;
+
+			case 'o':
+				snapshot_file = optarg;
+				break;
+
+			case 'S':
+				script_file = optarg;
+				batch_mode = 1;
+				break;
 		}
 	}
 
+	// Printed after parsing the options since --format decides where messages go
+	out("Welcome to the \033[38;5;34mGame\033[38;5;214mSurge\033[0m config management tool.");
+	if(*workdir)
+		out("Working directory: %s", workdir);
+
 #ifdef DEBUG_OUTPUT
 	if(debug_output_enabled)
 		out("Debug output is enabled; use -d to disable");
 #endif
 
-	if(batch_mode)
+	// A script may be read from stdin. Otherwise fd 0 stays open on
+	// /dev/null so no other descriptor (epoll, database) can end up there.
+	if(batch_mode && !(script_file && !strcmp(script_file, "-")) && !freopen("/dev/null", "r", stdin))
 		fclose(stdin);
 
 	if(conf_init() != 0)
 		return 1;
 
-	if(pgsql_init() != 0)
+	// Thin client: everything else is done by the daemon
+	if(client_mode)
+	{
+		if(!batch_commands)
+		{
+			error("--client requires at least one --batch command");
+			conf_fini();
+			return 1;
+		}
+
+		ret = daemon_client(batch_commands);
+		stringlist_free(batch_commands);
+		conf_fini();
+		return ret;
+	}
+
+	// Offline mode answers all queries from the snapshot
+	if(snapshot_file ? snapshot_open(snapshot_file) : pgsql_init())
 	{
 		conf_fini();
 		return 1;
 	}
+	table_set_utf8(pgsql_client_utf8());
 
 	history_file = NULL;
 	if(!batch_mode)
@@ -179,62 +248,82 @@ int main(int argc, char **argv)
 			history_file = strdup(tmp);
 	}
 
+	if(!batch_mode)
+	{
+		const char *pager = conf_str("pager");
+		table_set_pager(pager ? pager : getenv("PAGER"));
+	}
+
 	init_genrand(time(NULL));
 	database_init();
 	signal_init();
 	input_init("GSConf", history_file);
+	event_init();
 	ssh_init();
+	job_init(handle_line);
 	cmd_init();
 
 	if(!batch_mode)
 	{
-		char *line = NULL;
-		const char *prompt = conf_get("prompt", DB_STRING);
+		prompt = conf_get("prompt", DB_STRING);
+		event_add(STDIN_FILENO, EV_READ, input_readable, NULL);
+		rl_callback_handler_install(prompt, input_line);
+		prompt_active = 1;
 		while(!quit)
 		{
-			sigsetjmp(sigint_jmp_buf, 1);
 			sigint_received = 0;
-			sigint_jmp_on = 1;
-			line = readline(prompt);
-			sigint_jmp_on = 0;
-
-			if(!line)
-				break;
-			if(*line)
+			if(event_run_once(-1) < 0 && sigint_received && !quit)
 			{
-				handle_line(line);
-				add_history(line);
+				// Ctrl+C at the prompt discards the current line
+				rl_reset_after_signal();
+				rl_replace_line("", 0);
+				putc('\n', stdout);
+				rl_on_new_line();
+				rl_redisplay();
 			}
-			free(line);
-			line = NULL;
 		}
 
-		if(line)
-			free(line);
+		event_del(STDIN_FILENO);
+		if(prompt_active)
+			rl_callback_handler_remove();
 
 		putc('\n', stdout);
 	}
 	else
 	{
-		for(unsigned int i = 0; i < batch_commands->count; i++)
+		for(unsigned int i = 0; batch_commands && i < batch_commands->count; i++)
 		{
 			out("Executing: %s", batch_commands->data[i]);
 			handle_line(batch_commands->data[i]);
 		}
+
+		if(script_file)
+			ret = script_run(script_file);
+
+		// Jobs started with 'bg' must finish; job_fini() would cancel them
+		if(daemon_mode)
+			ret = daemon_run();
+		else if(job_wait_all() != 0)
+			ret = 1;
 	}
 
 	// Cleanup
 	if(batch_commands)
 		stringlist_free(batch_commands);
+	job_fini();
 	cmd_fini();
 	input_fini();
 	ssh_fini();
+	event_fini();
 	database_fini();
-	pgsql_fini();
+	if(snapshot_file)
+		snapshot_close();
+	else
+		pgsql_fini();
 	conf_fini();
 	xfree(history_file);
 
-	return 0;
+	return ret;
 }
 
 static void sig_int(int n)
@@ -261,7 +350,46 @@ static void signal_init()
 	sigaction(SIGINT, &sa, NULL);
 }
 
-static void handle_line(const char *line)
+static void input_readable(int fd, unsigned int events, void *ctx)
+{
+	// Nested event loops (e.g. a pgsql query during tab completion) must not
+	// feed readline recursively.
+	event_del(STDIN_FILENO);
+	rl_callback_read_char();
+	if(!quit && prompt_active && !event_watched(STDIN_FILENO))
+		event_add(STDIN_FILENO, EV_READ, input_readable, NULL);
+}
+
+static void input_line(char *line)
+{
+	// The command may use readline() itself so the callback interface is
+	// disabled until it has finished.
+	rl_callback_handler_remove();
+	prompt_active = 0;
+
+	if(!line)
+	{
+		quit = 1;
+		return;
+	}
+
+	if(*line)
+	{
+		sigint_received = 0;
+		handle_line(line);
+		add_history(line);
+	}
+
+	free(line);
+
+	if(!quit)
+	{
+		rl_callback_handler_install(prompt, input_line);
+		prompt_active = 1;
+	}
+}
+
+void handle_line(const char *line)
 {
 	char *dup;
 	char *argv[32];
@@ -10,5 +10,8 @@ extern int quit;
 extern int debug_output_enabled;
 extern int batch_mode;
 extern int no_colors;
+extern int output_format;
+
+void handle_line(const char *line);
 
 #endif
@@ -0,0 +1,379 @@
+#define MEMSTATS_NO_WRAP
+#include "common.h"
+#include "memstats.h"
+#include "table.h"
+#include <stdint.h>
+
+#ifdef MEMSTATS
+
+#define SITE_BUCKETS	1024
+#define PTR_TOMBSTONE	((void *)1)
+
+// All allocations made at one file:line
+struct memstats_site
+{
+	const char *file;
+	unsigned int line;
+	unsigned long allocs; // since the last reset
+	size_t bytes; // since the last reset
+	unsigned long live;
+	size_t live_bytes;
+	struct memstats_site *next;
+};
+
+// Live allocation; open addressing with tombstones, keyed by pointer
+struct memstats_ptr
+{
+	void *ptr;
+	size_t size;
+	struct memstats_site *site;
+};
+
+static struct memstats_site *sites[SITE_BUCKETS];
+static struct memstats_ptr *ptrs;
+static size_t ptrs_size, ptrs_used; // used includes tombstones
+static size_t live_bytes, peak_bytes;
+static unsigned long live_count, total_allocs;
+static size_t total_bytes;
+
+static struct memstats_site *memstats_site(const char *file, unsigned int line)
+{
+	unsigned int hash = line;
+	struct memstats_site *site;
+
+	for(const char *c = file; *c; c++)
+		hash = hash * 31 + *c;
+	hash %= SITE_BUCKETS;
+
+	for(site = sites[hash]; site; site = site->next)
+	{
+		if(site->line == line && (site->file == file || !strcmp(site->file, file)))
+			return site;
+	}
+
+	site = calloc(1, sizeof(struct memstats_site));
+	site->file = file;
+	site->line = line;
+	site->next = sites[hash];
+	sites[hash] = site;
+	return site;
+}
+
+static size_t memstats_ptr_slot(void *ptr)
+{
+	return ((uintptr_t)ptr >> 4) * 2654435761U & (ptrs_size - 1);
+}
+
+static struct memstats_ptr *memstats_ptr_find(void *ptr)
+{
+	if(!ptrs_size)
+		return NULL;
+
+	for(size_t i = memstats_ptr_slot(ptr); ptrs[i].ptr; i = (i + 1) & (ptrs_size - 1))
+	{
+		if(ptrs[i].ptr == ptr)
+			return &ptrs[i];
+	}
+
+	return NULL;
+}
+
+static void memstats_untrack_entry(struct memstats_ptr *entry)
+{
+	entry->site->live--;
+	entry->site->live_bytes -= entry->size;
+	live_count--;
+	live_bytes -= entry->size;
+	entry->ptr = PTR_TOMBSTONE;
+}
+
+static void memstats_untrack(void *ptr)
+{
+	struct memstats_ptr *entry;
+
+	// Not found if allocated by a library or before being tracked
+	if(ptr && (entry = memstats_ptr_find(ptr)))
+		memstats_untrack_entry(entry);
+}
+
+static void memstats_track(void *ptr, size_t size, const char *file, unsigned int line)
+{
+	struct memstats_site *site;
+	size_t i;
+
+	if(!ptr)
+		return;
+
+	// An address we missed a free() for (e.g. inside a library) may be reused
+	memstats_untrack(ptr);
+
+	if((ptrs_used + 1) * 2 > ptrs_size)
+	{
+		struct memstats_ptr *old = ptrs;
+		size_t old_size = ptrs_size;
+
+		// Rehashing drops the tombstones; only grow if that is not enough
+		ptrs_size = max(1024, (live_count + 1) * 4 > old_size ? old_size * 2 : old_size);
+		ptrs = calloc(ptrs_size, sizeof(struct memstats_ptr));
+		ptrs_used = 0;
+		for(i = 0; i < old_size; i++)
+		{
+			if(!old[i].ptr || old[i].ptr == PTR_TOMBSTONE)
+				continue;
+
+			size_t slot = memstats_ptr_slot(old[i].ptr);
+			while(ptrs[slot].ptr)
+				slot = (slot + 1) & (ptrs_size - 1);
+			ptrs[slot] = old[i];
+			ptrs_used++;
+		}
+
+		free(old);
+	}
+
+	site = memstats_site(file, line);
+	for(i = memstats_ptr_slot(ptr); ptrs[i].ptr && ptrs[i].ptr != PTR_TOMBSTONE; i = (i + 1) & (ptrs_size - 1))
+		;
+	if(!ptrs[i].ptr)
+		ptrs_used++;
+	ptrs[i].ptr = ptr;
+	ptrs[i].size = size;
+	ptrs[i].site = site;
+
+	site->allocs++;
+	site->bytes += size;
+	site->live++;
+	site->live_bytes += size;
+	total_allocs++;
+	total_bytes += size;
+	live_count++;
+	live_bytes += size;
+	if(live_bytes > peak_bytes)
+		peak_bytes = live_bytes;
+}
+
+void *memstats_malloc(size_t size, const char *file, unsigned int line)
+{
+	void *ptr = malloc(size);
+	memstats_track(ptr, size, file, line);
+	return ptr;
+}
+
+void *memstats_calloc(size_t nmemb, size_t size, const char *file, unsigned int line)
+{
+	void *ptr = calloc(nmemb, size);
+	memstats_track(ptr, nmemb * size, file, line);
+	return ptr;
+}
+
+void *memstats_realloc(void *ptr, size_t size, const char *file, unsigned int line)
+{
+	struct memstats_ptr *entry = ptr ? memstats_ptr_find(ptr) : NULL;
+	void *new = realloc(ptr, size);
+
+	if(!new && size)
+		return NULL; // the old block is still valid
+	if(entry)
+		memstats_untrack_entry(entry);
+	memstats_track(new, size, file, line);
+	return new;
+}
+
+char *memstats_strdup(const char *str, const char *file, unsigned int line)
+{
+	char *ptr = strdup(str);
+	memstats_track(ptr, strlen(str) + 1, file, line);
+	return ptr;
+}
+
+char *memstats_strndup(const char *str, size_t n, const char *file, unsigned int line)
+{
+	char *ptr = strndup(str, n);
+	if(ptr)
+		memstats_track(ptr, strlen(ptr) + 1, file, line);
+	return ptr;
+}
+
+int memstats_vasprintf(const char *file, unsigned int line, char **strp, const char *fmt, va_list args)
+{
+	int len = vasprintf(strp, fmt, args);
+	if(len >= 0)
+		memstats_track(*strp, len + 1, file, line);
+	return len;
+}
+
+int memstats_asprintf(const char *file, unsigned int line, char **strp, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = memstats_vasprintf(file, line, strp, fmt, args);
+	va_end(args);
+	return len;
+}
+
+void memstats_free(void *ptr)
+{
+	memstats_untrack(ptr);
+	free(ptr);
+}
+
+static int memstats_cmp_allocs(const void *a, const void *b)
+{
+	const struct memstats_site *x = *(const struct memstats_site **)a;
+	const struct memstats_site *y = *(const struct memstats_site **)b;
+	if(x->allocs != y->allocs)
+		return (x->allocs < y->allocs) - (x->allocs > y->allocs);
+	return (x->live_bytes < y->live_bytes) - (x->live_bytes > y->live_bytes);
+}
+
+// Module name of a site, i.e. the file name without extension
+static size_t memstats_module(const struct memstats_site *site, const char **name)
+{
+	const char *dot;
+
+	*name = strrchr(site->file, '/') ? strrchr(site->file, '/') + 1 : site->file;
+	dot = strrchr(*name, '.');
+	return dot ? (size_t)(dot - *name) : strlen(*name);
+}
+
+void memstats_show(unsigned int top_sites)
+{
+	struct memstats_site *snapshot, **list, **modules;
+	unsigned int count = 0, module_count = 0, row;
+	struct table *table;
+
+	// Work on a snapshot; building the tables allocates memory itself
+	for(int i = 0; i < SITE_BUCKETS; i++)
+		for(struct memstats_site *site = sites[i]; site; site = site->next)
+			count++;
+
+	snapshot = malloc(max(count, 1) * sizeof(struct memstats_site));
+	list = malloc(max(count, 1) * sizeof(struct memstats_site *));
+	modules = calloc(max(count, 1), sizeof(struct memstats_site *));
+	count = 0;
+	for(int i = 0; i < SITE_BUCKETS; i++)
+	{
+		for(struct memstats_site *site = sites[i]; site; site = site->next)
+		{
+			if(!site->allocs && !site->live)
+				continue;
+			snapshot[count] = *site;
+			list[count] = &snapshot[count];
+			count++;
+		}
+	}
+
+	out("Live:   %zu bytes in %lu allocations (peak %zu bytes)", live_bytes, live_count, peak_bytes);
+	out("Total:  %zu bytes in %lu allocations since the last reset", total_bytes, total_allocs);
+
+	// Sum up the sites of each module
+	for(unsigned int i = 0; i < count; i++)
+	{
+		const char *name, *other;
+		size_t len = memstats_module(list[i], &name);
+		unsigned int j;
+
+		for(j = 0; j < module_count; j++)
+		{
+			if(memstats_module(modules[j], &other) == len && !strncmp(name, other, len))
+				break;
+		}
+
+		if(j == module_count)
+		{
+			modules[j] = calloc(1, sizeof(struct memstats_site));
+			modules[j]->file = list[i]->file;
+			module_count++;
+		}
+
+		modules[j]->allocs += list[i]->allocs;
+		modules[j]->bytes += list[i]->bytes;
+		modules[j]->live += list[i]->live;
+		modules[j]->live_bytes += list[i]->live_bytes;
+	}
+
+	qsort(modules, module_count, sizeof(struct memstats_site *), memstats_cmp_allocs);
+	table = table_create(5, module_count);
+	table_set_header(table, "Module", "Allocs", "Bytes", "Live", "Live bytes");
+	table_free_column(table, 0, 1);
+	for(unsigned int i = 1; i < 5; i++)
+	{
+		table_free_column(table, i, 1);
+		table_ralign_column(table, i, 1);
+	}
+
+	for(row = 0; row < module_count; row++)
+	{
+		const char *name;
+		size_t len = memstats_module(modules[row], &name);
+		table_col_fmt(table, row, 0, "%.*s", (int)len, name);
+		table_col_fmt(table, row, 1, "%lu", modules[row]->allocs);
+		table_col_fmt(table, row, 2, "%zu", modules[row]->bytes);
+		table_col_fmt(table, row, 3, "%lu", modules[row]->live);
+		table_col_fmt(table, row, 4, "%zu", modules[row]->live_bytes);
+		free(modules[row]);
+	}
+
+	table_send(table);
+	table_free(table);
+
+	qsort(list, count, sizeof(struct memstats_site *), memstats_cmp_allocs);
+	count = min(count, top_sites);
+	table = table_create(5, count);
+	table_set_header(table, "Site", "Allocs", "Bytes", "Live", "Live bytes");
+	table_free_column(table, 0, 1);
+	for(unsigned int i = 1; i < 5; i++)
+	{
+		table_free_column(table, i, 1);
+		table_ralign_column(table, i, 1);
+	}
+
+	for(row = 0; row < count; row++)
+	{
+		table_col_fmt(table, row, 0, "%s:%u", list[row]->file, list[row]->line);
+		table_col_fmt(table, row, 1, "%lu", list[row]->allocs);
+		table_col_fmt(table, row, 2, "%zu", list[row]->bytes);
+		table_col_fmt(table, row, 3, "%lu", list[row]->live);
+		table_col_fmt(table, row, 4, "%zu", list[row]->live_bytes);
+	}
+
+	out("Top %u call sites:", count);
+	table_send(table);
+	table_free(table);
+	free(modules);
+	free(list);
+	free(snapshot);
+}
+
+// Live allocations are still tracked; only the counters start over
+void memstats_reset()
+{
+	for(int i = 0; i < SITE_BUCKETS; i++)
+	{
+		for(struct memstats_site *site = sites[i]; site; site = site->next)
+		{
+			site->allocs = 0;
+			site->bytes = 0;
+		}
+	}
+
+	total_allocs = 0;
+	total_bytes = 0;
+	peak_bytes = live_bytes;
+}
+
+#else
+
+void memstats_show(unsigned int top_sites)
+{
+	error("Allocation statistics are not available; rebuild with `make clean && make MEMSTATS=1'");
+}
+
+void memstats_reset()
+{
+	memstats_show(0);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+// Allocation statistics; only collected when built with `make MEMSTATS=1'.
+// The allocation functions are then replaced by wrappers which record the
+// file and line of every allocation; see the `memstats' command.
+
+void memstats_show(unsigned int top_sites);
+void memstats_reset();
+
+#ifdef MEMSTATS
+void *memstats_malloc(size_t size, const char *file, unsigned int line);
+void *memstats_calloc(size_t nmemb, size_t size, const char *file, unsigned int line);
+void *memstats_realloc(void *ptr, size_t size, const char *file, unsigned int line);
+char *memstats_strdup(const char *str, const char *file, unsigned int line);
+char *memstats_strndup(const char *str, size_t n, const char *file, unsigned int line);
+int memstats_asprintf(const char *file, unsigned int line, char **strp, const char *fmt, ...) PRINTF_LIKE(4, 5);
+int memstats_vasprintf(const char *file, unsigned int line, char **strp, const char *fmt, va_list args);
+void memstats_free(void *ptr);
+
+#ifndef MEMSTATS_NO_WRAP
+#undef strdup
+#undef strndup
+#define malloc(SIZE)			memstats_malloc((SIZE), __FILE__, __LINE__)
+#define calloc(NMEMB, SIZE)		memstats_calloc((NMEMB), (SIZE), __FILE__, __LINE__)
+#define realloc(PTR, SIZE)		memstats_realloc((PTR), (SIZE), __FILE__, __LINE__)
+#define strdup(STR)			memstats_strdup((STR), __FILE__, __LINE__)
+#define strndup(STR, N)			memstats_strndup((STR), (N), __FILE__, __LINE__)
+#define asprintf(STRP, ...)		memstats_asprintf(__FILE__, __LINE__, (STRP), __VA_ARGS__)
+#define vasprintf(STRP, FMT, ARGS)	memstats_vasprintf(__FILE__, __LINE__, (STRP), (FMT), (ARGS))
+// Not function-like so it also catches free being passed as a callback
+#define free				memstats_free
+#endif
+#endif
+
+#endif
@@ -2,8 +2,14 @@
 #include "conf.h"
 #include "pgsql.h"
 #include "stringlist.h"
+#include "event.h"
+#include "snapshot.h"
+#include "cmd.h"
+#include "input.h"
 
 static PGconn *conn = NULL;
+// Nested transactions are savepoints so commands work inside scripts
+static unsigned int transaction_depth = 0;
 
 int pgsql_init()
 {
@@ -26,6 +32,36 @@ int pgsql_init()
 	return 0;
 }
 
+// The connection is shared with the parent after fork(); the child must not
+// use it (or even PQfinish() it) so it simply drops it and reconnects.
+int pgsql_after_fork()
+{
+	if(snapshot_offline())
+		return 0;
+
+	close(PQsocket(conn));
+	conn = NULL;
+	transaction_depth = 0;
+	return pgsql_init();
+}
+
+// Re-establishes the connection if it was lost (used by the daemon between commands)
+int pgsql_check()
+{
+	if(snapshot_offline() || PQstatus(conn) == CONNECTION_OK)
+		return 0;
+
+	error("Lost connection to database; reconnecting");
+	PQreset(conn);
+	if(PQstatus(conn) != CONNECTION_OK)
+	{
+		error("Connection to database failed: %s", PQerrorMessage(conn));
+		return 1;
+	}
+
+	return 0;
+}
+
 void pgsql_fini()
 {
 	PQfinish(conn);
@@ -45,7 +81,12 @@ int pgsql_num_rows(PGresult *res)
 
 int pgsql_num_affected(PGresult *res)
 {
-	const char *str = PQcmdTuples(res);
+	const char *str;
+
+	if(!res)
+		return 0;
+
+	str = PQcmdTuples(res);
 	assert(*str);
 	return atoi(str);
 }
@@ -71,22 +112,278 @@ const char *pgsql_nvalue(PGresult *res, int row, const char *col)
 	return PQgetvalue(res, row, fnum);
 }
 
+static void pgsql_send(const char *query, struct stringlist *params)
+{
+	if(!PQsendQueryParams(conn, query, params ? params->count : 0, NULL, params ? (const char*const*)params->data : NULL, NULL, NULL, 0))
+	{
+		error("Could not send query: %s", PQerrorMessage(conn));
+		exit(1);
+	}
+}
+
+// Like PQgetResult() but keeps the event loop running while waiting for the server
+static PGresult *pgsql_next_result()
+{
+	while(PQisBusy(conn))
+	{
+		event_wait_fd(PQsocket(conn), EV_READ, -1);
+		if(!PQconsumeInput(conn))
+		{
+			error("Could not read from database: %s", PQerrorMessage(conn));
+			exit(1);
+		}
+	}
+
+	return PQgetResult(conn);
+}
+
+// Like PQexecParams() but keeps the event loop running while waiting for the server
+static PGresult *pgsql_exec(const char *query, struct stringlist *params)
+{
+	PGresult *res = NULL, *tmp;
+
+	pgsql_send(query, params);
+
+	// Only the last result is returned, just like PQexec() does
+	while((tmp = pgsql_next_result()))
+	{
+		if(res)
+			PQclear(res);
+		res = tmp;
+	}
+
+	return res;
+}
+
+// Answers a query from the snapshot in offline mode. Queries that are not in
+// it return no rows so completions and lookups simply find nothing; changes
+// abort the command.
+static PGresult *pgsql_exec_offline(const char *query, struct stringlist *params)
+{
+	PGresult *res;
+
+	if((res = snapshot_lookup(query, params)))
+		return res;
+
+	// Transactions do not matter since nothing can be changed
+	static const char *noop[] = { "BEGIN", "COMMIT", "ROLLBACK", "SAVEPOINT", "RELEASE", "SET TRANSACTION", NULL };
+	for(unsigned int i = 0; noop[i]; i++)
+	{
+		if(!strncasecmp(query, noop[i], strlen(noop[i])))
+			return PQmakeEmptyPGresult(NULL, PGRES_COMMAND_OK);
+	}
+
+	query += strspn(query, " \t\r\n(");
+	if(strncasecmp(query, "SELECT", 6) && strncasecmp(query, "WITH", 4))
+	{
+		error("Database changes are not possible in offline mode");
+		return PQmakeEmptyPGresult(NULL, PGRES_FATAL_ERROR);
+	}
+
+	// Tab completions just find nothing
+	if(cmd_running() && !input_completing())
+		error("Not available in offline mode; the snapshot only contains the queries of the read-only commands without options");
+	debug("Query: %s", query);
+	return PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+}
+
+// Calls func for every row as soon as it has been received instead of
+// buffering the whole result. Before the first row func is called once
+// with row -1 so the column names/types can be used.
+int pgsql_query_stream(const char *query, struct stringlist *params, pgsql_row_f *func, void *ctx)
+{
+	PGresult *res;
+	int rows = 0, header_sent = 0;
+
+	// Single rows cannot be recorded, so `snapshot export' gets the whole result
+	if(snapshot_offline() || snapshot_recording())
+	{
+		res = pgsql_query(query, 1, params);
+		func(res, -1, ctx);
+		for(; rows < PQntuples(res); rows++)
+			func(res, rows, ctx);
+		pgsql_free(res);
+		return rows;
+	}
+
+	pgsql_send(query, params);
+	if(!PQsetSingleRowMode(conn))
+		debug("Could not enable single-row mode");
+
+	while((res = pgsql_next_result()))
+	{
+		switch(PQresultStatus(res))
+		{
+			case PGRES_SINGLE_TUPLE:
+			case PGRES_TUPLES_OK:
+				if(!header_sent)
+				{
+					func(res, -1, ctx);
+					header_sent = 1;
+				}
+
+				// TUPLES_OK is empty in single-row mode and contains everything otherwise
+				for(int i = 0; i < PQntuples(res); i++, rows++)
+					func(res, i, ctx);
+				break;
+
+			case PGRES_COMMAND_OK:
+				break;
+
+			default:
+				error("Unexpected PG result status (%s): %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessage(res));
+				exit(1);
+		}
+
+		PQclear(res);
+	}
+
+	if(params)
+		stringlist_free(params);
+
+	return rows;
+}
+
+// Runs a COPY ... FROM STDIN and sends data as its input. Unlike the other
+// query functions this does not exit on errors since the data may violate
+// constraints; the caller should roll back the transaction.
+int pgsql_copy_from(const char *query, const char *data, size_t len)
+{
+	PGresult *res;
+	int ret = 0;
+
+	if(snapshot_offline())
+	{
+		error("Database changes are not possible in offline mode");
+		return -1;
+	}
+
+	pgsql_send(query, NULL);
+	res = pgsql_next_result();
+	if(PQresultStatus(res) != PGRES_COPY_IN)
+	{
+		error("Unexpected PG result status (%s): %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessage(res));
+		ret = -1;
+	}
+	else
+	{
+		// Blocks while the send buffer is full; COPY data is not worth a callback
+		for(size_t pos = 0; pos < len && ret == 0; pos += 65536)
+		{
+			if(PQputCopyData(conn, data + pos, min(len - pos, 65536)) != 1)
+				ret = -1;
+		}
+
+		if(PQputCopyEnd(conn, ret ? "aborted" : NULL) != 1)
+			ret = -1;
+	}
+
+	PQclear(res);
+	while((res = pgsql_next_result()))
+	{
+		if(PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			error("%s", PQresultErrorMessage(res));
+			ret = -1;
+		}
+		else if(ret >= 0)
+			ret = atoi(PQcmdTuples(res));
+
+		PQclear(res);
+	}
+
+	return ret;
+}
+
+// Runs a COPY ... TO STDOUT and writes its output to fp. Returns the number
+// of rows.
+int pgsql_copy_to(const char *query, FILE *fp)
+{
+	PGresult *res;
+	char *buf;
+	int len, ret = 0;
+
+	if(snapshot_offline())
+	{
+		error("Not available in offline mode");
+		return -1;
+	}
+
+	pgsql_send(query, NULL);
+	res = pgsql_next_result();
+	if(PQresultStatus(res) != PGRES_COPY_OUT)
+	{
+		error("Unexpected PG result status (%s): %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessage(res));
+		exit(1);
+	}
+
+	PQclear(res);
+	while(1)
+	{
+		// 0 means nothing has been received yet
+		if((len = PQgetCopyData(conn, &buf, 1)) == 0)
+		{
+			event_wait_fd(PQsocket(conn), EV_READ, -1);
+			if(!PQconsumeInput(conn))
+			{
+				error("Could not read from database: %s", PQerrorMessage(conn));
+				exit(1);
+			}
+
+			continue;
+		}
+		else if(len < 0)
+			break;
+
+		fwrite(buf, 1, len, fp);
+		PQfreemem(buf);
+	}
+
+	while((res = pgsql_next_result()))
+	{
+		if(PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			error("Unexpected PG result status (%s): %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessage(res));
+			exit(1);
+		}
+
+		ret = atoi(PQcmdTuples(res));
+		PQclear(res);
+	}
+
+	return ret;
+}
+
+// Returns NULL for changes refused in offline mode (the error has been reported)
 PGresult *pgsql_query(const char *query, int want_result, struct stringlist *params)
 {
 	PGresult *res = NULL;
 
-	res = PQexecParams(conn, query, params ? params->count : 0, NULL, params ? (const char*const*)params->data : NULL, NULL, NULL, 0);
+	res = snapshot_offline() ? pgsql_exec_offline(query, params) : pgsql_exec(query, params);
 	switch(PQresultStatus(res))
 	{
 		case PGRES_COMMAND_OK:
 		case PGRES_TUPLES_OK:
 			break;
 
+		case PGRES_FATAL_ERROR:
+			if(snapshot_offline())
+			{
+				PQclear(res);
+				if(params)
+					stringlist_free(params);
+				return NULL;
+			}
+			error("Unexpected PG result status (%s): %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessage(res));
+			exit(1);
+
 		default:
 			error("Unexpected PG result status (%s): %s", PQresStatus(PQresultStatus(res)), PQresultErrorMessage(res));
 			exit(1);
 	}
 
+	snapshot_record(query, params, res);
+
 	if(params)
 		stringlist_free(params);
 
@@ -139,17 +436,61 @@ int pgsql_valid_for_type(const char *value, const char *type)
 	return valid;
 }
 
+// Values from the schema are LATIN1 unless the connection was told otherwise;
+// offline snapshots keep the bytes they were recorded with
+int pgsql_client_utf8()
+{
+	return conn && PQclientEncoding(conn) == pg_char_to_encoding("UTF8");
+}
+
+unsigned int pgsql_transaction_depth()
+{
+	return transaction_depth;
+}
+
 void pgsql_begin()
 {
-	pgsql_query("BEGIN TRANSACTION", 0, NULL);
+	char query[32];
+
+	if(!transaction_depth++)
+	{
+		pgsql_query("BEGIN TRANSACTION", 0, NULL);
+		return;
+	}
+
+	snprintf(query, sizeof(query), "SAVEPOINT nested_%u", transaction_depth);
+	pgsql_query(query, 0, NULL);
 }
 
 void pgsql_commit()
 {
-	pgsql_query("COMMIT", 0, NULL);
+	char query[48];
+
+	assert(transaction_depth);
+	if(!--transaction_depth)
+	{
+		pgsql_query("COMMIT", 0, NULL);
+		return;
+	}
+
+	snprintf(query, sizeof(query), "RELEASE SAVEPOINT nested_%u", transaction_depth + 1);
+	pgsql_query(query, 0, NULL);
 }
 
 void pgsql_rollback()
 {
-	pgsql_query("ROLLBACK", 0, NULL);
+	char query[48];
+
+	assert(transaction_depth);
+	if(!--transaction_depth)
+	{
+		pgsql_query("ROLLBACK", 0, NULL);
+		return;
+	}
+
+	// Only undoes what happened since the matching pgsql_begin()
+	snprintf(query, sizeof(query), "ROLLBACK TO SAVEPOINT nested_%u", transaction_depth + 1);
+	pgsql_query(query, 0, NULL);
+	snprintf(query, sizeof(query), "RELEASE SAVEPOINT nested_%u", transaction_depth + 1);
+	pgsql_query(query, 0, NULL);
 }
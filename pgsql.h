@@ -5,8 +5,12 @@
 
 struct stringlist;
 
+typedef void (pgsql_row_f)(PGresult *res, int row, void *ctx);
+
 int pgsql_init();
 void pgsql_fini();
+int pgsql_after_fork();
+int pgsql_check();
 
 void pgsql_free(PGresult *res);
 int pgsql_num_rows(PGresult *res);
@@ -14,10 +18,15 @@ int pgsql_num_affected(PGresult *res);
 const char *pgsql_value(PGresult *res, int row, int col);
 const char *pgsql_nvalue(PGresult *res, int row, const char *col);
 PGresult *pgsql_query(const char *query, int want_result, struct stringlist *params);
+int pgsql_query_stream(const char *query, struct stringlist *params, pgsql_row_f *func, void *ctx);
+int pgsql_copy_from(const char *query, const char *data, size_t len);
+int pgsql_copy_to(const char *query, FILE *fp);
 int pgsql_query_int(const char *query, struct stringlist *params);
 int pgsql_query_bool(const char *query, struct stringlist *params);
 char *pgsql_query_str(const char *query, struct stringlist *params);
 int pgsql_valid_for_type(const char *value, const char *type);
+int pgsql_client_utf8();
+unsigned int pgsql_transaction_depth();
 void pgsql_begin();
 void pgsql_commit();
 void pgsql_rollback();
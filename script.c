@@ -0,0 +1,217 @@
+#include "common.h"
+#include "script.h"
+#include "main.h"
+#include "cmd.h"
+#include "pgsql.h"
+#include "configs.h"
+#include "event.h"
+#include "stringlist.h"
+#include "tokenize.h"
+
+// Commands which build, upload or activate configs. In a script they only
+// run after the last transaction has been committed, in script order, so
+// they never see uncommitted changes and nothing is uploaded for changes
+// which are rolled back later.
+static char *deferred_argv[][2] = {
+	{ "conf", "build" },
+	{ "conf", "put" },
+	{ "conf", "rehash" },
+	{ "conf", "sync" },
+	{ "conf", "quicksync" },
+	{ "conf", "stage" },
+	{ "retry", NULL }
+};
+
+#define DEFERRED_COUNT	(sizeof(deferred_argv) / sizeof(deferred_argv[0]))
+
+// Returns the command run by the line, looking through `bg' and `timeout';
+// its arguments start at argv[*args]
+static struct command *script_lookup(int argc, char **argv, int *args)
+{
+	char *bg_argv[] = { "bg" }, *timeout_argv[] = { "timeout" };
+	struct command *cmd, *bg_cmd, *timeout_cmd;
+	int words, offset = 0;
+
+	bg_cmd = cmd_lookup(1, bg_argv, &words);
+	timeout_cmd = cmd_lookup(1, timeout_argv, &words);
+	while((cmd = cmd_lookup(argc - offset, argv + offset, &words)))
+	{
+		int skip = (cmd->func == bg_cmd->func) ? 1 : (cmd->func == timeout_cmd->func) ? 2 : 0;
+		if(!skip || argc - offset <= skip)
+			break;
+		offset += skip;
+	}
+
+	*args = offset + words;
+	return cmd;
+}
+
+// Runs the commands in a file (- for stdin), one per line. Commands outside
+// of begin/end blocks are grouped into one transaction up to the next begin
+// or the end of the script; every block is a transaction of its own. The
+// first failing command rolls back its transaction and stops the script.
+// Config commands are deferred until everything has been committed.
+int script_run(const char *filename)
+{
+	cmd_func *deferred_funcs[DEFERRED_COUNT];
+	struct command *build_cmd = NULL;
+	struct stringlist *deferred = stringlist_create(), *builds = stringlist_create();
+	unsigned long long start = event_now(), elapsed;
+	unsigned int line_num = 0, block_start = 0, transaction_start = 0, commands = 0;
+	unsigned int *deferred_lines = NULL;
+	int words, args, deferred_cmd, in_transaction = 0, build_all = 0, failed = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *fp, *devnull, *instream = rl_instream;
+
+	if(!strcmp(filename, "-"))
+		fp = stdin;
+	else if(!(fp = fopen(filename, "r")))
+	{
+		error("Could not open script `%s': %s", filename, strerror(errno));
+		stringlist_free(deferred);
+		stringlist_free(builds);
+		return 1;
+	}
+
+	// The script may be on stdin; commands must not read their answers from it
+	if((devnull = fopen("/dev/null", "r")))
+		rl_instream = devnull;
+
+	for(unsigned int i = 0; i < DEFERRED_COUNT; i++)
+	{
+		struct command *cmd = cmd_lookup(deferred_argv[i][1] ? 2 : 1, deferred_argv[i], &words);
+		assert(cmd);
+		deferred_funcs[i] = cmd->func;
+		if(!i)
+			build_cmd = cmd;
+	}
+
+	while(!failed && getline(&line, &line_size, fp) > 0)
+	{
+		char *argv[32], *dup, *str = trim(line);
+		struct command *cmd;
+		unsigned int errors;
+		int argc;
+
+		line_num++;
+		if(!*str || *str == '#')
+			continue;
+
+		dup = strdup(str);
+		argc = tokenize_quoted(dup, argv, 32);
+		if(!strcasecmp(argv[0], "begin") || !strcasecmp(argv[0], "end"))
+		{
+			int begin = !strcasecmp(argv[0], "begin");
+			free(dup);
+			if(begin == !!block_start)
+			{
+				error("Line %u: `%s' without %s", line_num, str, begin ? "`end' of the previous block" : "`begin'");
+				failed = 1;
+				break;
+			}
+
+			if(in_transaction)
+				pgsql_commit();
+			in_transaction = begin;
+			block_start = transaction_start = begin ? line_num : 0;
+			if(begin)
+				pgsql_begin();
+			continue;
+		}
+
+		cmd = script_lookup(argc, argv, &args);
+		deferred_cmd = 0;
+		for(unsigned int i = 0; cmd && i < DEFERRED_COUNT; i++)
+			deferred_cmd |= (cmd->func == deferred_funcs[i]);
+
+		if(deferred_cmd)
+		{
+			// Builds only depend on the final state of the database, so
+			// building a config again would produce the same result
+			if(cmd->func == build_cmd->func)
+			{
+				if(build_all || (args < argc && stringlist_find(builds, argv[args]) != -1))
+					deferred_cmd = 0;
+				else if(args < argc)
+					stringlist_add(builds, strdup(argv[args]));
+				else
+					build_all = 1;
+			}
+
+			if(deferred_cmd)
+			{
+				stringlist_add(deferred, strdup(str));
+				deferred_lines = realloc(deferred_lines, deferred->count * sizeof(unsigned int));
+				deferred_lines[deferred->count - 1] = line_num;
+			}
+			commands++;
+			free(dup);
+			continue;
+		}
+
+		free(dup);
+		if(!in_transaction)
+		{
+			pgsql_begin();
+			in_transaction = 1;
+			transaction_start = line_num;
+		}
+
+		errors = error_count;
+		handle_line(str);
+		commands++;
+		if(error_count != errors)
+		{
+			error("Line %u: `%s' failed", line_num, str);
+			failed = 1;
+		}
+	}
+
+	if(!failed && block_start)
+	{
+		error("Line %u: `begin' without `end'", block_start);
+		failed = 1;
+	}
+
+	if(in_transaction)
+	{
+		if(failed)
+		{
+			pgsql_rollback();
+			error("The changes since line %u have been rolled back", transaction_start);
+		}
+		else
+			pgsql_commit();
+	}
+
+	xfree(line);
+	if(fp != stdin)
+		fclose(fp);
+	if(devnull)
+		fclose(devnull);
+	rl_instream = instream;
+
+	elapsed = max(event_now() - start, 1);
+	out("%u commands in %.2fs (%.0f commands/s)", commands, elapsed / 1000.0, commands * 1000.0 / elapsed);
+
+	if(failed && deferred->count)
+		error("The config commands of the script have been skipped");
+	for(unsigned int i = 0; !failed && i < deferred->count; i++)
+	{
+		unsigned int errors = error_count;
+
+		out("Executing: %s", deferred->data[i]);
+		handle_line(deferred->data[i]);
+		if(error_count != errors)
+		{
+			error("Line %u: `%s' failed; the config commands after it have been skipped", deferred_lines[i], deferred->data[i]);
+			failed = 1;
+		}
+	}
+
+	xfree(deferred_lines);
+	stringlist_free(deferred);
+	stringlist_free(builds);
+	return failed;
+}
@@ -0,0 +1,6 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+int script_run(const char *filename);
+
+#endif
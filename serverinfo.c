@@ -4,6 +4,7 @@
 #include "pgsql.h"
 #include "stringlist.h"
 #include "conf.h"
+#include "arena.h"
 
 static struct server_type server_types[] = {
 	{ "0", NULL, NULL },
@@ -37,13 +38,34 @@ int serverinfo_type_from_db(const char *db_type)
 	return 0;
 }
 
+// Inside a command the record is allocated from its arena and released
+// together with it; serverinfo_free() is still safe to call.
 struct server_info *serverinfo_load_pg(PGresult *res, int row)
 {
-	struct server_info *data = malloc(sizeof(struct server_info));
-	memset(data, 0, sizeof(struct server_info));
-	data->free_self = 1;
+	struct arena *arena = arena_current;
+	struct server_info *data;
+	const char *value;
+
+	if(arena)
+	{
+		data = arena_alloc(arena, sizeof(struct server_info));
+		memset(data, 0, sizeof(struct server_info));
+		data->arena = arena;
+	}
+	else
+	{
+		data = malloc(sizeof(struct server_info));
+		memset(data, 0, sizeof(struct server_info));
+		data->free_self = 1;
+	}
 
-#define LOAD_FIELD(FIELD)	data->FIELD = xstrdup(pgsql_nvalue(res, row, #FIELD));
+#define LOAD_FIELD(FIELD) \
+	do { \
+		if(!(value = pgsql_nvalue(res, row, #FIELD))) \
+			data->FIELD = NULL; \
+		else \
+			data->FIELD = arena ? arena_strdup(arena, value) : strdup(value); \
+	} while(0)
 	LOAD_FIELD(name);
 	LOAD_FIELD(numeric);
 	LOAD_FIELD(link_pass);
@@ -551,6 +573,9 @@ void serverinfo_show(struct server_info *info)
 
 void serverinfo_free(struct server_info *info)
 {
+	if(info->arena)
+		return;
+
 	xfree(info->name);
 	xfree(info->numeric);
 	xfree(info->link_pass);
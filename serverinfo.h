@@ -3,6 +3,8 @@
 
 #include <libpq-fe.h>
 
+struct arena;
+
 struct server_type
 {
 	const char *idx;
@@ -40,6 +42,7 @@ struct server_info
 
 	PGresult *db_res;
 	int free_self;
+	struct arena *arena; // set if the struct and its strings live in an arena
 };
 
 const char *serverinfo_db_from_type(struct server_info *info);
@@ -0,0 +1,617 @@
+#include "common.h"
+#include "snapshot.h"
+#include "stringlist.h"
+#include "stringbuffer.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+// File layout (host byte order; the records keep the parts 8-byte aligned):
+//   header
+//   entries[entry_count]	one per query, sorted by hash
+//   fields[field_count]	column descriptions of all results
+//   cells[cell_count]		values of all results, row by row
+//   strings[strings_len]	NUL-terminated strings, each stored once
+// The key of a query is its text followed by \x1e and the value of each
+// parameter. All references between the parts are array indexes/offsets.
+
+#define SNAPSHOT_MAGIC	"GSSNAP01"
+#define SNAPSHOT_NULL	0xffffffff
+#define KEY_SEPARATOR	'\x1e'
+
+struct snapshot_header
+{
+	char magic[8];
+	uint64_t created;
+	uint32_t entry_count;
+	uint32_t field_count;
+	uint32_t cell_count;
+	uint32_t strings_len;
+};
+
+struct snapshot_entry
+{
+	uint64_t hash;
+	uint32_t key;
+	uint32_t field; // first field of the result
+	uint32_t cell; // first cell of the result
+	uint32_t nfields;
+	uint32_t ntuples;
+	uint32_t unused;
+};
+
+struct snapshot_field
+{
+	uint32_t name;
+	uint32_t type; // oid of the column type
+};
+
+struct snapshot_cell
+{
+	uint32_t value; // SNAPSHOT_NULL for NULL
+	uint32_t length;
+};
+
+// Open addressing hash of the strings/entries added while recording;
+// slots contain index + 1 so 0 is free
+struct snapshot_hash
+{
+	uint32_t *slots;
+	uint32_t size;
+	uint32_t count;
+};
+
+static struct
+{
+	void *map;
+	size_t length;
+	const struct snapshot_header *header;
+	const struct snapshot_entry *entries;
+	const struct snapshot_field *fields;
+	const struct snapshot_cell *cells;
+	const char *strings;
+} offline;
+
+static struct
+{
+	int active;
+	struct snapshot_entry *entries;
+	uint32_t entry_count, entry_size;
+	struct snapshot_field *fields;
+	uint32_t field_count, field_size;
+	struct snapshot_cell *cells;
+	uint32_t cell_count, cell_size;
+	char *strings;
+	uint32_t strings_len, strings_size;
+	struct snapshot_hash entry_hash;
+	struct snapshot_hash string_hash;
+} rec;
+
+static uint64_t snapshot_hash_data(const char *data, size_t len);
+static char *snapshot_key(const char *query, struct stringlist *params, size_t *len);
+static int snapshot_check(const char *filename);
+static const struct snapshot_entry *snapshot_find(const char *query, struct stringlist *params);
+static struct stringlist *snapshot_canonical_params(struct stringlist *params);
+static uint32_t *snapshot_hash_slot(struct snapshot_hash *hash, uint64_t value, const char *data, size_t len, int strings);
+static void snapshot_hash_grow(struct snapshot_hash *hash, int strings);
+static uint32_t snapshot_add_string(const char *str, size_t len);
+static int snapshot_cmp_entry(const void *a, const void *b);
+static void snapshot_record_free();
+
+// FNV-1a
+static uint64_t snapshot_hash_data(const char *data, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static char *snapshot_key(const char *query, struct stringlist *params, size_t *len)
+{
+	struct stringbuffer *buf = stringbuffer_create();
+	char *key;
+
+	stringbuffer_append_string(buf, query);
+	for(unsigned int i = 0; params && i < params->count; i++)
+	{
+		stringbuffer_append_char(buf, KEY_SEPARATOR);
+		stringbuffer_append_string(buf, params->data[i] ? params->data[i] : "");
+	}
+
+	*len = buf->len;
+	key = strdup(buf->string);
+	stringbuffer_free(buf);
+	return key;
+}
+
+int snapshot_offline()
+{
+	return offline.map != NULL;
+}
+
+int snapshot_recording()
+{
+	return rec.active;
+}
+
+// Makes sure every reference in the file stays inside the mapping so
+// lookups do not need any further checks
+static int snapshot_check(const char *filename)
+{
+	const struct snapshot_header *header = offline.header;
+	uint64_t expected;
+
+	if(offline.length < sizeof(struct snapshot_header) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)))
+	{
+		error("`%s' is not a gsconf snapshot", filename);
+		return 1;
+	}
+
+	expected = sizeof(struct snapshot_header) +
+		   (uint64_t)header->entry_count * sizeof(struct snapshot_entry) +
+		   (uint64_t)header->field_count * sizeof(struct snapshot_field) +
+		   (uint64_t)header->cell_count * sizeof(struct snapshot_cell) +
+		   header->strings_len;
+	if(expected != offline.length || !header->strings_len || offline.strings[header->strings_len - 1])
+	{
+		error("Snapshot `%s' is truncated or corrupt", filename);
+		return 1;
+	}
+
+	for(uint32_t i = 0; i < header->entry_count; i++)
+	{
+		const struct snapshot_entry *entry = &offline.entries[i];
+		if(entry->key >= header->strings_len ||
+		   (uint64_t)entry->field + entry->nfields > header->field_count ||
+		   (uint64_t)entry->cell + (uint64_t)entry->nfields * entry->ntuples > header->cell_count ||
+		   (i && entry->hash < offline.entries[i - 1].hash))
+		{
+			error("Snapshot `%s' contains an invalid entry", filename);
+			return 1;
+		}
+	}
+
+	for(uint32_t i = 0; i < header->field_count; i++)
+	{
+		if(offline.fields[i].name >= header->strings_len)
+		{
+			error("Snapshot `%s' contains an invalid field", filename);
+			return 1;
+		}
+	}
+
+	for(uint32_t i = 0; i < header->cell_count; i++)
+	{
+		const struct snapshot_cell *cell = &offline.cells[i];
+		if(cell->value != SNAPSHOT_NULL && (uint64_t)cell->value + cell->length >= header->strings_len)
+		{
+			error("Snapshot `%s' contains an invalid value", filename);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int snapshot_open(const char *filename)
+{
+	struct stat statinfo;
+	char date[64];
+	time_t created;
+	int fd;
+
+	if((fd = open(filename, O_RDONLY)) < 0)
+	{
+		error("Could not open snapshot `%s': %s", filename, strerror(errno));
+		return 1;
+	}
+
+	if(fstat(fd, &statinfo) != 0 || statinfo.st_size == 0)
+	{
+		error("Could not read snapshot `%s'", filename);
+		close(fd);
+		return 1;
+	}
+
+	offline.length = statinfo.st_size;
+	offline.map = mmap(NULL, offline.length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(offline.map == MAP_FAILED)
+	{
+		error("mmap() failed: %s (%d)", strerror(errno), errno);
+		offline.map = NULL;
+		return 1;
+	}
+
+	offline.header = offline.map;
+	offline.entries = (const struct snapshot_entry *)(offline.header + 1);
+	offline.fields = (const struct snapshot_field *)(offline.entries + offline.header->entry_count);
+	offline.cells = (const struct snapshot_cell *)(offline.fields + offline.header->field_count);
+	offline.strings = (const char *)(offline.cells + offline.header->cell_count);
+	if(snapshot_check(filename) != 0)
+	{
+		snapshot_close();
+		return 1;
+	}
+
+	created = offline.header->created;
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&created));
+	out("Offline mode: using snapshot `%s' from %s (%u query results)", filename, date, offline.header->entry_count);
+	return 0;
+}
+
+void snapshot_close()
+{
+	if(offline.map)
+		munmap(offline.map, offline.length);
+	memset(&offline, 0, sizeof(offline));
+}
+
+// Returns a result built from the snapshot or NULL if the query is not in it
+static const struct snapshot_entry *snapshot_find(const char *query, struct stringlist *params)
+{
+	const struct snapshot_entry *entry = NULL;
+	size_t len;
+	char *key = snapshot_key(query, params, &len);
+	uint64_t hash = snapshot_hash_data(key, len);
+	uint32_t low = 0, high = offline.header->entry_count;
+
+	while(low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if(offline.entries[mid].hash < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	for(; low < offline.header->entry_count && offline.entries[low].hash == hash; low++)
+	{
+		if(!strcmp(offline.strings + offline.entries[low].key, key))
+		{
+			entry = &offline.entries[low];
+			break;
+		}
+	}
+
+	free(key);
+	return entry;
+}
+
+// Server names are case-insensitive but the queries were recorded with the
+// names as written in the database. Returns a copy of the parameters with
+// the server names replaced by the recorded ones, or NULL if nothing changed.
+static struct stringlist *snapshot_canonical_params(struct stringlist *params)
+{
+	const struct snapshot_entry *names = snapshot_find(SNAPSHOT_SERVERS_QUERY, NULL);
+	struct stringlist *canonical = NULL;
+
+	if(!names || names->nfields != 1)
+		return NULL;
+
+	for(unsigned int i = 0; i < params->count; i++)
+	{
+		if(!params->data[i])
+			continue;
+
+		for(uint32_t row = 0; row < names->ntuples; row++)
+		{
+			const struct snapshot_cell *cell = &offline.cells[names->cell + row];
+			const char *name = offline.strings + cell->value;
+
+			if(cell->value == SNAPSHOT_NULL || strcasecmp(name, params->data[i]) || !strcmp(name, params->data[i]))
+				continue;
+
+			if(!canonical)
+			{
+				canonical = stringlist_create();
+				for(unsigned int j = 0; j < params->count; j++)
+					stringlist_add(canonical, xstrdup(params->data[j]));
+			}
+
+			free(canonical->data[i]);
+			canonical->data[i] = strdup(name);
+			break;
+		}
+	}
+
+	return canonical;
+}
+
+PGresult *snapshot_lookup(const char *query, struct stringlist *params)
+{
+	const struct snapshot_entry *entry = snapshot_find(query, params);
+	PGresult *res;
+
+	if(!entry && params && params->count)
+	{
+		struct stringlist *canonical = snapshot_canonical_params(params);
+		if(canonical)
+		{
+			entry = snapshot_find(query, canonical);
+			stringlist_free(canonical);
+		}
+	}
+
+	if(!entry)
+		return NULL;
+
+	res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+	if(entry->nfields)
+	{
+		PGresAttDesc attrs[entry->nfields];
+		for(uint32_t i = 0; i < entry->nfields; i++)
+		{
+			const struct snapshot_field *field = &offline.fields[entry->field + i];
+			attrs[i] = (PGresAttDesc){ .name = (char *)offline.strings + field->name, .typid = field->type, .typlen = -1, .atttypmod = -1 };
+		}
+
+		PQsetResultAttrs(res, entry->nfields, attrs);
+	}
+
+	for(uint32_t row = 0; row < entry->ntuples; row++)
+	{
+		for(uint32_t col = 0; col < entry->nfields; col++)
+		{
+			const struct snapshot_cell *cell = &offline.cells[entry->cell + row * entry->nfields + col];
+			if(cell->value == SNAPSHOT_NULL)
+				PQsetvalue(res, row, col, NULL, -1);
+			else
+				PQsetvalue(res, row, col, (char *)offline.strings + cell->value, cell->length);
+		}
+	}
+
+	return res;
+}
+
+// Finds the slot of the string (strings=1) or entry key in the hash
+static uint32_t *snapshot_hash_slot(struct snapshot_hash *hash, uint64_t value, const char *data, size_t len, int strings)
+{
+	uint32_t mask = hash->size - 1;
+
+	for(uint32_t pos = value & mask; ; pos = (pos + 1) & mask)
+	{
+		uint32_t *slot = &hash->slots[pos];
+		const char *str;
+
+		if(!*slot)
+			return slot;
+
+		if(strings)
+		{
+			str = rec.strings + *slot - 1;
+			if(!strncmp(str, data, len) && !str[len])
+				return slot;
+		}
+		else if(rec.entries[*slot - 1].hash == value && !strcmp(rec.strings + rec.entries[*slot - 1].key, data))
+			return slot;
+	}
+}
+
+static void snapshot_hash_grow(struct snapshot_hash *hash, int strings)
+{
+	uint32_t *old = hash->slots, old_size = hash->size;
+
+	hash->size = hash->size ? hash->size * 2 : 1024;
+	hash->slots = calloc(hash->size, sizeof(uint32_t));
+	for(uint32_t i = 0; i < old_size; i++)
+	{
+		const char *str;
+		uint64_t value;
+
+		if(!old[i])
+			continue;
+
+		if(strings)
+		{
+			str = rec.strings + old[i] - 1;
+			value = snapshot_hash_data(str, strlen(str));
+		}
+		else
+		{
+			str = rec.strings + rec.entries[old[i] - 1].key;
+			value = rec.entries[old[i] - 1].hash;
+		}
+
+		*snapshot_hash_slot(hash, value, str, strlen(str), strings) = old[i];
+	}
+
+	free(old);
+}
+
+// Adds a string to the string table unless it is already in there.
+// For the string hash the slots contain the offset + 1.
+static uint32_t snapshot_add_string(const char *str, size_t len)
+{
+	uint32_t *slot;
+
+	if(rec.string_hash.count * 2 >= rec.string_hash.size)
+		snapshot_hash_grow(&rec.string_hash, 1);
+
+	slot = snapshot_hash_slot(&rec.string_hash, snapshot_hash_data(str, len), str, len, 1);
+	if(*slot)
+		return *slot - 1;
+
+	while(rec.strings_len + len + 1 > rec.strings_size)
+	{
+		rec.strings_size *= 2;
+		rec.strings = realloc(rec.strings, rec.strings_size);
+	}
+
+	memcpy(rec.strings + rec.strings_len, str, len);
+	rec.strings[rec.strings_len + len] = '\0';
+	*slot = rec.strings_len + 1;
+	rec.string_hash.count++;
+	rec.strings_len += len + 1;
+	return *slot - 1;
+}
+
+void snapshot_record_start()
+{
+	snapshot_record_free();
+	rec.active = 1;
+	rec.strings_size = 65536;
+	rec.strings = malloc(rec.strings_size);
+	snapshot_add_string("", 0);
+}
+
+// Only results of queries returning rows are recorded; a query that is
+// recorded twice keeps the first result
+void snapshot_record(const char *query, struct stringlist *params, PGresult *res)
+{
+	struct snapshot_entry *entry;
+	uint32_t *slot, nfields, ntuples;
+	uint64_t hash;
+	size_t len;
+	char *key;
+
+	if(!rec.active || PQresultStatus(res) != PGRES_TUPLES_OK)
+		return;
+
+	key = snapshot_key(query, params, &len);
+	hash = snapshot_hash_data(key, len);
+	if(rec.entry_hash.count * 2 >= rec.entry_hash.size)
+		snapshot_hash_grow(&rec.entry_hash, 0);
+	if(*(slot = snapshot_hash_slot(&rec.entry_hash, hash, key, len, 0)))
+	{
+		free(key);
+		return;
+	}
+
+	nfields = PQnfields(res);
+	ntuples = PQntuples(res);
+	if(rec.entry_count == rec.entry_size)
+	{
+		rec.entry_size = rec.entry_size ? rec.entry_size * 2 : 256;
+		rec.entries = realloc(rec.entries, rec.entry_size * sizeof(struct snapshot_entry));
+	}
+
+	if(rec.field_count + nfields > rec.field_size)
+	{
+		rec.field_size = max(rec.field_size * 2, rec.field_count + nfields);
+		rec.fields = realloc(rec.fields, rec.field_size * sizeof(struct snapshot_field));
+	}
+
+	if(rec.cell_count + nfields * ntuples > rec.cell_size)
+	{
+		rec.cell_size = max(rec.cell_size * 2, rec.cell_count + nfields * ntuples);
+		rec.cells = realloc(rec.cells, rec.cell_size * sizeof(struct snapshot_cell));
+	}
+
+	entry = &rec.entries[rec.entry_count];
+	memset(entry, 0, sizeof(struct snapshot_entry));
+	entry->hash = hash;
+	entry->key = snapshot_add_string(key, len);
+	entry->field = rec.field_count;
+	entry->cell = rec.cell_count;
+	entry->nfields = nfields;
+	entry->ntuples = ntuples;
+	free(key);
+
+	for(uint32_t i = 0; i < nfields; i++)
+	{
+		struct snapshot_field *field = &rec.fields[rec.field_count++];
+		field->name = snapshot_add_string(PQfname(res, i), strlen(PQfname(res, i)));
+		field->type = PQftype(res, i);
+	}
+
+	for(uint32_t row = 0; row < ntuples; row++)
+	{
+		for(uint32_t col = 0; col < nfields; col++)
+		{
+			struct snapshot_cell *cell = &rec.cells[rec.cell_count++];
+			if(PQgetisnull(res, row, col))
+			{
+				cell->value = SNAPSHOT_NULL;
+				cell->length = 0;
+			}
+			else
+			{
+				cell->length = PQgetlength(res, row, col);
+				cell->value = snapshot_add_string(PQgetvalue(res, row, col), cell->length);
+			}
+		}
+	}
+
+	*slot = ++rec.entry_count;
+	rec.entry_hash.count++;
+}
+
+static int snapshot_cmp_entry(const void *a, const void *b)
+{
+	const struct snapshot_entry *entry_a = a, *entry_b = b;
+	if(entry_a->hash != entry_b->hash)
+		return entry_a->hash < entry_b->hash ? -1 : 1;
+	return 0;
+}
+
+static void snapshot_record_free()
+{
+	free(rec.entries);
+	free(rec.fields);
+	free(rec.cells);
+	free(rec.strings);
+	free(rec.entry_hash.slots);
+	free(rec.string_hash.slots);
+	memset(&rec, 0, sizeof(rec));
+}
+
+// Stops recording and writes the snapshot unless filename is NULL.
+// Returns the number of recorded queries or -1 if the file could not be written.
+int snapshot_record_finish(const char *filename)
+{
+	struct snapshot_header header;
+	char tmp_filename[PATH_MAX];
+	int count = rec.entry_count;
+	FILE *fp;
+
+	if(!filename)
+	{
+		snapshot_record_free();
+		return count;
+	}
+
+	qsort(rec.entries, rec.entry_count, sizeof(struct snapshot_entry), snapshot_cmp_entry);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.created = time(NULL);
+	header.entry_count = rec.entry_count;
+	header.field_count = rec.field_count;
+	header.cell_count = rec.cell_count;
+	header.strings_len = rec.strings_len;
+
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+	if(!(fp = fopen(tmp_filename, "w")))
+	{
+		error("Could not open `%s' for writing: %s", tmp_filename, strerror(errno));
+		snapshot_record_free();
+		return -1;
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(rec.entries, sizeof(struct snapshot_entry), rec.entry_count, fp);
+	fwrite(rec.fields, sizeof(struct snapshot_field), rec.field_count, fp);
+	fwrite(rec.cells, sizeof(struct snapshot_cell), rec.cell_count, fp);
+	fwrite(rec.strings, 1, rec.strings_len, fp);
+	snapshot_record_free();
+
+	if(ferror(fp) | fclose(fp))
+	{
+		error("Could not write snapshot `%s': %s", tmp_filename, strerror(errno));
+		unlink(tmp_filename);
+		return -1;
+	}
+
+	if(rename(tmp_filename, filename) != 0)
+	{
+		error("Could not rename `%s' to `%s': %s", tmp_filename, filename, strerror(errno));
+		unlink(tmp_filename);
+		return -1;
+	}
+
+	return count;
+}
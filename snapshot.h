@@ -0,0 +1,26 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <libpq-fe.h>
+
+// Snapshot of the results of the read-only queries used by the list/info
+// commands and the config builder. `snapshot export' records every query
+// result while running those commands; --offline answers the same queries
+// from the mmap'd file instead of the database.
+
+// Recorded by `snapshot export' so server names given in a different case
+// can be resolved offline
+#define SNAPSHOT_SERVERS_QUERY	"SELECT name FROM servers ORDER BY name ASC"
+
+struct stringlist;
+
+int snapshot_open(const char *filename);
+void snapshot_close();
+int snapshot_offline();
+PGresult *snapshot_lookup(const char *query, struct stringlist *params);
+void snapshot_record_start();
+int snapshot_recording();
+void snapshot_record(const char *query, struct stringlist *params, PGresult *res);
+int snapshot_record_finish(const char *filename);
+
+#endif
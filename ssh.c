@@ -4,19 +4,107 @@
 #include "input.h"
 #include "serverinfo.h"
 #include "main.h"
-
+#include "event.h"
+#include "stringlist.h"
+#include "table.h"
+#include "pgsql.h"
+#include "job.h"
+#include <netinet/tcp.h>
+
+static const struct ssh_backend *ssh_backend(void);
+static void ssh_failed_add(const char *server);
+static void ssh_timed_out(struct ssh_session *session);
+static void ssh_stats_connect(const char *server, const char *address, unsigned long long ms);
+static void ssh_stats_open(const char *server, unsigned long long ms);
 static int ssh_socket(struct server_info *server);
 static int ssh_auth(struct ssh_session *session, struct server_info *server);
 static const char *ssh_error(struct ssh_session *session);
-static void ssh_waitsocket(struct ssh_session *session);
+static int ssh2_check_timeout(struct ssh_session *session);
+static int ssh_waitsocket(struct ssh_session *session, unsigned long long deadline);
 static int ssh_sftp(struct ssh_session *session);
 
+// Command output is read in chunks of this size
+#define SSH_READ_CHUNK	16384
+// Addresses tried per connect and the delay before trying the next one
+#define SSH_MAX_ADDRS		8
+#define SSH_ATTEMPT_DELAY	250
+// Resolved addresses are cached for this many seconds
+#define SSH_DNS_TTL		300
+
+// Lookups run in the background (getaddrinfo_a) and wake up the event loop
+// through dns_pipe when they are done
+struct ssh_dns_entry
+{
+	char *host;
+	time_t expires;
+	struct addrinfo *addrs;
+	int status; // EAI_INPROGRESS while the lookup is running
+	struct addrinfo hints;
+	struct gaicb req;
+};
+
+// Connection attempt to one address of a server
+struct ssh_attempt
+{
+	const struct addrinfo *addr;
+	int fd;
+	int error;
+	unsigned int ready : 1;
+};
+
+// Connection setup times of a server
+struct ssh_conn_stats
+{
+	char address[INET6_ADDRSTRLEN];
+	unsigned int connections;
+	unsigned long long connect_ms; // last TCP connect
+	unsigned long long setup_ms; // last connect including handshake and authentication
+	unsigned long long setup_max;
+	unsigned long long setup_total;
+};
+
+static void ssh_dns_entry_free(struct ssh_dns_entry *entry);
+static void ssh_dns_readable(int fd, unsigned int events, void *ctx);
+
 static char *last_passphrase = NULL;
 static struct dict *persistent_connections = NULL;
+static int persist_all = 0;
+static int timeout_override = -1;
+// Servers which failed during the current command; the ones which timed out
+// are not contacted again until ssh_failed_reset() is called
+static struct stringlist *failed_servers = NULL;
+static struct dict *timed_out_servers = NULL;
+static struct dict *dns_cache = NULL;
+static int dns_pipe[2] = { -1, -1 };
+static struct dict *conn_stats = NULL;
+
+static const struct
+{
+	const char *name;
+	unsigned int seconds;
+} timeouts[SSH_TIMEOUT_COUNT] = {
+	[SSH_TIMEOUT_CONNECT] = { "connect", 10 },
+	[SSH_TIMEOUT_AUTH] = { "auth", 30 },
+	[SSH_TIMEOUT_TRANSFER] = { "transfer", 120 },
+	[SSH_TIMEOUT_COMMAND] = { "command", 0 }
+};
 
 void ssh_init()
 {
 	persistent_connections = dict_create();
+	failed_servers = stringlist_create();
+	timed_out_servers = dict_create();
+	dict_set_free_funcs(timed_out_servers, free, NULL);
+	dns_cache = dict_create();
+	dict_set_free_funcs(dns_cache, free, (dict_free_f *)ssh_dns_entry_free);
+	if(pipe2(dns_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		error("pipe() failed: %s", strerror(errno));
+		exit(1);
+	}
+	event_add(dns_pipe[0], EV_READ, ssh_dns_readable, NULL);
+	conn_stats = dict_create();
+	dict_set_free_funcs(conn_stats, free, free);
 }
 
 void ssh_fini()
@@ -27,43 +115,991 @@ void ssh_fini()
 	}
 
 	dict_free(persistent_connections);
+	stringlist_free(failed_servers);
+	dict_free(timed_out_servers);
+	dict_free(dns_cache);
+	event_del(dns_pipe[0]);
+	close(dns_pipe[0]);
+	close(dns_pipe[1]);
+	dict_free(conn_stats);
 	xfree(last_passphrase);
 }
 
+// Persistent sessions belong to the parent process; a forked child opens its own
+void ssh_after_fork()
+{
+	dict_iter(node, persistent_connections)
+	{
+		struct ssh_session *session = node->data;
+		if(session->fd >= 0)
+			close(session->fd);
+	}
+
+	dict_clear(persistent_connections);
+
+	// The resolver threads only exist in the parent; children resolve
+	// synchronously (see ssh_resolve()) and must not wait for its lookups
+	dict_iter(node, dns_cache)
+	{
+		struct ssh_dns_entry *entry = node->data;
+		if(entry->status == EAI_INPROGRESS)
+			entry->status = EAI_AGAIN;
+	}
+
+	close(dns_pipe[0]);
+	close(dns_pipe[1]);
+	dns_pipe[0] = dns_pipe[1] = -1;
+}
+
 void ssh_set_passphrase(const char *passphrase)
 {
 	xfree(last_passphrase);
 	last_passphrase = strdup(passphrase);
 }
 
-static int ssh_socket(struct server_info *server)
-{
-	struct hostent *hp;
-	struct sockaddr_in sin;
-	int sock;
+// Keep every opened session around (daemon mode)
+void ssh_persist_all(int enable)
+{
+	persist_all = enable;
+}
+
+// Keep idle persistent sessions alive and drop the ones which died.
+// Sessions used by a running command (refs > 1) are left alone so no
+// keepalive packet ends up in the middle of their exec/scp channel.
+void ssh_keepalive()
+{
+	struct dict_node *next;
+
+	for(struct dict_node *node = persistent_connections->head; node; node = next)
+	{
+		struct ssh_session *session = node->data;
+
+		next = node->next;
+		if(session->refs > 1 || !session->backend->keepalive || session->backend->keepalive(session) == 0)
+			continue;
+
+		debug("SSH session %s is dead", session->name);
+		ssh_close_persistent(session);
+	}
+}
+
+// Returns the timeout in ms; 0 means no limit
+unsigned int ssh_timeout(enum ssh_timeout type)
+{
+	char key[32];
+	const char *str;
+
+	if(timeout_override >= 0)
+		return timeout_override * 1000;
+
+	snprintf(key, sizeof(key), "timeouts/%s", timeouts[type].name);
+	if(!(str = conf_str(key)))
+		return timeouts[type].seconds * 1000;
+	return max(atoi(str), 0) * 1000;
+}
+
+// Overrides all configured timeouts; -1 goes back to the configured ones.
+// Returns the previous override.
+int ssh_set_timeout(int seconds)
+{
+	int prev = timeout_override;
+	timeout_override = seconds;
+	return prev;
+}
+
+void ssh_failed_reset()
+{
+	while(failed_servers->count)
+		stringlist_del(failed_servers, failed_servers->count - 1);
+	dict_clear(timed_out_servers);
+}
+
+// Servers which could not be reached or timed out since ssh_failed_reset()
+struct stringlist *ssh_failed()
+{
+	return failed_servers;
+}
+
+static void ssh_failed_add(const char *server)
+{
+	if(stringlist_find(failed_servers, server) < 0)
+		stringlist_add(failed_servers, strdup(server));
+}
+
+// The server did not respond in time; it is skipped for the rest of the command
+static void ssh_timed_out(struct ssh_session *session)
+{
+	ssh_failed_add(session->server);
+	if(!dict_find_node(timed_out_servers, session->server))
+		dict_insert(timed_out_servers, strdup(session->server), NULL);
+	// Whatever it is doing, the session cannot be reused
+	ssh_unpersist(session);
+}
+
+static const struct ssh_backend *ssh_backend(void)
+{
+	const char *type = conf_str("transport/type");
+
+	if(!type || !strcasecmp(type, "ssh"))
+		return &ssh_backend_libssh2;
+	else if(!strcasecmp(type, "local"))
+		return &ssh_backend_local;
+
+	error("Unknown transport type `%s'", type);
+	return NULL;
+}
+
+static struct ssh_conn_stats *ssh_stats(const char *server)
+{
+	struct ssh_conn_stats *stats;
+
+	if(!(stats = dict_find(conn_stats, server)))
+	{
+		stats = calloc(1, sizeof(struct ssh_conn_stats));
+		dict_insert(conn_stats, strdup(server), stats);
+	}
+
+	return stats;
+}
+
+static void ssh_stats_connect(const char *server, const char *address, unsigned long long ms)
+{
+	struct ssh_conn_stats *stats = ssh_stats(server);
+
+	strlcpy(stats->address, address, sizeof(stats->address));
+	stats->connect_ms = ms;
+	debug("[%s] Connected to %s in %llums", server, address, ms);
+}
+
+static void ssh_stats_open(const char *server, unsigned long long ms)
+{
+	struct ssh_conn_stats *stats = ssh_stats(server);
+
+	stats->connections++;
+	stats->setup_ms = ms;
+	stats->setup_max = max(stats->setup_max, ms);
+	stats->setup_total += ms;
+}
+
+// Shows how long it took to connect to each server
+void ssh_show_stats()
+{
+	struct table *table;
+	unsigned int rows = 0, row = 0;
+
+	dict_iter(node, conn_stats)
+	{
+		if(((struct ssh_conn_stats *)node->data)->connections)
+			rows++;
+	}
+
+	if(!rows)
+	{
+		out("No connections have been made yet");
+		return;
+	}
+
+	table = table_create(7, rows);
+	table_set_header(table, "Server", "Address", "Conns", "Connect", "Setup", "Avg setup", "Max setup");
+	table_free_column(table, 1, 1);
+	for(unsigned int i = 2; i < 7; i++)
+	{
+		table_free_column(table, i, 1);
+		table_ralign_column(table, i, 1);
+	}
+
+	dict_iter(node, conn_stats)
+	{
+		struct ssh_conn_stats *stats = node->data;
+
+		if(!stats->connections)
+			continue;
+
+		table_col_str(table, row, 0, node->key);
+		table_col_str(table, row, 1, strdup(*stats->address ? stats->address : "-"));
+		table_col_num(table, row, 2, stats->connections);
+		table_col_fmt(table, row, 3, "%llums", stats->connect_ms);
+		table_col_fmt(table, row, 4, "%llums", stats->setup_ms);
+		table_col_fmt(table, row, 5, "%llums", stats->setup_total / stats->connections);
+		table_col_fmt(table, row, 6, "%llums", stats->setup_max);
+		row++;
+	}
+
+	table_sort(table, 0);
+	table_send(table);
+	table_free(table);
+}
+
+struct ssh_session *ssh_open(struct server_info *server)
+{
+	const struct ssh_backend *backend;
+	struct ssh_session *session;
+	unsigned long long begin;
+	char *name;
+
+	if(!(backend = ssh_backend()))
+		return NULL;
+
+	if(dict_find_node(timed_out_servers, server->name))
+	{
+		error("[%s] Skipped; the server did not respond in time before", server->name);
+		return NULL;
+	}
+
+	if(backend == &ssh_backend_local)
+		asprintf(&name, "local:%s", server->name);
+	else
+		asprintf(&name, "%s@%s:%s", server->ssh_user, server->ssh_host, server->ssh_port);
+
+	if((session = dict_find(persistent_connections, name)))
+	{
+		free(name);
+		session->refs++;
+		return session;
+	}
+
+	session = malloc(sizeof(struct ssh_session));
+	memset(session, 0, sizeof(struct ssh_session));
+	session->backend = backend;
+	session->name = name;
+	session->server = strdup(server->name);
+	session->fd = -1;
+
+	begin = event_now();
+	if(backend->open(session, server) != 0)
+	{
+		ssh_failed_add(server->name);
+		free(session->server);
+		free(session->name);
+		free(session);
+		return NULL;
+	}
+
+	ssh_stats_open(server->name, event_now() - begin);
+	session->refs = 1;
+	if(persist_all)
+		ssh_persist(session);
+	return session;
+}
+
+void ssh_persist(struct ssh_session *session)
+{
+	if(session->persistent)
+	{
+		debug("SSH session %s is already persistent", session->name);
+		return;
+	}
+
+	session->persistent = 1;
+	session->refs++;
+	debug("SSH session %s is now persistent", session->name);
+	dict_insert(persistent_connections, session->name, session);
+}
+
+void ssh_unpersist(struct ssh_session *session)
+{
+	if(!session->persistent)
+		return;
+
+	session->persistent = 0;
+	session->refs--;
+	dict_delete(persistent_connections, session->name);
+}
+
+void ssh_close_persistent(struct ssh_session *session)
+{
+	debug("Closing persistent ssh connection %s", session->name);
+	assert(session->persistent);
+	assert(session->refs == 1); // one ref is used by the persistent connection itself
+	dict_delete(persistent_connections, session->name);
+	session->persistent = 0;
+	ssh_close(session);
+}
+
+void ssh_close(struct ssh_session *session)
+{
+	session->refs--;
+
+	if(session->persistent)
+		return;
+
+	assert(session->refs == 0);
+	session->backend->close(session);
+	free(session->server);
+	free(session->name);
+	free(session);
+}
+
+int ssh_scp_get(struct ssh_session *session, const char *remote_file, const char *local_file)
+{
+	return session->backend->scp_get(session, remote_file, local_file);
+}
+
+int ssh_scp_put(struct ssh_session *session, const char *local_file, const char *remote_file, int mode)
+{
+	return session->backend->scp_put(session, local_file, remote_file, mode);
+}
+
+static struct ssh_exec *ssh_exec_start(struct ssh_session *session, const char *command, int merge_stderr)
+{
+	struct ssh_exec *exec;
+
+	exec = malloc(sizeof(struct ssh_exec));
+	memset(exec, 0, sizeof(struct ssh_exec));
+	exec->session = session;
+	exec->fd = -1;
+
+	if(session->backend->exec_start(exec, command, merge_stderr) != 0)
+	{
+		free(exec);
+		return NULL;
+	}
+
+	ssh_exec_set_timeout(exec, ssh_timeout(SSH_TIMEOUT_COMMAND));
+
+	return exec;
+}
+
+// Makes room for the next chunk. Unread data is moved to the front only if
+// the chunk would not fit behind it; since complete lines are consumed before
+// reading more, only a partial line is ever moved.
+static void ssh_exec_reserve(struct ssh_exec *exec)
+{
+	if(exec->size - exec->len > SSH_READ_CHUNK)
+		return;
+
+	if(exec->start)
+	{
+		memmove(exec->buf, exec->buf + exec->start, exec->len - exec->start);
+		exec->len -= exec->start;
+		exec->scan -= exec->start;
+		exec->start = 0;
+	}
+
+	if(exec->size - exec->len <= SSH_READ_CHUNK)
+	{
+		exec->size = max(exec->size * 2, exec->len + SSH_READ_CHUNK + 1);
+		exec->buf = realloc(exec->buf, exec->size);
+	}
+}
+
+// Reads the next chunk of output, waiting for it if necessary.
+// Returns the number of bytes read, 0 on EOF and -1 on error.
+static int ssh_exec_fill(struct ssh_exec *exec)
+{
+	const struct ssh_backend *backend = exec->session->backend;
+
+	while(1)
+	{
+		int res;
+
+		ssh_exec_reserve(exec);
+		res = backend->exec_read(exec, exec->buf + exec->len, exec->size - exec->len - 1);
+		if(res > 0)
+		{
+			exec->len += res;
+			return res;
+		}
+		else if(res == 0) // EOF (Channel closed)
+			return 0;
+		else if(res != SSH_AGAIN)
+			return -1;
+
+		if((res = ssh_exec_wait(&exec, 1, exec->deadline)) < 0)
+		{
+			error("Interrupted");
+			return -1;
+		}
+		else if(res == 0)
+		{
+			error("[%s] Timed out waiting for command output", exec->session->server);
+			exec->timed_out = 1;
+			ssh_timed_out(exec->session);
+			return -1;
+		}
+	}
+}
+
+// Returns the next complete line in the buffer (terminated in place) or NULL
+static char *ssh_exec_next_line(struct ssh_exec *exec, size_t *len)
+{
+	char *line, *nl;
+
+	if(!(nl = memchr(exec->buf + exec->scan, '\n', exec->len - exec->scan)))
+	{
+		exec->scan = exec->len;
+		return NULL;
+	}
+
+	*nl = '\0';
+	line = exec->buf + exec->start;
+	*len = nl - line;
+	exec->start = exec->scan = nl - exec->buf + 1;
+	return line;
+}
+
+// Returns the last line if the output did not end with a newline
+static char *ssh_exec_last_line(struct ssh_exec *exec, size_t *len)
+{
+	char *line = exec->buf + exec->start;
+
+	exec->finished = 1;
+	if(exec->start == exec->len)
+		return NULL;
+
+	exec->buf[exec->len] = '\0';
+	*len = exec->len - exec->start;
+	exec->start = exec->scan = exec->len;
+	return line;
+}
+
+int ssh_exec(struct ssh_session *session, const char *command, char **output)
+{
+	struct ssh_exec *exec;
+	int res;
+
+	if(!(exec = ssh_exec_start(session, command, 0)))
+		return -1;
+
+	while((res = ssh_exec_fill(exec)) > 0)
+	{
+		// If output is not wanted, simply read into the same buffer and overwrite old contents
+		if(!output)
+			exec->len = 0;
+	}
+
+	if(res < 0)
+	{
+		ssh_exec_close(exec);
+		return -1;
+	}
+
+	exec->buf[exec->len] = '\0';
+	if(output)
+	{
+		*output = exec->buf;
+		exec->buf = NULL;
+	}
+
+	return ssh_exec_close(exec);
+}
+
+struct ssh_exec *ssh_exec_async(struct ssh_session *session, const char *command)
+{
+	return ssh_exec_start(session, command, 1);
+}
+
+// Returns the next line of output in *line (0), 1 on EOF and -1 on error
+int ssh_exec_read(struct ssh_exec *exec, const char **line)
+{
+	char *next;
+	size_t len;
+	int res;
+
+	assert(line);
+
+	*line = NULL;
+
+	if(exec->finished)
+		return 1;
+
+	while(!(next = ssh_exec_next_line(exec, &len)))
+	{
+		if((res = ssh_exec_fill(exec)) < 0)
+			return -1;
+		else if(res == 0 && !(next = ssh_exec_last_line(exec, &len)))
+			return 1;
+		else if(res == 0)
+			break;
+	}
+
+	*line = next;
+	return 0;
+}
+
+// Calls func for every line of output until EOF. All lines received by one
+// read are passed without copying them. Returns 0 on EOF, -1 on error or the
+// non-zero value returned by func.
+int ssh_exec_lines(struct ssh_exec *exec, ssh_line_f *func, void *ctx)
+{
+	char *line;
+	size_t len;
+	int res;
+
+	while(!exec->finished)
+	{
+		while((line = ssh_exec_next_line(exec, &len)))
+		{
+			if((res = func(line, len, ctx)))
+				return res;
+		}
+
+		if((res = ssh_exec_fill(exec)) < 0)
+			return -1;
+		else if(res == 0 && (line = ssh_exec_last_line(exec, &len)) && (res = func(line, len, ctx)))
+			return res;
+	}
+
+	return 0;
+}
+
+int ssh_exec_close(struct ssh_exec *exec)
+{
+	int exitcode;
+
+	exitcode = exec->session->backend->exec_close(exec);
+	if(exec->buf)
+		free(exec->buf);
+	free(exec);
+	return exitcode;
+}
+
+// Aborts reading the output of the command if it takes longer than ms
+void ssh_exec_set_timeout(struct ssh_exec *exec, unsigned int ms)
+{
+	exec->deadline = ms ? event_now() + ms : 0;
+}
+
+struct ssh_wait_ctx
+{
+	struct ssh_exec **execs;
+	unsigned int count;
+	unsigned int ready;
+};
+
+static void ssh_exec_wait_cb(int fd, unsigned int events, void *ctx)
+{
+	struct ssh_wait_ctx *wait = ctx;
+
+	// Channels of the same session share its socket; all of them may have output now
+	for(unsigned int i = 0; i < wait->count; i++)
+	{
+		if(!wait->execs[i]->ready && wait->execs[i]->wait_fd == fd)
+		{
+			wait->execs[i]->ready = 1;
+			wait->ready++;
+		}
+	}
+}
+
+// Waits until at least one of the commands has output or reached EOF while
+// dispatching other events. The ready flag of those commands is set.
+// Returns the number of ready commands, 0 if the deadline (event_now()
+// based; 0 for none) passed and -1 if a signal arrived.
+int ssh_exec_wait(struct ssh_exec **execs, unsigned int count, unsigned long long deadline)
+{
+	struct ssh_wait_ctx wait = { execs, count, 0 };
+	int fds[count];
+	unsigned int fd_events[count], fd_count = 0;
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		struct ssh_exec *exec = execs[i];
+		unsigned int events = 0, j;
+
+		exec->ready = 0;
+		exec->wait_fd = exec->finished ? -1 : exec->session->backend->exec_poll(exec, &events);
+		if(!events)
+		{
+			exec->ready = 1;
+			wait.ready++;
+			continue;
+		}
+
+		for(j = 0; j < fd_count && fds[j] != exec->wait_fd; j++)
+			;
+		if(j == fd_count)
+		{
+			fds[fd_count] = exec->wait_fd;
+			fd_events[fd_count++] = 0;
+		}
+
+		fd_events[j] |= events;
+	}
+
+	if(wait.ready)
+		return wait.ready;
+
+	for(unsigned int i = 0; i < fd_count; i++)
+		event_add(fds[i], fd_events[i], ssh_exec_wait_cb, &wait);
+
+	while(!wait.ready)
+	{
+		int left = -1;
+
+		if(deadline)
+		{
+			unsigned long long now = event_now();
+			if(now >= deadline)
+				break;
+			left = deadline - now;
+		}
+
+		if(event_run_once(left) < 0 && sigint_received)
+			break;
+	}
+
+	for(unsigned int i = 0; i < fd_count; i++)
+		event_del(fds[i]);
+
+	if(!wait.ready && sigint_received)
+		return -1;
+	return wait.ready;
+}
+
+static int ssh_exec_live_line(const char *line, size_t len, void *ctx)
+{
+	out("%s", line);
+	return 0;
+}
+
+int ssh_exec_live(struct ssh_session *session, const char *command)
+{
+	struct ssh_exec *exec;
+	int ret;
+
+	if(!(exec = ssh_exec_async(session, command)))
+		return -1;
+
+	ssh_exec_lines(exec, ssh_exec_live_line, NULL);
+
+	ret = ssh_exec_close(exec);
+	if(ret == 127)
+		error("Could not execute `%s'", command);
+	else if(ret != 0)
+		out_color(COLOR_BROWN, "Command exited with code %d", ret);
+	return ret;
+}
+
+int ssh_file_exists(struct ssh_session *session, const char *file)
+{
+	return session->backend->file_exists(session, file);
+}
+
+static void ssh_dns_notify(union sigval value)
+{
+	// Runs in a resolver thread; the event loop does the rest
+	if(write(value.sival_int, "", 1) < 0)
+		return;
+}
+
+static void ssh_dns_readable(int fd, unsigned int events, void *ctx)
+{
+	char buf[64];
+	while(read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+// Returns the status of the lookup and takes over its result once it is done
+static int ssh_dns_check(struct ssh_dns_entry *entry)
+{
+	if(entry->status == EAI_INPROGRESS && (entry->status = gai_error(&entry->req)) == 0)
+	{
+		entry->addrs = entry->req.ar_result;
+		entry->expires = time(NULL) + SSH_DNS_TTL;
+	}
+
+	return entry->status;
+}
+
+// Returns the cache entry of host with its old addresses dropped if they
+// have to be looked up (again), or NULL if they are still valid
+static struct ssh_dns_entry *ssh_dns_entry(const char *host)
+{
+	struct ssh_dns_entry *entry;
+
+	if(!(entry = dict_find(dns_cache, host)))
+	{
+		entry = malloc(sizeof(struct ssh_dns_entry));
+		memset(entry, 0, sizeof(struct ssh_dns_entry));
+		entry->host = strdup(host);
+		dict_insert(dns_cache, strdup(host), entry);
+		return entry;
+	}
+
+	if(ssh_dns_check(entry) == EAI_INPROGRESS || (entry->status == 0 && entry->expires > time(NULL)))
+		return NULL;
+
+	if(entry->addrs)
+		freeaddrinfo(entry->addrs);
+	entry->addrs = NULL;
+	return entry;
+}
+
+// Starts resolving host unless its addresses are cached or already being looked up
+void ssh_prefetch(const char *host)
+{
+	struct ssh_dns_entry *entry;
+	struct gaicb *list[1];
+	struct sigevent sev;
+
+	if(job_child || !host || !(entry = ssh_dns_entry(host)))
+		return;
+
+	// AF_UNSPEC sends the A and AAAA queries at the same time
+	memset(&entry->hints, 0, sizeof(entry->hints));
+	entry->hints.ai_family = AF_UNSPEC;
+	entry->hints.ai_socktype = SOCK_STREAM;
+	entry->hints.ai_flags = AI_ADDRCONFIG;
+	memset(&entry->req, 0, sizeof(entry->req));
+	entry->req.ar_name = entry->host;
+	entry->req.ar_request = &entry->hints;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = ssh_dns_notify;
+	sev.sigev_value.sival_int = dns_pipe[1];
+
+	list[0] = &entry->req;
+	entry->status = EAI_INPROGRESS;
+	if(getaddrinfo_a(GAI_NOWAIT, list, 1, &sev) != 0)
+		entry->status = EAI_SYSTEM;
+}
+
+// Starts resolving the ssh hosts of all servers in a `SELECT * FROM servers'
+// result so they are looked up in parallel before the first connect
+void ssh_prefetch_servers(PGresult *res)
+{
+	int rows = pgsql_num_rows(res);
+
+	for(int i = 0; i < rows; i++)
+		ssh_prefetch(pgsql_nvalue(res, i, "ssh_host"));
+}
+
+// Returns the cached addresses of host, waiting for its lookup if necessary.
+// Background job children resolve synchronously and do not cache anything
+// beyond what they inherited.
+static struct addrinfo *ssh_resolve(const char *host)
+{
+	struct ssh_dns_entry *entry;
+	unsigned long long deadline;
+	unsigned int timeout;
+	int res;
+
+	if(job_child)
+	{
+		if(!(entry = ssh_dns_entry(host)))
+			return ((struct ssh_dns_entry *)dict_find(dns_cache, host))->addrs;
+
+		memset(&entry->hints, 0, sizeof(entry->hints));
+		entry->hints.ai_family = AF_UNSPEC;
+		entry->hints.ai_socktype = SOCK_STREAM;
+		entry->hints.ai_flags = AI_ADDRCONFIG;
+		if((entry->status = getaddrinfo(host, NULL, &entry->hints, &entry->addrs)) != 0)
+		{
+			error("Could not resolve %s: %s", host, gai_strerror(entry->status));
+			return NULL;
+		}
+
+		entry->expires = time(NULL) + SSH_DNS_TTL;
+		return entry->addrs;
+	}
+
+	ssh_prefetch(host);
+	entry = dict_find(dns_cache, host);
+
+	// Other events (and other lookups) keep being processed meanwhile
+	timeout = ssh_timeout(SSH_TIMEOUT_CONNECT);
+	deadline = timeout ? event_now() + timeout : 0;
+	while((res = ssh_dns_check(entry)) == EAI_INPROGRESS)
+	{
+		unsigned long long now = event_now();
+
+		if(deadline && now >= deadline)
+		{
+			error("Could not resolve %s: timed out", host);
+			return NULL;
+		}
+
+		if(event_run_once(deadline ? (int)(deadline - now) : -1) < 0 && sigint_received)
+			return NULL;
+	}
+
+	if(res != 0)
+	{
+		error("Could not resolve %s: %s", host, gai_strerror(res));
+		return NULL;
+	}
+
+	return entry->addrs;
+}
+
+static void ssh_dns_entry_free(struct ssh_dns_entry *entry)
+{
+	// A running lookup still writes to the entry; leave it alone
+	if(ssh_dns_check(entry) == EAI_INPROGRESS && gai_cancel(&entry->req) != EAI_CANCELED)
+		return;
+
+	if(entry->addrs)
+		freeaddrinfo(entry->addrs);
+	free(entry->host);
+	free(entry);
+}
+
+static void ssh_connect_ready(int fd, unsigned int events, void *ctx)
+{
+	((struct ssh_attempt *)ctx)->ready = 1;
+}
+
+// Starts a non-blocking connect; returns the socket or -1
+static int ssh_connect_start(struct ssh_attempt *attempt, const char *port)
+{
+	struct sockaddr_storage addr;
+	int sock;
+
+	memcpy(&addr, attempt->addr->ai_addr, attempt->addr->ai_addrlen);
+	if(addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&addr)->sin6_port = htons(atoi(port));
+	else
+		((struct sockaddr_in *)&addr)->sin_port = htons(atoi(port));
+
+	if((sock = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
+	{
+		attempt->error = errno;
+		return -1;
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	if(connect(sock, (struct sockaddr *)&addr, attempt->addr->ai_addrlen) < 0 && errno != EINPROGRESS)
+	{
+		attempt->error = errno;
+		close(sock);
+		return -1;
+	}
+
+	attempt->fd = sock;
+	event_add(sock, EV_WRITE, ssh_connect_ready, attempt);
+	return sock;
+}
+
+// Connects to the addresses of the server, starting another attempt every
+// SSH_ATTEMPT_DELAY ms (or as soon as one fails) while the previous ones are
+// still pending, alternating between IPv6 and IPv4 (RFC 8305). The first
+// connection which succeeds is used.
+// Returns the socket, -1 on error, -2 if interrupted and -3 on timeout.
+static int ssh_socket(struct server_info *server)
+{
+	struct addrinfo *addrs, *addrs6[SSH_MAX_ADDRS], *addrs4[SSH_MAX_ADDRS];
+	struct ssh_attempt attempts[SSH_MAX_ADDRS];
+	unsigned int timeout, count = 0, count6 = 0, count4 = 0, started = 0, failed = 0;
+	unsigned long long now, begin, deadline, next_attempt;
+	int sock = -1, err = 0, one = 1;
+	char address[INET6_ADDRSTRLEN] = "";
+
+	if(!(addrs = ssh_resolve(server->ssh_host)))
+		return -1;
+
+	// Interleave the address families, starting with the preferred one
+	for(struct addrinfo *ai = addrs; ai; ai = ai->ai_next)
+	{
+		if(ai->ai_family == AF_INET6 && count6 < SSH_MAX_ADDRS)
+			addrs6[count6++] = ai;
+		else if(ai->ai_family == AF_INET && count4 < SSH_MAX_ADDRS)
+			addrs4[count4++] = ai;
+	}
+
+	for(unsigned int i = 0; count < SSH_MAX_ADDRS && (i < count6 || i < count4); i++)
+	{
+		struct addrinfo *first = addrs->ai_family == AF_INET6 ? (i < count6 ? addrs6[i] : NULL) : (i < count4 ? addrs4[i] : NULL);
+		struct addrinfo *second = addrs->ai_family == AF_INET6 ? (i < count4 ? addrs4[i] : NULL) : (i < count6 ? addrs6[i] : NULL);
+
+		if(first)
+			attempts[count++] = (struct ssh_attempt){ .addr = first, .fd = -1 };
+		if(second && count < SSH_MAX_ADDRS)
+			attempts[count++] = (struct ssh_attempt){ .addr = second, .fd = -1 };
+	}
+
+	if(!count)
+	{
+		error("[%s] %s has no IPv4 or IPv6 address", server->name, server->ssh_host);
+		return -1;
+	}
+
+	timeout = ssh_timeout(SSH_TIMEOUT_CONNECT);
+	begin = next_attempt = event_now();
+	deadline = timeout ? begin + timeout : 0;
+	while(sock < 0 && failed < count)
+	{
+		int left = -1;
+
+		now = event_now();
+		if(started < count && (now >= next_attempt || failed == started))
+		{
+			if(ssh_connect_start(&attempts[started], server->ssh_port) < 0)
+				failed++;
+			started++;
+			next_attempt = now + SSH_ATTEMPT_DELAY;
+			continue;
+		}
+
+		if(deadline && now >= deadline)
+			break;
+		if(deadline)
+			left = deadline - now;
+		if(started < count)
+			left = (left < 0 || next_attempt - now < (unsigned long long)left) ? (int)(next_attempt - now) : left;
+
+		if(event_run_once(left) < 0 && sigint_received)
+			break;
 
-	if((hp = gethostbyname2(server->ssh_host, AF_INET)) == NULL)
-	{
-		error("[%s] Could not resolve %s", server->name, server->ssh_host);
-		return -1;
-	}
+		for(unsigned int i = 0; i < started && sock < 0; i++)
+		{
+			socklen_t len = sizeof(err);
+
+			if(!attempts[i].ready || attempts[i].fd < 0)
+				continue;
 
-	sock = socket(AF_INET, SOCK_STREAM, 0);
-	assert(sock >= 0);
+			event_del(attempts[i].fd);
+			if(getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+				err = errno;
+			if(!err)
+			{
+				sock = attempts[i].fd;
+				getnameinfo(attempts[i].addr->ai_addr, attempts[i].addr->ai_addrlen, address, sizeof(address), NULL, 0, NI_NUMERICHOST);
+			}
+			else
+			{
+				attempts[i].error = err;
+				close(attempts[i].fd);
+				failed++;
+			}
 
-	memset(&sin, 0, sizeof(struct sockaddr_in));
+			attempts[i].fd = -1;
+		}
+	}
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(atoi(server->ssh_port));
-	memcpy(&sin.sin_addr, hp->h_addr, sizeof(struct in_addr));
+	// Abandon the attempts which lost the race
+	for(unsigned int i = 0; i < started; i++)
+	{
+		if(attempts[i].fd < 0)
+			continue;
+		event_del(attempts[i].fd);
+		close(attempts[i].fd);
+	}
 
-	if(connect(sock, (struct sockaddr*)&sin, sizeof(struct sockaddr_in)) < 0)
+	if(sock < 0)
 	{
-		error("[%s] Could not connect to %s:%s (IPv4): %s (%d)", server->name, server->ssh_host, server->ssh_port, strerror(errno), errno);
-		close(sock);
-		return -2;
+		if(failed == count)
+		{
+			// Report the error of the first address; it is the preferred one
+			err = attempts[0].error;
+			error("[%s] Could not connect to %s:%s: %s (%d)", server->name, server->ssh_host, server->ssh_port, strerror(err), err);
+			return -1;
+		}
+		else if(sigint_received)
+		{
+			error("[%s] Interrupted while connecting to %s:%s", server->name, server->ssh_host, server->ssh_port);
+			return -2;
+		}
+
+		error("[%s] Timed out connecting to %s:%s", server->name, server->ssh_host, server->ssh_port);
+		return -3;
 	}
 
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+	// ssh sends lots of small packets; do not let them wait for each other
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	ssh_stats_connect(server->name, address, event_now() - begin);
 	return sock;
 }
 
@@ -79,7 +1115,13 @@ static int ssh_auth(struct ssh_session *session, struct server_info *server)
 	sigint_received = 0;
 	sigint_jmp_on = 1;
 
-	assert((methods = libssh2_userauth_list(session->session, server->ssh_user, strlen(server->ssh_user))));
+	if(!(methods = libssh2_userauth_list(session->session, server->ssh_user, strlen(server->ssh_user))))
+	{
+		error("[%s] Could not get authentication methods: %s", server->name, ssh_error(session));
+		ssh2_check_timeout(session);
+		sigint_jmp_on = 0;
+		return 1;
+	}
 	//debug("Supported authentication methods: %s", methods);
 
 	if(strstr(methods, "publickey") && (pubkey = conf_str("sshkey/pub")) && (privkey = conf_str("sshkey/priv")))
@@ -108,6 +1150,12 @@ static int ssh_auth(struct ssh_session *session, struct server_info *server)
 			}
 
 			out("Pubkey auth failed: %s", ssh_error(session));
+			if(ssh2_check_timeout(session))
+			{
+				sigint_jmp_on = 0;
+				return 1;
+			}
+
 			xfree(last_passphrase);
 			last_passphrase = NULL;
 			ask_passphrase = 1;
@@ -129,6 +1177,11 @@ static int ssh_auth(struct ssh_session *session, struct server_info *server)
 				return 0;
 			}
 			out("Password auth failed");
+			if(ssh2_check_timeout(session))
+			{
+				sigint_jmp_on = 0;
+				return 1;
+			}
 		}
 	}
 
@@ -145,70 +1198,76 @@ static const char *ssh_error(struct ssh_session *session)
 	return trim(buf);
 }
 
-static void ssh_waitsocket(struct ssh_session *session)
+// Marks the server as timed out if the last blocking libssh2 call timed out
+static int ssh2_check_timeout(struct ssh_session *session)
 {
-	struct timeval timeout;
-	fd_set fd;
-	fd_set *writefd = NULL;
-	fd_set *readfd = NULL;
-	int dir;
+	if(libssh2_session_last_errno(session->session) != LIBSSH2_ERROR_TIMEOUT)
+		return 0;
 
-	timeout.tv_sec = 2;
-	timeout.tv_usec = 0;
+	ssh_timed_out(session);
+	return 1;
+}
 
-	FD_ZERO(&fd);
-	FD_SET(session->fd, &fd);
+// Events libssh2 is waiting for; reading is assumed if it is not blocked
+static unsigned int ssh_session_events(struct ssh_session *session)
+{
+	unsigned int events = 0;
+	int dir;
 
 	dir = libssh2_session_block_directions(session->session);
 
 	if(dir & LIBSSH2_SESSION_BLOCK_INBOUND)
-		readfd = &fd;
+		events |= EV_READ;
 	if(dir & LIBSSH2_SESSION_BLOCK_OUTBOUND)
-		writefd = &fd;
+		events |= EV_WRITE;
 
-	select(session->fd + 1, readfd, writefd, NULL, &timeout);
+	return events ? events : EV_READ;
 }
 
-struct ssh_session *ssh_open(struct server_info *server)
+// Returns 0 if the deadline (0 for none) passed or a signal arrived
+static int ssh_waitsocket(struct ssh_session *session, unsigned long long deadline)
 {
-	int sock = 0;
-	struct ssh_session *session;
-	char *name;
+	unsigned long long now = event_now();
 
-	asprintf(&name, "%s@%s:%s", server->ssh_user, server->ssh_host, server->ssh_port);
-	if((session = dict_find(persistent_connections, name)))
-	{
-		free(name);
-		session->refs++;
-		return session;
-	}
+	if(deadline && now >= deadline)
+		return 0;
+	return event_wait_fd(session->fd, ssh_session_events(session), deadline ? (int)(deadline - now) : -1) != 0;
+}
+
+static int ssh2_open(struct ssh_session *session, struct server_info *server)
+{
+	int sock;
 
 	// Create socket
 	if((sock = ssh_socket(server)) < 0)
-		return NULL;
+	{
+		if(sock == -3)
+			ssh_timed_out(session);
+		return -1;
+	}
 
-	session = malloc(sizeof(struct ssh_session));
-	memset(session, 0, sizeof(struct ssh_session));
-	session->name = name;
 	session->fd = sock;
 
 	// Init ssh session
 	if(!(session->session = libssh2_session_init()))
 	{
 		error("Could not init ssh session");
-		free(session);
-		return NULL;
+		close(sock);
+		return -1;
 	}
 
+	// Blocking libssh2 calls fail with LIBSSH2_ERROR_TIMEOUT after this
+	libssh2_session_set_timeout(session->session, ssh_timeout(SSH_TIMEOUT_AUTH));
+
 	// Startup ssh session (handshake etc.)
 	if(libssh2_session_startup(session->session, sock) != 0)
 	{
-		error("Could not startup ssh session: %s", ssh_error(session));
+		error("[%s] Could not startup ssh session: %s", server->name, ssh_error(session));
+		ssh2_check_timeout(session);
 		libssh2_session_disconnect(session->session, "Session startup failed");
 		libssh2_session_free(session->session);
 		close(sock);
-		free(session);
-		return NULL;
+		return -1;
 	}
 
 	// Authenticate
@@ -217,47 +1276,26 @@ struct ssh_session *ssh_open(struct server_info *server)
 		libssh2_session_disconnect(session->session, "Authentication failed");
 		libssh2_session_free(session->session);
 		close(sock);
-		free(session);
-		return NULL;
+		return -1;
 	}
 
-	// Authenticated successfully
-	session->refs = 1;
-	return session;
+	libssh2_session_set_timeout(session->session, ssh_timeout(SSH_TIMEOUT_TRANSFER));
+	libssh2_keepalive_config(session->session, 1, 30);
+	return 0;
 }
 
-void ssh_persist(struct ssh_session *session)
+static int ssh2_keepalive(struct ssh_session *session)
 {
-	if(session->persistent)
+	int next, ret;
+
+	// A busy socket does not mean the session is dead
+	if((ret = libssh2_keepalive_send(session->session, &next)) != 0 && ret != LIBSSH2_ERROR_EAGAIN)
 	{
-		debug("SSH session %s is already persistent", session->name);
-		return;
+		debug("Keepalive for %s failed: %s", session->name, ssh_error(session));
+		return -1;
 	}
 
-	session->persistent = 1;
-	session->refs++;
-	debug("SSH session %s is now persistent", session->name);
-	dict_insert(persistent_connections, session->name, session);
-}
-
-void ssh_unpersist(struct ssh_session *session)
-{
-	if(!session->persistent)
-		return;
-
-	session->persistent = 0;
-	session->refs--;
-	dict_delete(persistent_connections, session->name);
-}
-
-void ssh_close_persistent(struct ssh_session *session)
-{
-	debug("Closing persistent ssh connection %s", session->name);
-	assert(session->persistent);
-	assert(session->refs == 1); // one ref is used by the persistent connection itself
-	dict_delete(persistent_connections, session->name);
-	session->persistent = 0;
-	ssh_close(session);
+	return 0;
 }
 
 static int ssh_sftp(struct ssh_session *session)
@@ -270,30 +1308,23 @@ static int ssh_sftp(struct ssh_session *session)
 	if(!(session->sftp = libssh2_sftp_init(session->session)))
 	{
 		error("Could not init sftp session: %s", ssh_error(session));
+		ssh2_check_timeout(session);
 		return -1;
 	}
 
 	return 0;
 }
 
-void ssh_close(struct ssh_session *session)
+static void ssh2_close(struct ssh_session *session)
 {
-	session->refs--;
-
-	if(session->persistent)
-		return;
-
-	assert(session->refs == 0);
 	if(session->sftp)
 		libssh2_sftp_shutdown(session->sftp);
 	libssh2_session_disconnect(session->session, "Finished");
 	libssh2_session_free(session->session);
 	close(session->fd);
-	free(session->name);
-	free(session);
 }
 
-int ssh_scp_get(struct ssh_session *session, const char *remote_file, const char *local_file)
+static int ssh2_scp_get(struct ssh_session *session, const char *remote_file, const char *local_file)
 {
 	LIBSSH2_CHANNEL *channel;
 	struct stat fileinfo;
@@ -309,6 +1340,7 @@ int ssh_scp_get(struct ssh_session *session, const char *remote_file, const char
 	if(!(channel = libssh2_scp_recv(session->session, remote_file, &fileinfo)))
 	{
 		error("Could not create scp receive channel: %s", ssh_error(session));
+		ssh2_check_timeout(session);
 		fclose(outfile);
 		unlink(local_file);
 		return 2;
@@ -331,6 +1363,7 @@ int ssh_scp_get(struct ssh_session *session, const char *remote_file, const char
 			if(received)
 				putc('\n', stdout);
 			error("Could not read from ssh channel: %s", ssh_error(session));
+			ssh2_check_timeout(session);
 			fclose(outfile);
 			unlink(local_file);
 			libssh2_channel_free(channel);
@@ -347,7 +1380,7 @@ int ssh_scp_get(struct ssh_session *session, const char *remote_file, const char
 	return 0;
 }
 
-int ssh_scp_put(struct ssh_session *session, const char *local_file, const char *remote_file, int mode)
+static int ssh2_scp_put(struct ssh_session *session, const char *local_file, const char *remote_file, int mode)
 {
 	LIBSSH2_CHANNEL *channel;
 	struct stat fileinfo;
@@ -369,6 +1402,7 @@ int ssh_scp_put(struct ssh_session *session, const char *local_file, const char
 	if(!(channel = libssh2_scp_send(session->session, remote_file, mode, fileinfo.st_size)))
 	{
 		error("Could not create scp send channel: %s", ssh_error(session));
+		ssh2_check_timeout(session);
 		fclose(infile);
 		return 2;
 	}
@@ -405,9 +1439,12 @@ int ssh_scp_put(struct ssh_session *session, const char *local_file, const char
 				if(sent)
 					putc('\n', stdout);
 				error("Could not write to ssh channel: %s", ssh_error(session));
-				libssh2_channel_send_eof(channel);
-				libssh2_channel_wait_eof(channel);
-				libssh2_channel_wait_closed(channel);
+				if(!ssh2_check_timeout(session))
+				{
+					libssh2_channel_send_eof(channel);
+					libssh2_channel_wait_eof(channel);
+					libssh2_channel_wait_closed(channel);
+				}
 				libssh2_channel_free(channel);
 				fclose(infile);
 				return 2;
@@ -426,254 +1463,104 @@ int ssh_scp_put(struct ssh_session *session, const char *local_file, const char
 	return 0;
 }
 
-int ssh_exec(struct ssh_session *session, const char *command, char **output)
+static int ssh2_exec_start(struct ssh_exec *exec, const char *command, int merge_stderr)
 {
+	struct ssh_session *session = exec->session;
 	LIBSSH2_CHANNEL *channel;
-	char *buf;
-	int len, size;
-	int res, exitcode;
 
 	if(!(channel = libssh2_channel_open_session(session->session)))
 	{
 		error("Could not create session channel: %s", ssh_error(session));
+		ssh2_check_timeout(session);
 		ssh_unpersist(session);
 		return -1;
 	}
 
+	if(merge_stderr)
+		libssh2_channel_handle_extended_data2(channel, LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE);
 	if(libssh2_channel_exec(channel, command) != 0)
 	{
 		error("Unable to execute command: %s", ssh_error(session));
+		ssh2_check_timeout(session);
 		libssh2_channel_free(channel);
 		return -1;
 	}
 
 	libssh2_channel_set_blocking(channel, 0);
-
-	len = 0;
-	size = 256;
-	buf = malloc(size);
-	while(1)
-	{
-		if(size - len < 2)
-		{
-			size <<= 1; // double size
-			buf = realloc(buf, size);
-		}
-
-		res = libssh2_channel_read(channel, buf + len, size - len - 1);
-		if(res > 0)
-		{
-			// If output is not wanted, simply read into the same buffer and overwrite old contents
-			if(output)
-				len += res;
-			continue;
-		}
-		else if(res == 0)
-			break;
-		else if(res != LIBSSH2_ERROR_EAGAIN)
-		{
-			error("Could not read from ssh channel: %s %d", ssh_error(session), res);
-			free(buf);
-			libssh2_channel_free(channel);
-			libssh2_session_set_blocking(session->session, 1);
-			return -1;
-		}
-
-		ssh_waitsocket(session);
-	}
-
-	buf[len] = '\0';
-	if(!output)
-		free(buf);
-
-	exitcode = 127;
-	while((res = libssh2_channel_close(channel)) == LIBSSH2_ERROR_EAGAIN)
-		ssh_waitsocket(session);
-
-	if(res == 0)
-		exitcode = libssh2_channel_get_exit_status(channel);
-
-	if(output)
-		*output = buf;
-	libssh2_channel_free(channel);
-	libssh2_session_set_blocking(session->session, 1);
-	return exitcode;
+	exec->channel = channel;
+	return 0;
 }
 
-struct ssh_exec *ssh_exec_async(struct ssh_session *session, const char *command)
+static int ssh2_exec_read(struct ssh_exec *exec, char *buf, size_t len)
 {
-	LIBSSH2_CHANNEL *channel;
-	struct ssh_exec *exec;
-
-	if(!(channel = libssh2_channel_open_session(session->session)))
-	{
-		error("Could not create session channel: %s", ssh_error(session));
-		ssh_unpersist(session);
-		return NULL;
-	}
-
-	libssh2_channel_handle_extended_data2(channel, LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE);
-	if(libssh2_channel_exec(channel, command) != 0)
-	{
-		error("Unable to execute command: %s", ssh_error(session));
-		libssh2_channel_free(channel);
-		return NULL;
-	}
+	int res;
 
-	libssh2_channel_set_blocking(channel, 0);
+	res = libssh2_channel_read(exec->channel, buf, len);
+	if(res >= 0)
+		return res;
+	else if(res == LIBSSH2_ERROR_EAGAIN)
+		return SSH_AGAIN;
 
-	exec = malloc(sizeof(struct ssh_exec));
-	memset(exec, 0, sizeof(struct ssh_exec));
-	exec->session = session;
-	exec->channel = channel;
-	return exec;
+	error("Could not read from ssh channel: %s", ssh_error(exec->session));
+	return -1;
 }
 
-int ssh_exec_read(struct ssh_exec *exec, const char **line)
+static int ssh2_exec_poll(struct ssh_exec *exec, unsigned int *events)
 {
-	assert(line);
-
-	*line = NULL;
-
-	if(exec->finished)
-		return 1;
-
-	if(!exec->buf)
-	{
-		exec->size = 256;
-		exec->len = 0;
-		exec->buf = malloc(exec->size);
-	}
-
-	if(exec->getlen)
-	{
-		size_t retlen;
-
-		// Get rid of fetched data
-		memmove(exec->buf, exec->buf + exec->getlen, exec->size - exec->getlen);
-		exec->len -= exec->getlen;
-		exec->buf[exec->len] = '\0';
-		exec->getlen = 0;
+	unsigned long avail = 0;
+
+	// Reading another channel of the session may have queued data for this one
+	libssh2_channel_window_read_ex(exec->channel, &avail, NULL);
+	if(avail || libssh2_channel_eof(exec->channel))
+		*events = 0;
+	else
+		*events = ssh_session_events(exec->session);
+	return exec->session->fd;
+}
 
-		// Check if there's more data to fetch
-		if((retlen = strcspn(exec->buf, "\n")) > 0 && *(exec->buf + retlen) == '\n')
-		{
-			exec->getlen = retlen + 1;
-			exec->buf[retlen] = '\0';
-			*line = exec->buf;
-			return 0;
-		}
-		else if(*exec->buf == '\n') // empty line
-		{
-			exec->getlen = 1;
-			exec->buf[0] = '\0';
-			*line = exec->buf; // empty string
-			return 0;
-		}
-	}
+static int ssh2_exec_close(struct ssh_exec *exec)
+{
+	unsigned int timeout = ssh_timeout(SSH_TIMEOUT_TRANSFER);
+	unsigned long long deadline = timeout ? event_now() + timeout : 0;
+	int res = -1, exitcode = 127;
 
-	while(1)
+	// Nothing can be expected from a server which already timed out
+	while(!exec->timed_out && (res = libssh2_channel_close(exec->channel)) == LIBSSH2_ERROR_EAGAIN)
 	{
-		int res;
-		size_t retlen;
-
-		if(exec->size - exec->len < 2)
-		{
-			exec->size <<= 1; // double size
-			exec->buf = realloc(exec->buf, exec->size);
-		}
-
-		res = libssh2_channel_read(exec->channel, exec->buf + exec->len, exec->size - exec->len - 1);
-		if(res > 0)
-		{
-			exec->len += res;
-			exec->buf[exec->len] = '\0';
-
-			// Return everything until \n and remove the read string and its \n from the buffer
-			if(((retlen = strcspn(exec->buf, "\n")) > 0 && *(exec->buf + retlen) == '\n') || (*exec->buf == '\n'))
-			{
-				exec->getlen = retlen + 1;
-				exec->buf[retlen] = '\0';
-				*line = exec->buf;
-				return 0;
-			}
-			else if(*exec->buf == '\n') // empty line
-			{
-				exec->getlen = 1;
-				exec->buf[0] = '\0';
-				*line = exec->buf; // empty string
-				return 0;
-			}
-
-			continue;
-		}
-		else if(res == 0)
+		if(!ssh_waitsocket(exec->session, deadline))
 		{
-			// EOF (Channel closed)
+			if(!sigint_received)
+				ssh_timed_out(exec->session);
 			break;
 		}
-		else if(res != LIBSSH2_ERROR_EAGAIN)
-		{
-			error("Could not read from ssh channel: %s", ssh_error(exec->session));
-			return -1;
-		}
-
-		ssh_waitsocket(exec->session);
 	}
 
-	if(!exec->len)
-		return 1;
-
-	exec->finished = 1;
-	exec->buf[exec->len] = '\0';
-	*line = exec->buf;
-	return 0;
-}
-
-int ssh_exec_close(struct ssh_exec *exec)
-{
-	int res, exitcode = 127;
-
-	while((res = libssh2_channel_close(exec->channel)) == LIBSSH2_ERROR_EAGAIN)
-		ssh_waitsocket(exec->session);
-
 	if(res == 0)
 		exitcode = libssh2_channel_get_exit_status(exec->channel);
 
 	libssh2_channel_free(exec->channel);
 	libssh2_session_set_blocking(exec->session->session, 1);
-	if(exec->buf)
-		free(exec->buf);
-	free(exec);
 	return exitcode;
 }
 
-int ssh_exec_live(struct ssh_session *session, const char *command)
-{
-	struct ssh_exec *exec;
-	const char *buf;
-	int ret;
-
-	if(!(exec = ssh_exec_async(session, command)))
-		return -1;
-
-	while(ssh_exec_read(exec, &buf) == 0)
-	{
-		if(buf)
-			out("%s", buf);
-	}
-
-	ret = ssh_exec_close(exec);
-	if(ret == 127)
-		error("Could not execute `%s'", command);
-	else if(ret != 0)
-		out_color(COLOR_BROWN, "Command exited with code %d", ret);
-	return ret;
-}
-
-int ssh_file_exists(struct ssh_session *session, const char *file)
+static int ssh2_file_exists(struct ssh_session *session, const char *file)
 {
 	LIBSSH2_SFTP_ATTRIBUTES attrs;
-	assert(ssh_sftp(session) == 0);
+	if(ssh_sftp(session) != 0)
+		return 0;
 	return (libssh2_sftp_stat(session->sftp, file, &attrs) == 0);
 }
+
+const struct ssh_backend ssh_backend_libssh2 = {
+	.name = "ssh",
+	.open = ssh2_open,
+	.close = ssh2_close,
+	.scp_get = ssh2_scp_get,
+	.scp_put = ssh2_scp_put,
+	.exec_start = ssh2_exec_start,
+	.exec_read = ssh2_exec_read,
+	.exec_poll = ssh2_exec_poll,
+	.exec_close = ssh2_exec_close,
+	.file_exists = ssh2_file_exists,
+	.keepalive = ssh2_keepalive
+};
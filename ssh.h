@@ -3,41 +3,108 @@
 
 #include <libssh2.h>
 #include <libssh2_sftp.h>
+#include <libpq-fe.h>
+
+// Returned by ssh_backend->exec_read if no data is available yet
+#define SSH_AGAIN	(-37)
+
+// Deadlines for remote operations; see ssh_timeout()
+enum ssh_timeout
+{
+	SSH_TIMEOUT_CONNECT,
+	SSH_TIMEOUT_AUTH, // handshake and authentication
+	SSH_TIMEOUT_TRANSFER, // file transfers and other blocking requests
+	SSH_TIMEOUT_COMMAND, // remote commands
+	SSH_TIMEOUT_COUNT
+};
 
 struct server_info;
+struct stringlist;
+struct ssh_session;
+struct ssh_exec;
+
+// A transport backend implements all remote operations of a session
+struct ssh_backend
+{
+	const char *name;
+	int (*open)(struct ssh_session *session, struct server_info *server);
+	void (*close)(struct ssh_session *session);
+	int (*scp_get)(struct ssh_session *session, const char *remote_file, const char *local_file);
+	int (*scp_put)(struct ssh_session *session, const char *local_file, const char *remote_file, int mode);
+	int (*exec_start)(struct ssh_exec *exec, const char *command, int merge_stderr);
+	int (*exec_read)(struct ssh_exec *exec, char *buf, size_t len);
+	// Returns the fd to wait on for more output and the events to wait for;
+	// events is 0 if output (or EOF) is available without waiting
+	int (*exec_poll)(struct ssh_exec *exec, unsigned int *events);
+	int (*exec_close)(struct ssh_exec *exec);
+	int (*file_exists)(struct ssh_session *session, const char *file);
+	int (*keepalive)(struct ssh_session *session); // optional; 0 if the session is still usable
+};
 
 struct ssh_session
 {
+	const struct ssh_backend *backend;
 	LIBSSH2_SESSION *session;
 	LIBSSH2_SFTP *sftp;
 	int fd;
 	int refs;
 	int persistent : 1;
 	char *name;
+	char *server; // name of the server in the database
+	char *root; // local backend: directory representing the server
 };
 
 struct ssh_exec
 {
 	struct ssh_session *session;
 	LIBSSH2_CHANNEL *channel;
+	pid_t pid; // local backend
+	int fd; // local backend
+	// Output not returned yet is buf[start..len); the search for the next
+	// newline continues at scan so no byte is looked at twice
 	char *buf;
-	size_t getlen, len, size;
+	size_t start, scan, len, size;
+	unsigned long long deadline; // event_now() based; 0 if none
+	int wait_fd; // set by ssh_exec_wait()
 	int finished : 1;
+	unsigned int ready : 1; // set by ssh_exec_wait()
+	unsigned int timed_out : 1;
 };
 
+// Called for every line of output; line is NUL-terminated and only valid
+// during the call. A non-zero return value stops reading.
+typedef int (ssh_line_f)(const char *line, size_t len, void *ctx);
+
+extern const struct ssh_backend ssh_backend_libssh2;
+extern const struct ssh_backend ssh_backend_local;
+
 void ssh_init();
 void ssh_fini();
+void ssh_after_fork();
 void ssh_set_passphrase(const char *passphrase);
+void ssh_persist_all(int enable);
+void ssh_keepalive();
+unsigned int ssh_timeout(enum ssh_timeout type);
+int ssh_set_timeout(int seconds);
+void ssh_show_stats();
+void ssh_failed_reset();
+struct stringlist *ssh_failed();
+void ssh_prefetch(const char *host);
+void ssh_prefetch_servers(PGresult *res);
 struct ssh_session *ssh_open(struct server_info *server);
 void ssh_close(struct ssh_session *session);
 void ssh_persist(struct ssh_session *session);
+void ssh_unpersist(struct ssh_session *session);
 void ssh_close_persistent(struct ssh_session *session);
 int ssh_scp_get(struct ssh_session *session, const char *remote_file, const char *local_file);
 int ssh_scp_put(struct ssh_session *session, const char *local_file, const char *remote_file, int mode);
 int ssh_exec(struct ssh_session *session, const char *command, char **output);
 struct ssh_exec *ssh_exec_async(struct ssh_session *session, const char *command);
 int ssh_exec_read(struct ssh_exec *exec, const char **output);
+int ssh_exec_lines(struct ssh_exec *exec, ssh_line_f *func, void *ctx);
 int ssh_exec_close(struct ssh_exec *exec);
+void ssh_exec_set_timeout(struct ssh_exec *exec, unsigned int ms);
+int ssh_exec_wait(struct ssh_exec **execs, unsigned int count, unsigned long long deadline);
 int ssh_exec_live(struct ssh_session *session, const char *command);
 int ssh_file_exists(struct ssh_session *session, const char *file);
 
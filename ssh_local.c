@@ -0,0 +1,251 @@
+#include "common.h"
+#include "ssh.h"
+#include "conf.h"
+#include "serverinfo.h"
+#include "main.h"
+#include "event.h"
+
+// Local transport backend: every server is a directory on this machine,
+// commands are executed by /bin/sh inside that directory.
+
+static void local_latency(void);
+static char *local_path(struct ssh_session *session, const char *file);
+static int local_copy(const char *src, const char *dst, int mode);
+
+// Waits for the fake latency while the event loop keeps serving other
+// sessions and the prompt; Ctrl+C cuts it short
+static void local_latency(void)
+{
+	unsigned long long now, deadline;
+	const char *str;
+	int ms;
+
+	if(!(str = conf_str("transport/latency")) || (ms = atoi(str)) <= 0)
+		return;
+
+	deadline = event_now() + ms;
+	while((now = event_now()) < deadline)
+	{
+		if(event_run_once(deadline - now) < 0 && sigint_received)
+			break;
+	}
+}
+
+static char *local_path(struct ssh_session *session, const char *file)
+{
+	char *path;
+
+	// Remote paths are relative to the server's home directory
+	if(!strncmp(file, "~/", 2))
+		file += 2;
+	while(*file == '/')
+		file++;
+
+	asprintf(&path, "%s/%s", session->root, file);
+	return path;
+}
+
+static int local_copy(const char *src, const char *dst, int mode)
+{
+	char buf[10240];
+	unsigned long long copied = 0;
+	ssize_t res;
+	int in, out;
+
+	if((in = open(src, O_RDONLY)) < 0)
+	{
+		error("Could not open `%s' for reading: %s (%d)", src, strerror(errno), errno);
+		return 1;
+	}
+
+	if((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0)
+	{
+		error("Could not open `%s' for writing: %s (%d)", dst, strerror(errno), errno);
+		close(in);
+		return 1;
+	}
+
+	while((res = read(in, buf, sizeof(buf))) > 0)
+	{
+		if(write(out, buf, res) != res)
+		{
+			error("Could not write to `%s': %s (%d)", dst, strerror(errno), errno);
+			close(in);
+			close(out);
+			unlink(dst);
+			return 2;
+		}
+
+		copied += res;
+	}
+
+	close(in);
+	close(out);
+
+	if(res < 0)
+	{
+		error("Could not read from `%s': %s (%d)", src, strerror(errno), errno);
+		unlink(dst);
+		return 2;
+	}
+
+	debug("Copied %llu bytes", copied);
+	return 0;
+}
+
+static int local_open(struct ssh_session *session, struct server_info *server)
+{
+	char root[PATH_MAX];
+	const char *fmt;
+	struct stat sb;
+
+	if(!(fmt = conf_str("transport/root")))
+		fmt = "servers/$1";
+	expand_num_args(root, sizeof(root), fmt, 1, server->name);
+
+	local_latency();
+	if(stat(root, &sb) != 0 || !S_ISDIR(sb.st_mode))
+	{
+		error("[%s] Server directory `%s' does not exist", server->name, root);
+		return -1;
+	}
+
+	session->root = realpath(root, NULL);
+	return 0;
+}
+
+static void local_close(struct ssh_session *session)
+{
+	free(session->root);
+}
+
+static int local_scp_get(struct ssh_session *session, const char *remote_file, const char *local_file)
+{
+	char *path = local_path(session, remote_file);
+	int res;
+
+	local_latency();
+	res = local_copy(path, local_file, 0644);
+	free(path);
+	return res;
+}
+
+static int local_scp_put(struct ssh_session *session, const char *local_file, const char *remote_file, int mode)
+{
+	char *path = local_path(session, remote_file);
+	int res;
+
+	local_latency();
+	if((res = local_copy(local_file, path, mode)) == 0)
+		chmod(path, mode);
+	free(path);
+	return res;
+}
+
+static int local_exec_start(struct ssh_exec *exec, const char *command, int merge_stderr)
+{
+	int fds[2];
+	pid_t pid;
+
+	if(pipe(fds) != 0)
+	{
+		error("Could not create pipe: %s (%d)", strerror(errno), errno);
+		return -1;
+	}
+
+	local_latency();
+	if((pid = fork()) < 0)
+	{
+		error("Could not fork: %s (%d)", strerror(errno), errno);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	else if(pid == 0)
+	{
+		int devnull = open("/dev/null", O_RDWR);
+
+		close(fds[0]);
+		setpgid(0, 0);
+		dup2(devnull, STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(merge_stderr ? fds[1] : devnull, STDERR_FILENO);
+		if(chdir(exec->session->root) != 0)
+			_exit(127);
+		setenv("HOME", exec->session->root, 1);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+
+	setpgid(pid, pid);
+	close(fds[1]);
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	exec->pid = pid;
+	exec->fd = fds[0];
+	return 0;
+}
+
+static int local_exec_read(struct ssh_exec *exec, char *buf, size_t len)
+{
+	ssize_t res;
+
+	if((res = read(exec->fd, buf, len)) >= 0)
+		return res;
+	else if(errno == EAGAIN || errno == EINTR)
+		return SSH_AGAIN;
+
+	error("Could not read from command pipe: %s (%d)", strerror(errno), errno);
+	return -1;
+}
+
+static int local_exec_poll(struct ssh_exec *exec, unsigned int *events)
+{
+	*events = EV_READ;
+	return exec->fd;
+}
+
+static int local_exec_close(struct ssh_exec *exec)
+{
+	int status;
+	pid_t res;
+
+	close(exec->fd);
+	if((res = waitpid(exec->pid, &status, WNOHANG)) == 0)
+	{
+		// Still running; kill the whole process group if the user gave up
+		// or it took too long
+		if(sigint_received || exec->timed_out)
+			kill(-exec->pid, SIGTERM);
+		while((res = waitpid(exec->pid, &status, 0)) < 0 && errno == EINTR)
+			;
+	}
+
+	if(res <= 0)
+		return 127;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 127;
+}
+
+static int local_file_exists(struct ssh_session *session, const char *file)
+{
+	char *path = local_path(session, file);
+	struct stat sb;
+	int res;
+
+	local_latency();
+	res = (stat(path, &sb) == 0);
+	free(path);
+	return res;
+}
+
+const struct ssh_backend ssh_backend_local = {
+	.name = "local",
+	.open = local_open,
+	.close = local_close,
+	.scp_get = local_scp_get,
+	.scp_put = local_scp_put,
+	.exec_start = local_exec_start,
+	.exec_read = local_exec_read,
+	.exec_poll = local_exec_poll,
+	.exec_close = local_exec_close,
+	.file_exists = local_file_exists
+};
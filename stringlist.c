@@ -1,10 +1,13 @@
 #include "common.h"
 #include "stringlist.h"
 #include "strnatcmp.h"
+#include "arena.h"
 
 // stringlists...
 // ...DO NOT store duplicates of strings
 // ...free the stored strings
+// ...unless they live in an arena; then strings added later must be
+//    allocated from the same arena and nothing is ever freed
 
 struct stringlist *stringlist_create()
 {
@@ -18,6 +21,9 @@ struct stringlist *stringlist_create()
 
 void stringlist_free(struct stringlist *list)
 {
+	if(list->arena)
+		return;
+
 	for(unsigned int i = 0; i < list->count; i++)
 	{
 		if(list->data[i])
@@ -32,6 +38,7 @@ struct stringlist *stringlist_copy(const struct stringlist *slist)
 	struct stringlist *new = malloc(sizeof(struct stringlist));
 	new->count = slist->count;
 	new->size = slist->size;
+	new->arena = NULL;
 	new->data = calloc(new->size, sizeof(char *));
 	for(unsigned int i = 0; i < slist->count; i++) // copy entries
 		new->data[i] = strdup(slist->data[i]);
@@ -44,7 +51,13 @@ void stringlist_add(struct stringlist *list, char *string)
 	if(list->count == list->size) // list is full, we need to allocate more memory
 	{
 		list->size <<= 1; // double size
-		list->data = realloc(list->data, list->size * sizeof(char *));
+		if(list->arena)
+		{
+			char **data = arena_alloc(list->arena, list->size * sizeof(char *));
+			list->data = memcpy(data, list->data, list->count * sizeof(char *));
+		}
+		else
+			list->data = realloc(list->data, list->size * sizeof(char *));
 	}
 
 	list->data[list->count++] = string;
@@ -53,7 +66,7 @@ void stringlist_add(struct stringlist *list, char *string)
 void stringlist_del(struct stringlist *list, int pos)
 {
 	assert(pos < (int)list->count);
-	if(list->data[pos])
+	if(list->data[pos] && !list->arena)
 		free(list->data[pos]);
 	list->data[pos] = list->data[--list->count]; // copy last element into empty position
 }
@@ -66,7 +79,8 @@ char *stringlist_shift(struct stringlist *list)
 		return NULL;
 
 	string = strdup(list->data[0]);
-	free(list->data[0]);
+	if(!list->arena)
+		free(list->data[0]);
 	list->count--;
 	memmove(list->data, list->data + 1, list->count * sizeof(*list->data));
 	return string;
@@ -93,15 +107,46 @@ void stringlist_sort(struct stringlist *list)
 	qsort(list->data, list->count, sizeof(list->data[0]), stringlist_cmp);
 }
 
+// Creates an empty list of the given size in the current command's arena
+static struct stringlist *stringlist_create_arena(unsigned int size)
+{
+	struct stringlist *list = arena_alloc(arena_current, sizeof(struct stringlist));
+	list->count = 0;
+	list->size = max(size, 2);
+	list->data = arena_alloc(arena_current, list->size * sizeof(char *));
+	list->arena = arena_current;
+	return list;
+}
+
+// Lists built by these functions are usually query parameters which are
+// freed right after the query; inside a command they come from its arena.
 struct stringlist *stringlist_build(const char *str, ...)
 {
 	va_list args;
-	struct stringlist *list = stringlist_create();
+	struct stringlist *list;
+	unsigned int count = 1;
+
+	if(!arena_current)
+	{
+		list = stringlist_create();
+		stringlist_add(list, strdup(str));
+		va_start(args, str);
+		while((str = va_arg(args, const char *)))
+			stringlist_add(list, strdup(str));
+		va_end(args);
+		return list;
+	}
 
-	stringlist_add(list, strdup(str));
+	va_start(args, str);
+	while(va_arg(args, const char *))
+		count++;
+	va_end(args);
+
+	list = stringlist_create_arena(count);
+	list->data[list->count++] = arena_strdup(arena_current, str);
 	va_start(args, str);
 	while((str = va_arg(args, const char *)))
-		stringlist_add(list, strdup(str));
+		list->data[list->count++] = arena_strdup(arena_current, str);
 	va_end(args);
 	return list;
 }
@@ -109,13 +154,17 @@ struct stringlist *stringlist_build(const char *str, ...)
 struct stringlist *stringlist_build_n(unsigned int count, ...)
 {
 	va_list args;
-	struct stringlist *list = stringlist_create();
+	struct stringlist *list;
 
+	list = arena_current ? stringlist_create_arena(count) : stringlist_create();
 	va_start(args, count);
 	for(unsigned int i = 0; i < count; i++)
 	{
 		const char *str = va_arg(args, const char *);
-		stringlist_add(list, str ? strdup(str) : NULL);
+		if(list->arena)
+			list->data[list->count++] = str ? arena_strdup(list->arena, str) : NULL;
+		else
+			stringlist_add(list, str ? strdup(str) : NULL);
 	}
 	va_end(args);
 	return list;
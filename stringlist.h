@@ -1,12 +1,15 @@
 #ifndef STRINGLIST_H
 #define STRINGLIST_H
 
+struct arena;
+
 struct stringlist
 {
 	unsigned int count;
 	unsigned int size;
 
 	char **data;
+	struct arena *arena; // set if the list and its strings live in an arena
 };
 
 struct stringlist *stringlist_create();
@@ -1,10 +1,20 @@
 #include "common.h"
 #include "table.h"
 #include "stringbuffer.h"
-#include "strnatcmp.h"
+#include "main.h"
+#include "format.h"
+#include <sys/ioctl.h>
 
-// Thanks to qsort not offering a custom argument we need a global var for that.
-static unsigned int table_sort_col;
+// Rows are allocated in chunks of at least this many rows
+#define TABLE_CHUNK_ROWS	64
+
+// Header row (if any) first, then the data rows
+#define table_row(TABLE, ROW)	((TABLE)->header ? ((ROW) ? (const char **)(TABLE)->data[(ROW) - 1] : (TABLE)->header) : (const char **)(TABLE)->data[(ROW)])
+
+static void table_grow(struct table *table, unsigned int rows);
+
+static const char *pager = NULL;
+static int utf8 = 0;
 
 size_t table_strlen(const char *str, unsigned int col)
 {
@@ -38,16 +48,45 @@ struct table *table_create(unsigned int cols, unsigned int rows)
 
 	table->cols = cols;
 	table->rows = rows;
-
-	table->data = calloc(table->rows, sizeof(char **));
-	for(unsigned int i = 0; i < table->rows; i++)
-		table->data[i] = calloc(table->cols, sizeof(char *));
+	table_grow(table, rows);
 
 	table->field_len = table_strlen;
 
 	return table;
 }
 
+// Makes room for at least `rows' rows. The cells are allocated in chunks
+// (doubling the capacity) instead of one calloc() per row.
+static void table_grow(struct table *table, unsigned int rows)
+{
+	unsigned int count;
+	char **cells;
+
+	if(rows <= table->size)
+		return;
+
+	count = max(rows - table->size, max(TABLE_CHUNK_ROWS, table->size));
+	cells = calloc(count * table->cols, sizeof(char *));
+	table->chunks = realloc(table->chunks, (table->chunk_count + 1) * sizeof(char **));
+	table->chunks[table->chunk_count++] = cells;
+
+	table->data = realloc(table->data, (table->size + count) * sizeof(char **));
+	for(unsigned int i = 0; i < count; i++)
+		table->data[table->size + i] = cells + i * table->cols;
+	table->size += count;
+}
+
+void table_set_pager(const char *cmd)
+{
+	pager = cmd;
+}
+
+// Values are LATIN1 (the schema's encoding) unless the connection says otherwise
+void table_set_utf8(int enable)
+{
+	utf8 = enable;
+}
+
 void table_set_header(struct table *table, const char *str, ...)
 {
 	va_list args;
@@ -96,9 +135,9 @@ void table_ralign_column(struct table *table, unsigned int col, unsigned char en
 #define col_free(TABLE, COL)	((TABLE)->free_cols & (1 << COL))
 void table_free(struct table *table)
 {
-	for(unsigned int i = 0; i < table->rows; i++)
+	if(table->free_cols)
 	{
-		if(table->free_cols)
+		for(unsigned int i = 0; i < table->rows; i++)
 		{
 			for(unsigned int j = 0; j < table->cols; j++)
 			{
@@ -106,89 +145,276 @@ void table_free(struct table *table)
 					free(table->data[i][j]);
 			}
 		}
-
-		free(table->data[i]);
 	}
 
+	for(unsigned int i = 0; i < table->chunk_count; i++)
+		free(table->chunks[i]);
+
 	if(table->header)
 		free(table->header);
+	free(table->chunks);
 	free(table->data);
 	free(table);
 }
 #undef col_free
 
-#define col_bold(TABLE, COL)	((TABLE)->bold_cols & (1 << COL))
-#define col_ralign(TABLE, COL)	((TABLE)->ralign_cols & (1 << COL))
-void table_send(struct table *table)
+// Copies a cell (or prefix), dropping color codes if colors are disabled
+static size_t table_copy(char *dst, const char *src, size_t len)
 {
-	unsigned int len, spaces, *maxlens;
-	struct stringbuffer *line;
+	char *start = dst;
 
-	maxlens = calloc(table->cols, sizeof(unsigned int));
+	if(!no_colors || !memchr(src, '\033', len))
+	{
+		memcpy(dst, src, len);
+		return len;
+	}
 
-	if(table->header)
+	for(const char *c = src; c < src + len; c++)
 	{
-		for(unsigned int col = 0; col < table->cols; col++)
-			maxlens[col] = table->field_len(table->header[col], col);
+		if(*c == '\033')
+		{
+			while(c < src + len - 1 && *c != 'm')
+				c++;
+			continue;
+		}
+
+		*dst++ = *c;
 	}
 
-	for(unsigned int col = 0; col < table->cols; col++)
+	return dst - start;
+}
+
+#define col_bold(TABLE, COL)	((TABLE)->bold_cols & (1 << COL))
+#define col_ralign(TABLE, COL)	((TABLE)->ralign_cols & (1 << COL))
+#define append_esc(BUF, POS, ESC)	do { if(!no_colors) { memcpy((BUF) + (POS), (ESC), sizeof(ESC) - 1); (POS) += sizeof(ESC) - 1; } } while(0)
+// Renders the whole table into a single buffer. Cell widths are calculated
+// once; the buffer size is known in advance so nothing is reallocated.
+static char *table_render(struct table *table, size_t *len)
+{
+	unsigned int rows = table->rows + (table->header ? 1 : 0);
+	unsigned int cols = table->cols;
+	unsigned int *widths, *bytes, *maxlens;
+	const char *prefix = table->prefix ? table->prefix : "";
+	const char *line_prefix = out_get_prefix();
+	size_t prefix_len = strlen(prefix), line_prefix_len = strlen(line_prefix);
+	size_t size = 0, line_size, pos = 0;
+	char *buf;
+
+	widths = malloc(rows * cols * sizeof(unsigned int));
+	bytes = malloc(rows * cols * sizeof(unsigned int));
+	maxlens = calloc(cols, sizeof(unsigned int));
+
+	for(unsigned int row = 0; row < rows; row++)
 	{
-		for(unsigned int row = 0; row < table->rows; row++)
+		const char **ptr = table_row(table, row);
+		for(unsigned int col = 0; col < cols; col++)
 		{
-			len = table->data[row][col] ? table->field_len(table->data[row][col], col) : 0;
-			if(len > maxlens[col])
-				maxlens[col] = len;
+			unsigned int i = row * cols + col;
+			bytes[i] = ptr[col] ? strlen(ptr[col]) : 0;
+			widths[i] = ptr[col] ? table->field_len(ptr[col], col) : 0;
+			if(widths[i] > maxlens[col])
+				maxlens[col] = widths[i];
+			size += bytes[i];
 		}
 	}
 
-	line = stringbuffer_create();
-	for(int row = (table->header ? -1 : 0); row < (int)table->rows; row++)
+	// Prefixes, padding, separators, escape codes (at most two of 5 bytes per cell) and the newline
+	line_size = line_prefix_len + prefix_len + 2 * (cols - 1) + 10 * cols + 1;
+	for(unsigned int col = 0; col < cols; col++)
+		line_size += maxlens[col];
+	size += rows * line_size;
+	buf = malloc(size + 1);
+
+	for(unsigned int row = 0; row < rows; row++)
 	{
-		const char **ptr = ((row == -1) ? table->header : (const char **)table->data[row]);
+		const char **ptr = table_row(table, row);
+		int header = (table->header && row == 0);
 
-		for(unsigned int col = 0; col < table->cols; col++)
+		pos += table_copy(buf + pos, line_prefix, line_prefix_len);
+		pos += table_copy(buf + pos, prefix, prefix_len);
+
+		for(unsigned int col = 0; col < cols; col++)
 		{
-			if(row == -1) // Header
+			unsigned int i = row * cols + col;
+			unsigned int spaces = maxlens[col] - widths[i];
+
+			if(header)
 			{
-				spaces = maxlens[col] - (ptr[col] ? table->field_len(ptr[col], col) : 0);
-				stringbuffer_append_string(line, "\033[4m");
+				append_esc(buf, pos, "\033[4m");
 				if(ptr[col])
-					stringbuffer_append_string(line, ptr[col]);
-				stringbuffer_append_string(line, "\033[24m");
+					pos += table_copy(buf + pos, ptr[col], bytes[i]);
+				append_esc(buf, pos, "\033[24m");
 			}
-			else // Data
+			else
 			{
-				spaces = maxlens[col] - (ptr[col] ? table->field_len(ptr[col], col) : 0);
 				if(col_bold(table, col))
-					stringbuffer_append_string(line, "\033[1m");
-				while(col_ralign(table, col) && spaces--)
-					stringbuffer_append_char(line, ' ');
+					append_esc(buf, pos, "\033[1m");
+				if(col_ralign(table, col))
+				{
+					memset(buf + pos, ' ', spaces);
+					pos += spaces;
+				}
 				if(ptr[col])
-					stringbuffer_append_string(line, ptr[col]);
+					pos += table_copy(buf + pos, ptr[col], bytes[i]);
 			}
 
-			if(col < table->cols - 1) // Not the last column
+			if(col < cols - 1) // Not the last column
 			{
-				while((!col_ralign(table, col) || row == -1) && spaces--)
-					stringbuffer_append_char(line, ' ');
+				if(!col_ralign(table, col) || header)
+				{
+					memset(buf + pos, ' ', spaces);
+					pos += spaces;
+				}
 				if(col_bold(table, col))
-					stringbuffer_append_string(line, "\033[22m");
+					append_esc(buf, pos, "\033[22m");
 
-				stringbuffer_append_string(line, "  ");
+				buf[pos++] = ' ';
+				buf[pos++] = ' ';
 			}
 			else if(col_bold(table, col))
 			{
-				stringbuffer_append_string(line, "\033[22m");
+				append_esc(buf, pos, "\033[22m");
 			}
 		}
 
-		out("%s%s", table->prefix ? table->prefix : "", line->string);
-		line->len = 0;
+		buf[pos++] = '\n';
 	}
 
-	stringbuffer_free(line);
+	assert(pos <= size);
+	buf[pos] = '\0';
+	*len = pos;
+
+	free(widths);
+	free(bytes);
 	free(maxlens);
+	return buf;
+}
+#undef append_esc
+
+// Writes the rendered table with a single write; long tables on an
+// interactive terminal are sent to the pager instead.
+static void table_write(const char *buf, size_t len, unsigned int lines)
+{
+	struct winsize ws;
+	ssize_t res;
+
+	fflush(stdout);
+
+	if(pager && *pager && !batch_mode && isatty(STDOUT_FILENO) &&
+	   ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && lines >= ws.ws_row)
+	{
+		struct sigaction sa, old_sa;
+		FILE *fp;
+
+		// Quitting the pager early must not kill us
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &sa, &old_sa);
+		if((fp = popen(pager, "w")))
+		{
+			fwrite(buf, 1, len, fp);
+			pclose(fp);
+			sigaction(SIGPIPE, &old_sa, NULL);
+			return;
+		}
+
+		sigaction(SIGPIPE, &old_sa, NULL);
+		debug("Could not start pager `%s'", pager);
+	}
+
+	while(len)
+	{
+		if((res = write(STDOUT_FILENO, buf, len)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		buf += res;
+		len -= res;
+	}
+}
+
+// Machine-readable output (--format); the header is used for the column names
+static void table_send_rows(struct table *table)
+{
+	char buf[16];
+	int json_flags = ESCAPE_JSON | ESCAPE_COLORS | (utf8 ? 0 : ESCAPE_LATIN1);
+
+	if(output_format == FORMAT_TSV && table->header)
+	{
+		for(unsigned int col = 0; col < table->cols; col++)
+		{
+			if(col)
+				putc('\t', stdout);
+			out_escaped(table->header[col], strlen(table->header[col]), ESCAPE_COLORS);
+		}
+		putc('\n', stdout);
+	}
+
+	for(unsigned int row = 0; row < table->rows; row++)
+	{
+		if(output_format == FORMAT_JSONL)
+			putc('{', stdout);
+
+		for(unsigned int col = 0; col < table->cols; col++)
+		{
+			const char *value = table->data[row][col];
+
+			if(output_format == FORMAT_TSV)
+			{
+				if(col)
+					putc('\t', stdout);
+				if(value)
+					out_escaped(value, strlen(value), ESCAPE_COLORS);
+				else
+					fputs("\\N", stdout);
+				continue;
+			}
+
+			if(col)
+				putc(',', stdout);
+			putc('"', stdout);
+			if(table->header)
+				out_escaped(table->header[col], strlen(table->header[col]), json_flags);
+			else
+			{
+				snprintf(buf, sizeof(buf), "%u", col);
+				fputs(buf, stdout);
+			}
+			fputs("\":", stdout);
+
+			if(value)
+			{
+				putc('"', stdout);
+				out_escaped(value, strlen(value), json_flags);
+				putc('"', stdout);
+			}
+			else
+				fputs("null", stdout);
+		}
+
+		fputs(output_format == FORMAT_JSONL ? "}\n" : "\n", stdout);
+	}
+
+	fflush(stdout);
+}
+
+void table_send(struct table *table)
+{
+	size_t len;
+	char *buf;
+
+	if(output_format != FORMAT_TABLE)
+	{
+		table_send_rows(table);
+		return;
+	}
+
+	buf = table_render(table, &len);
+	table_write(buf, len, table->rows + (table->header ? 1 : 0));
+	free(buf);
 }
 #undef col_bold
 #undef col_ralign
@@ -196,8 +422,7 @@ void table_send(struct table *table)
 static void table_alloc(struct table *table)
 {
 	table->rows++;
-	table->data = realloc(table->data, table->rows * sizeof(char **));
-	table->data[table->rows - 1] = calloc(table->cols, sizeof(char *));
+	table_grow(table, table->rows);
 }
 
 void table_col_str(struct table *table, unsigned int row, unsigned int col, char *val)
@@ -234,14 +459,159 @@ void table_col_fmt(struct table *table, unsigned int row, unsigned int col, cons
 	va_end(args);
 }
 
-static int table_cmp(const void *a, const void *b)
+// Natural sort keys: comparing two keys with memcmp() gives the same order as
+// strnatcasecmp() on the original strings, so the expensive parsing and case
+// folding is done once per cell instead of once per comparison.
+//  - whitespace is skipped, other characters are upper-cased
+//  - a run of digits becomes NAT_NUMBER, its length and the digits, so longer
+//    numbers sort after shorter ones
+//  - a run starting with '0' is compared left-aligned by strnatcmp; it becomes
+//    NAT_NUMBER, 0, the digits and NAT_END so it sorts before other numbers
+//  - columns are separated by NAT_SEPARATOR
+#define NAT_NUMBER	'0'
+#define NAT_END		'\001'
+#define NAT_SEPARATOR	'\000'
+static size_t table_sort_key(unsigned char *key, const char *str)
 {
-	return strnatcasecmp((*(const char ***)a)[table_sort_col], (*(const char ***)b)[table_sort_col]);
+	unsigned char *start = key;
+
+	if(!str)
+		return 0;
+
+	while(*str)
+	{
+		if(isspace((unsigned char)*str))
+		{
+			str++;
+		}
+		else if(isdigit((unsigned char)*str))
+		{
+			size_t len = strspn(str, "0123456789");
+
+			*key++ = NAT_NUMBER;
+			if(*str == '0')
+			{
+				*key++ = 0;
+				memcpy(key, str, len);
+				key += len;
+				*key++ = NAT_END;
+			}
+			else
+			{
+				*key++ = min(len, 255);
+				memcpy(key, str, len);
+				key += len;
+			}
+
+			str += len;
+		}
+		else
+		{
+			*key++ = toupper((unsigned char)*str++);
+		}
+	}
+
+	return key - start;
+}
+
+struct table_sort_entry
+{
+	const unsigned char *key;
+	size_t len;
+	char **row;
+};
+
+static int table_sort_entry_cmp(const struct table_sort_entry *a, const struct table_sort_entry *b)
+{
+	int res = memcmp(a->key, b->key, min(a->len, b->len));
+	if(res)
+		return res;
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+// Bottom-up merge sort; stable so rows with equal keys keep their order
+static void table_merge_sort(struct table_sort_entry *entries, struct table_sort_entry *tmp, unsigned int count)
+{
+	struct table_sort_entry *src = entries, *dst = tmp, *swap;
+
+	for(unsigned int width = 1; width < count; width *= 2)
+	{
+		for(unsigned int lo = 0; lo < count; lo += 2 * width)
+		{
+			unsigned int mid = min(lo + width, count), hi = min(lo + 2 * width, count);
+			unsigned int i = lo, j = mid, k = lo;
+
+			// Already in order (common for sorted input) - just copy the run
+			if(mid == hi || table_sort_entry_cmp(&src[mid - 1], &src[mid]) <= 0)
+			{
+				memcpy(dst + lo, src + lo, (hi - lo) * sizeof(struct table_sort_entry));
+				continue;
+			}
+
+			while(i < mid && j < hi)
+				dst[k++] = (table_sort_entry_cmp(&src[j], &src[i]) < 0) ? src[j++] : src[i++];
+			while(i < mid)
+				dst[k++] = src[i++];
+			while(j < hi)
+				dst[k++] = src[j++];
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if(src != entries)
+		memcpy(entries, src, count * sizeof(struct table_sort_entry));
+}
+
+// Sorts the rows by the given columns (natural, case-insensitive order)
+void table_sort_cols(struct table *table, unsigned int count, const unsigned int *cols)
+{
+	struct table_sort_entry *entries, *tmp;
+	unsigned char *keys, *key;
+	size_t size = 0;
+
+	if(table->rows < 2)
+		return;
+
+	// Every character needs at most 4 bytes in the key (a single zero: NAT_NUMBER, 0, '0', NAT_END)
+	for(unsigned int row = 0; row < table->rows; row++)
+	{
+		for(unsigned int i = 0; i < count; i++)
+		{
+			assert(cols[i] < table->cols);
+			size += (table->data[row][cols[i]] ? 4 * strlen(table->data[row][cols[i]]) : 0) + 1;
+		}
+	}
+
+	key = keys = malloc(size);
+	entries = malloc(table->rows * sizeof(struct table_sort_entry));
+	tmp = malloc(table->rows * sizeof(struct table_sort_entry));
+
+	for(unsigned int row = 0; row < table->rows; row++)
+	{
+		entries[row].key = key;
+		entries[row].row = table->data[row];
+		for(unsigned int i = 0; i < count; i++)
+		{
+			if(i)
+				*key++ = NAT_SEPARATOR;
+			key += table_sort_key(key, table->data[row][cols[i]]);
+		}
+		entries[row].len = key - entries[row].key;
+	}
+
+	table_merge_sort(entries, tmp, table->rows);
+	for(unsigned int row = 0; row < table->rows; row++)
+		table->data[row] = entries[row].row;
+
+	free(tmp);
+	free(entries);
+	free(keys);
 }
 
 void table_sort(struct table *table, unsigned int col)
 {
-	assert(col < table->cols);
-	table_sort_col = col;
-	qsort(table->data, table->rows, sizeof(table->data[0]), table_cmp);
+	table_sort_cols(table, 1, &col);
 }
@@ -7,6 +7,9 @@ struct table
 {
 	unsigned int	cols;
 	unsigned int	rows;
+	unsigned int	size; // allocated rows
+	unsigned int	chunk_count;
+	char		***chunks;
 	unsigned long	bold_cols;
 	unsigned long	free_cols;
 	unsigned long	ralign_cols;
@@ -25,7 +28,10 @@ void table_free_column(struct table *table, unsigned int col, unsigned char enab
 void table_ralign_column(struct table *table, unsigned int col, unsigned char enable);
 void table_free(struct table *table);
 void table_send(struct table *table);
+void table_set_pager(const char *cmd);
+void table_set_utf8(int enable);
 void table_sort(struct table *table, unsigned int col);
+void table_sort_cols(struct table *table, unsigned int count, const unsigned int *cols);
 
 void table_col_str(struct table *table, unsigned int row, unsigned int col, char *val);
 void table_col_num(struct table *table, unsigned int row, unsigned int col, unsigned int val);
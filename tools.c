@@ -2,8 +2,12 @@
 #include "tools.h"
 #include "main.h"
 
+// Messages go to stderr if stdout carries machine-readable output (--format)
+#define MSG_FP	(output_format ? stderr : stdout)
+
 static const char whitespace_chars[] = " \t\n\v\f\r";
 static char output_prefix[64] = "";
+unsigned int error_count = 0;
 
 static void strip_colors(char *str)
 {
@@ -25,12 +29,12 @@ static int my_vprintf(const char *fmt, va_list args)
 	int ret;
 
 	if(!no_colors)
-		return vprintf(fmt, args);
+		return vfprintf(MSG_FP, fmt, args);
 
 	ret = vsnprintf(buf, sizeof(buf), fmt, args);
 	strip_colors(buf);
 
-	printf("%s", buf);
+	fprintf(MSG_FP, "%s", buf);
 	return ret;
 }
 
@@ -42,17 +46,17 @@ void debug(char *text, ...)
 		return;
 
 	if(*output_prefix)
-		printf("%s", output_prefix);
+		fprintf(MSG_FP, "%s", output_prefix);
 
 	if(!no_colors)
-		printf("\033[" COLOR_LIGHT_BLUE "m");
+		fprintf(MSG_FP, "\033[" COLOR_LIGHT_BLUE "m");
 	else
-		printf("DEBUG: ");
+		fprintf(MSG_FP, "DEBUG: ");
 	va_start(va, text);
 	my_vprintf(text, va);
 	if(!no_colors)
-		printf("\033[0m");
-	printf("\n");
+		fprintf(MSG_FP, "\033[0m");
+	fprintf(MSG_FP, "\n");
 	va_end(va);
 }
 
@@ -73,16 +77,21 @@ void out_prefix(char *text, ...)
 	va_end(va);
 }
 
+const char *out_get_prefix()
+{
+	return output_prefix;
+}
+
 void out(char *text, ...)
 {
 	va_list	va;
 
 	if(*output_prefix)
-		printf("%s", output_prefix);
+		fprintf(MSG_FP, "%s", output_prefix);
 
 	va_start(va, text);
 	my_vprintf(text, va);
-	printf("\n");
+	fprintf(MSG_FP, "\n");
 	va_end(va);
 }
 
@@ -91,31 +100,81 @@ void out_color(const char *color, char *text, ...)
 	va_list	va;
 
 	if(*output_prefix)
-		printf("%s", output_prefix);
+		fprintf(MSG_FP, "%s", output_prefix);
 
 	if(!no_colors)
-		printf("\033[%sm", color);
+		fprintf(MSG_FP, "\033[%sm", color);
 	va_start(va, text);
 	my_vprintf(text, va);
 	if(!no_colors)
-		printf("\033[0m");
-	printf("\n");
+		fprintf(MSG_FP, "\033[0m");
+	fprintf(MSG_FP, "\n");
 	va_end(va);
 }
 
+// Writes a value for machine-readable output (TSV or JSON string)
+void out_escaped(const char *str, size_t len, int flags)
+{
+	const char *end = str + len;
+	int json = (flags & ESCAPE_JSON);
+	unsigned char raw_max = (json && (flags & ESCAPE_LATIN1)) ? 0x7f : 0xff;
+
+	while(str < end)
+	{
+		const char *c = str;
+		unsigned char chr;
+
+		// Copy everything that needs no escaping in one go
+		while(c < end && (unsigned char)*c >= 0x20 && (unsigned char)*c <= raw_max &&
+		      *c != '\\' && *c != '"' && *c != '\033')
+			c++;
+		if(c > str)
+			fwrite(str, 1, c - str, stdout);
+		if(c == end)
+			break;
+
+		chr = *c++;
+		if(chr == '\033' && (flags & ESCAPE_COLORS))
+		{
+			while(c < end && *c != 'm')
+				c++;
+			if(c < end)
+				c++;
+		}
+		else if(chr == '"')
+			fputs(json ? "\\\"" : "\"", stdout);
+		else if(chr == '\\')
+			fputs("\\\\", stdout);
+		else if(chr == '\t')
+			fputs("\\t", stdout);
+		else if(chr == '\n')
+			fputs("\\n", stdout);
+		else if(chr == '\r')
+			fputs("\\r", stdout);
+		else if(json) // control characters, and LATIN1 maps 1:1 to U+0080..U+00FF
+			printf("\\u%04x", chr);
+		else
+			putc(chr, stdout);
+
+		str = c;
+	}
+}
+
 void error(char *text, ...)
 {
 	va_list	va;
 
+	error_count++;
+
 	if(!no_colors)
-		printf("\033[" COLOR_LIGHT_RED "m");
+		fprintf(MSG_FP, "\033[" COLOR_LIGHT_RED "m");
 	else
-		printf("ERROR: ");
+		fprintf(MSG_FP, "ERROR: ");
 	va_start(va, text);
 	my_vprintf(text, va);
 	if(!no_colors)
-		printf("\033[0m");
-	printf("\n");
+		fprintf(MSG_FP, "\033[0m");
+	fprintf(MSG_FP, "\n");
 	va_end(va);
 }
 
@@ -234,14 +293,60 @@ int file_exists(const char *file)
 	return (stat(file, &statbuf) == 0);
 }
 
+// Checksum of a file as printed by the POSIX cksum utility (CRC-32 with the
+// length appended) so it can be compared to the one of a remote copy.
+// Returns 0 on success.
+int file_cksum(const char *file, unsigned int *crc, unsigned long long *size)
+{
+	static unsigned int table[256];
+	unsigned char buf[8192];
+	unsigned long long len;
+	size_t res;
+	FILE *fp;
+
+	if(!table[1])
+	{
+		for(unsigned int i = 0; i < 256; i++)
+		{
+			unsigned int c = i << 24;
+			for(int j = 0; j < 8; j++)
+				c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : (c << 1);
+			table[i] = c;
+		}
+	}
+
+	if(!(fp = fopen(file, "r")))
+		return -1;
+
+	*crc = 0;
+	*size = 0;
+	while((res = fread(buf, 1, sizeof(buf), fp)) > 0)
+	{
+		for(size_t i = 0; i < res; i++)
+			*crc = (*crc << 8) ^ table[(*crc >> 24) ^ buf[i]];
+		*size += res;
+	}
+
+	if(ferror(fp))
+	{
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	for(len = *size; len; len >>= 8)
+		*crc = (*crc << 8) ^ table[(*crc >> 24) ^ (len & 0xff)];
+	*crc = ~*crc;
+	return 0;
+}
+
 void expand_num_args(char *buf, size_t buf_size, const char *str, unsigned int argc, ...)
 {
 	va_list args;
 	size_t len = 0;
-	char **arg_list;
+	char *arg_list[argc ? argc : 1];
 
 	va_start(args, argc);
-	arg_list = calloc(argc, sizeof(char *));
 	for(unsigned int i = 0; i < argc; i++)
 		arg_list[i] = va_arg(args, char *);
 	va_end(args);
@@ -266,7 +371,6 @@ void expand_num_args(char *buf, size_t buf_size, const char *str, unsigned int a
 	}
 
 	buf[len] = '\0';
-	free(arg_list);
 }
 
 char *xstrdup(const char *str)
@@ -275,3 +379,26 @@ char *xstrdup(const char *str)
 		return NULL;
 	return strdup(str);
 }
+
+// Checks if the string is an IPv4/IPv6 address with an optional CIDR netmask
+int valid_inet(const char *str)
+{
+	char addr[INET6_ADDRSTRLEN + 4], *end, *mask;
+	unsigned char buf[sizeof(struct in6_addr)];
+	long num;
+
+	if(strlen(str) >= sizeof(addr))
+		return 0;
+
+	strlcpy(addr, str, sizeof(addr));
+	if((mask = strchr(addr, '/')))
+	{
+		*mask++ = '\0';
+		errno = 0;
+		num = strtol(mask, &end, 10);
+		if(!*mask || *end || errno || num < 0 || num > (strchr(addr, ':') ? 128 : 32))
+			return 0;
+	}
+
+	return inet_pton(strchr(addr, ':') ? AF_INET6 : AF_INET, addr, buf) == 1;
+}
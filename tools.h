@@ -18,18 +18,29 @@
 #define COLOR_LIGHT_PURPLE	"1;35"
 #define COLOR_LIGHT_CYAN	"1;36"
 
+extern unsigned int error_count;
+
+// Flags for out_escaped()
+#define ESCAPE_JSON	0x01 // JSON string instead of TSV field
+#define ESCAPE_COLORS	0x02 // drop color codes (table cells)
+#define ESCAPE_LATIN1	0x04 // value is LATIN1; JSON needs \u escapes for non-ASCII
+
 void debug(char *text, ...) PRINTF_LIKE(1,2);
 void out_prefix(char *text, ...) PRINTF_LIKE(1,2);
+const char *out_get_prefix();
 void out(char *text, ...) PRINTF_LIKE(1,2);
 void out_color(const char *color, char *text, ...) PRINTF_LIKE(2,3);
+void out_escaped(const char *str, size_t len, int flags);
 void error(char *text, ...) PRINTF_LIKE(1,2);
 char *ltrim(char *str);
 char *rtrim(char *str);
 int match(const char *mask, const char *name);
 size_t strlcpy(char *out, const char *in, size_t len);
 int file_exists(const char *file);
+int file_cksum(const char *file, unsigned int *crc, unsigned long long *size);
 void expand_num_args(char *buf, size_t buf_size, const char *str, unsigned int argc, ...);
 char *xstrdup(const char *str);
+int valid_inet(const char *str);
 
 static inline long min(long a, long b)
 {
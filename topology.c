@@ -0,0 +1,484 @@
+#include "common.h"
+#include "topology.h"
+#include "pgsql.h"
+#include "serverinfo.h"
+#include "ptrlist.h"
+#include "stringlist.h"
+
+static int topology_cmp_name(const void *a, const void *b);
+static struct topo_link *topology_add_link(struct topo_node *node, struct topo_node *peer, int uplink, int autoconnect);
+static int topology_cmp_link(const void *a, const void *b);
+static void topology_set_depths(struct topology *topo);
+static int topology_cmp_depth(const void *a, const void *b);
+static void topology_spof_free(struct topo_spof *spof);
+
+static int topology_cmp_name(const void *a, const void *b)
+{
+	return strcasecmp(((const struct topo_node *)a)->name, ((const struct topo_node *)b)->name);
+}
+
+static int topology_cmp_link(const void *a, const void *b)
+{
+	return strcasecmp(((const struct topo_link *)a)->peer->name, ((const struct topo_link *)b)->peer->name);
+}
+
+static struct topo_link *topology_add_link(struct topo_node *node, struct topo_node *peer, int uplink, int autoconnect)
+{
+	if(node->link_count == node->link_size)
+	{
+		node->link_size = node->link_size ? node->link_size * 2 : 4;
+		node->links = realloc(node->links, node->link_size * sizeof(struct topo_link));
+	}
+
+	node->links[node->link_count] = (struct topo_link){ .peer = peer, .uplink = uplink, .autoconnect = autoconnect };
+	return &node->links[node->link_count++];
+}
+
+struct topology *topology_load()
+{
+	struct topology *topo;
+	PGresult *servers, *services, *res;
+	unsigned int count;
+	int rows;
+
+	servers = pgsql_query("SELECT name, type, server_port FROM servers", 1, NULL);
+	services = pgsql_query("SELECT name FROM services", 1, NULL);
+
+	topo = malloc(sizeof(struct topology));
+	topo->count = pgsql_num_rows(servers) + pgsql_num_rows(services);
+	topo->nodes = calloc(max(topo->count, 1), sizeof(struct topo_node));
+
+	count = 0;
+	rows = pgsql_num_rows(servers);
+	for(int i = 0; i < rows; i++, count++)
+	{
+		topo->nodes[count].name = strdup(pgsql_value(servers, i, 0));
+		topo->nodes[count].type = serverinfo_type_from_db(pgsql_value(servers, i, 1));
+		topo->nodes[count].server_port = atoi(pgsql_value(servers, i, 2));
+	}
+
+	rows = pgsql_num_rows(services);
+	for(int i = 0; i < rows; i++, count++)
+	{
+		topo->nodes[count].name = strdup(pgsql_value(services, i, 0));
+		topo->nodes[count].service = 1;
+	}
+
+	pgsql_free(servers);
+	pgsql_free(services);
+
+	// Sorted so lookups are binary searches; links point into this array
+	qsort(topo->nodes, topo->count, sizeof(struct topo_node), topology_cmp_name);
+
+	res = pgsql_query("SELECT	l.server,\
+					l.hub,\
+					l.autoconnect,\
+					p.ip,\
+					p.port\
+			   FROM		links l\
+			   LEFT JOIN	ports p ON (p.id = l.port)",
+			  1, NULL);
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
+	{
+		struct topo_node *server = topology_find(topo, pgsql_value(res, i, 0));
+		struct topo_node *hub = topology_find(topo, pgsql_value(res, i, 1));
+		int autoconnect = !strcasecmp(pgsql_value(res, i, 2), "t");
+		const char *ip = pgsql_value(res, i, 3);
+		const char *port = pgsql_value(res, i, 4);
+		struct topo_link *up, *down;
+
+		if(!server || !hub)
+			continue;
+		up = topology_add_link(server, hub, 1, autoconnect);
+		down = topology_add_link(hub, server, 0, autoconnect);
+		up->port = down->port = port ? (unsigned int)atoi(port) : hub->server_port;
+		if(ip)
+		{
+			up->ip = strdup(ip);
+			down->ip = strdup(ip);
+		}
+	}
+
+	pgsql_free(res);
+
+	res = pgsql_query("SELECT service, hub FROM servicelinks", 1, NULL);
+	rows = pgsql_num_rows(res);
+	for(int i = 0; i < rows; i++)
+	{
+		struct topo_node *service = topology_find(topo, pgsql_value(res, i, 0));
+		struct topo_node *hub = topology_find(topo, pgsql_value(res, i, 1));
+
+		if(!service || !hub)
+			continue;
+		// Services always connect to their hub
+		topology_add_link(service, hub, 1, 1);
+		topology_add_link(hub, service, 0, 1);
+	}
+
+	pgsql_free(res);
+
+	for(unsigned int i = 0; i < topo->count; i++)
+		qsort(topo->nodes[i].links, topo->nodes[i].link_count, sizeof(struct topo_link), topology_cmp_link);
+
+	topology_set_depths(topo);
+	return topo;
+}
+
+void topology_free(struct topology *topo)
+{
+	for(unsigned int i = 0; i < topo->count; i++)
+	{
+		for(unsigned int j = 0; j < topo->nodes[i].link_count; j++)
+			free(topo->nodes[i].links[j].ip);
+		free(topo->nodes[i].name);
+		free(topo->nodes[i].links);
+	}
+
+	free(topo->nodes);
+	free(topo);
+}
+
+struct topo_node *topology_find(struct topology *topo, const char *name)
+{
+	struct topo_node key = { .name = (char *)name };
+	return bsearch(&key, topo->nodes, topo->count, sizeof(struct topo_node), topology_cmp_name);
+}
+
+// The uplink a server normally uses: the first autoconnect one, otherwise
+// the first one. NULL for servers without uplinks.
+struct topo_node *topology_primary_uplink(struct topo_node *node)
+{
+	struct topo_node *uplink = NULL;
+
+	for(unsigned int i = 0; i < node->link_count; i++)
+	{
+		if(!node->links[i].uplink)
+			continue;
+		if(node->links[i].autoconnect)
+			return node->links[i].peer;
+		if(!uplink)
+			uplink = node->links[i].peer;
+	}
+
+	return uplink;
+}
+
+struct topo_link *topology_link(struct topo_node *node, struct topo_node *peer)
+{
+	for(unsigned int i = 0; i < node->link_count; i++)
+	{
+		if(node->links[i].peer == peer)
+			return &node->links[i];
+	}
+
+	return NULL;
+}
+
+// Shortest route between two nodes; services are never used as a hop. The
+// nodes are stored in path (which needs room for topo->count entries) and
+// their number is returned; 0 if there is no route.
+unsigned int topology_path(struct topology *topo, struct topo_node *from, struct topo_node *to, int autoconnect_only, struct topo_node **path)
+{
+	struct topo_node *queue[max(topo->count, 1)];
+	int prev[max(topo->count, 1)];
+	unsigned int head = 0, tail = 0, count = 0;
+
+	for(unsigned int i = 0; i < topo->count; i++)
+		prev[i] = -2; // not visited
+
+	prev[from - topo->nodes] = -1;
+	queue[tail++] = from;
+	while(head < tail && prev[to - topo->nodes] == -2)
+	{
+		struct topo_node *cur = queue[head++];
+
+		if(cur->service && cur != from)
+			continue;
+
+		for(unsigned int i = 0; i < cur->link_count; i++)
+		{
+			struct topo_node *peer = cur->links[i].peer;
+			if(prev[peer - topo->nodes] != -2 || (autoconnect_only && !cur->links[i].autoconnect))
+				continue;
+			prev[peer - topo->nodes] = cur - topo->nodes;
+			queue[tail++] = peer;
+		}
+	}
+
+	if(prev[to - topo->nodes] == -2)
+		return 0;
+
+	for(int i = to - topo->nodes; i >= 0; i = prev[i])
+		count++;
+	for(int i = to - topo->nodes, pos = count; i >= 0; i = prev[i])
+		path[--pos] = &topo->nodes[i];
+	return count;
+}
+
+static void topology_spof_free(struct topo_spof *spof)
+{
+	stringlist_free(spof->cut_off);
+	free(spof);
+}
+
+// Articulation points of the link graph (Tarjan). For every server whose
+// loss partitions the network the servers split off are returned; if it
+// is the root of a search, its biggest part is considered the rest of the
+// network. Returns a list of struct topo_spof sorted by name.
+struct ptrlist *topology_spof(struct topology *topo)
+{
+	struct ptrlist *list = ptrlist_create();
+	unsigned int n = max(topo->count, 1);
+	unsigned int *disc = calloc(n, sizeof(unsigned int));
+	unsigned int *low = calloc(n, sizeof(unsigned int));
+	unsigned int *size = calloc(n, sizeof(unsigned int));
+	unsigned int *next = calloc(n, sizeof(unsigned int)); // next link to visit
+	int *parent = calloc(n, sizeof(int));
+	int *keep = malloc(n * sizeof(int));
+	unsigned int *children = calloc(n, sizeof(unsigned int));
+	struct topo_node **order = calloc(n, sizeof(struct topo_node *)); // by disc
+	struct topo_node **stack = calloc(n, sizeof(struct topo_node *));
+	struct topo_spof **spofs = calloc(n, sizeof(struct topo_spof *));
+	unsigned int time = 0;
+
+	ptrlist_set_free_func(list, (ptrlist_free_f *)topology_spof_free);
+
+	// Searching from the top of the network first means that the servers
+	// split off are the ones below the failed server
+	for(unsigned int i = 0; i < 2 * topo->count; i++)
+	{
+		unsigned int root = i % topo->count, sp = 0;
+
+		if(disc[root] || (i < topo->count && topo->nodes[root].depth != 0))
+			continue;
+
+		parent[root] = -1;
+		keep[root] = -1;
+		disc[root] = low[root] = ++time;
+		size[root] = 1;
+		order[time - 1] = &topo->nodes[root];
+		stack[sp++] = &topo->nodes[root];
+		while(sp)
+		{
+			struct topo_node *node = stack[sp - 1];
+			unsigned int v = node - topo->nodes;
+
+			if(next[v] < node->link_count)
+			{
+				unsigned int w = node->links[next[v]++].peer - topo->nodes;
+
+				if(!disc[w])
+				{
+					parent[w] = v;
+					disc[w] = low[w] = ++time;
+					size[w] = 1;
+					order[time - 1] = &topo->nodes[w];
+					stack[sp++] = &topo->nodes[w];
+				}
+				else if((int)w != parent[v])
+					low[v] = min(low[v], disc[w]);
+				continue;
+			}
+
+			sp--;
+			if(parent[v] >= 0)
+			{
+				low[parent[v]] = min(low[parent[v]], low[v]);
+				size[parent[v]] += size[v];
+			}
+		}
+	}
+
+	// Children of a root only split off if the root has several of them;
+	// its biggest subtree (keep) is the rest of the network then
+	for(unsigned int v = 0; v < topo->count; v++)
+	{
+		int p = parent[v];
+		if(p < 0 || parent[p] >= 0)
+			continue;
+		children[p]++;
+		if(keep[p] < 0 || size[v] > size[keep[p]])
+			keep[p] = v;
+	}
+
+	for(unsigned int v = 0; v < topo->count; v++)
+	{
+		int p = parent[v];
+
+		if(p < 0 || low[v] < disc[p])
+			continue;
+		if(parent[p] < 0 && (children[p] < 2 || keep[p] == (int)v))
+			continue;
+
+		if(!spofs[p])
+		{
+			spofs[p] = malloc(sizeof(struct topo_spof));
+			spofs[p]->node = &topo->nodes[p];
+			spofs[p]->cut_off = stringlist_create();
+		}
+
+		for(unsigned int i = disc[v] - 1; i < disc[v] - 1 + size[v]; i++)
+			stringlist_add(spofs[p]->cut_off, strdup(order[i]->name));
+	}
+
+	for(unsigned int i = 0; i < topo->count; i++)
+	{
+		if(!spofs[i])
+			continue;
+		stringlist_sort(spofs[i]->cut_off);
+		ptrlist_add(list, 0, spofs[i]);
+	}
+
+	free(disc);
+	free(low);
+	free(size);
+	free(next);
+	free(parent);
+	free(keep);
+	free(children);
+	free(order);
+	free(stack);
+	free(spofs);
+	return list;
+}
+
+// Breadth-first search down from the servers without an uplink. Servers
+// only reachable through a cycle of uplinks start a new search themselves.
+static void topology_set_depths(struct topology *topo)
+{
+	struct topo_node *queue[max(topo->count, 1)];
+	unsigned int head = 0, tail = 0;
+
+	for(unsigned int i = 0; i < topo->count; i++)
+		topo->nodes[i].depth = -1;
+
+	for(int pass = 0; pass < 2; pass++)
+	{
+		for(unsigned int i = 0; i < topo->count; i++)
+		{
+			struct topo_node *node = &topo->nodes[i];
+			int has_uplink = 0;
+
+			if(node->depth >= 0 || node->service)
+				continue;
+
+			for(unsigned int j = 0; j < node->link_count && !has_uplink; j++)
+				has_uplink = node->links[j].uplink;
+			if(has_uplink && pass == 0)
+				continue;
+
+			node->depth = 0;
+			queue[tail++] = node;
+			while(head < tail)
+			{
+				struct topo_node *cur = queue[head++];
+
+				for(unsigned int j = 0; j < cur->link_count; j++)
+				{
+					struct topo_node *peer = cur->links[j].peer;
+					if(cur->links[j].uplink || peer->depth >= 0)
+						continue;
+					peer->depth = cur->depth + 1;
+					queue[tail++] = peer;
+				}
+			}
+		}
+	}
+}
+
+static int topology_cmp_depth(const void *a, const void *b)
+{
+	const struct topo_node *x = *(const struct topo_node **)a;
+	const struct topo_node *y = *(const struct topo_node **)b;
+
+	if(x->depth != y->depth)
+		return x->depth - y->depth;
+	return strcasecmp(x->name, y->name);
+}
+
+// Splits the servers into waves which can be updated at the same time:
+// hubs before the servers linked to them and at most max_per_hub (0 for
+// no limit) servers of the same hub per wave. Returns a list of
+// stringlists, one per wave.
+struct ptrlist *topology_waves(struct topology *topo, struct stringlist *servers, unsigned int max_per_hub)
+{
+	struct ptrlist *waves = ptrlist_create();
+	struct topo_node *pending[max(servers->count, 1)];
+	unsigned int in_wave[max(topo->count, 1)];
+	unsigned int count = 0;
+
+	ptrlist_set_free_func(waves, (ptrlist_free_f *)stringlist_free);
+
+	for(unsigned int i = 0; i < servers->count; i++)
+	{
+		struct topo_node *node = topology_find(topo, servers->data[i]);
+		if(node)
+			pending[count++] = node;
+	}
+
+	qsort(pending, count, sizeof(struct topo_node *), topology_cmp_depth);
+
+	for(unsigned int start = 0, end; start < count; start = end)
+	{
+		unsigned int left;
+
+		for(end = start; end < count && pending[end]->depth == pending[start]->depth; end++)
+			;
+
+		for(left = end - start; left; )
+		{
+			struct stringlist *wave = stringlist_create();
+			unsigned int deferred = 0;
+
+			memset(in_wave, 0, sizeof(in_wave));
+			for(unsigned int i = 0; i < left; i++)
+			{
+				struct topo_node *node = pending[start + i];
+				struct topo_node *uplink = topology_primary_uplink(node);
+
+				// Over the limit for its hub: move it to the front for the next wave
+				if(max_per_hub && uplink && in_wave[uplink - topo->nodes] >= max_per_hub)
+				{
+					pending[start + deferred++] = node;
+					continue;
+				}
+
+				if(uplink)
+					in_wave[uplink - topo->nodes]++;
+				stringlist_add(wave, strdup(node->name));
+			}
+
+			left = deferred;
+			ptrlist_add(waves, 0, wave);
+		}
+	}
+
+	return waves;
+}
+
+// NULL if the server connects to the network by itself or is connected to
+const char *topology_orphan_problem(struct topo_node *node)
+{
+	unsigned int uplinks = 0, autoconnect = 0, autoconnect_down = 0;
+
+	for(unsigned int i = 0; i < node->link_count; i++)
+	{
+		if(node->links[i].uplink)
+		{
+			uplinks++;
+			autoconnect += node->links[i].autoconnect;
+		}
+		else
+			autoconnect_down += node->links[i].autoconnect;
+	}
+
+	// The top of the network is connected to by its downlinks
+	if(autoconnect || (!uplinks && autoconnect_down))
+		return NULL;
+	else if(!node->link_count)
+		return "No links";
+	else if(!uplinks)
+		return "No autoconnect links";
+	return "No autoconnect uplink";
+}
@@ -0,0 +1,55 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+// In-memory graph of the network built from the servers, services, links,
+// servicelinks and ports tables. Loaded at once so graph queries do not need any
+// further database access.
+
+struct stringlist;
+struct ptrlist;
+
+struct topo_link
+{
+	struct topo_node *peer;
+	unsigned int uplink : 1; // peer is the hub of this link
+	unsigned int autoconnect : 1;
+	unsigned int port; // port used to connect to the hub
+	char *ip; // only set if the link uses a specific port of the hub
+};
+
+struct topo_node
+{
+	char *name;
+	int type; // SERVER_*; 0 for services
+	unsigned int service : 1;
+	unsigned int server_port;
+	struct topo_link *links;
+	unsigned int link_count;
+	unsigned int link_size;
+	int depth; // number of uplinks to the top of the network
+};
+
+struct topology
+{
+	struct topo_node *nodes; // sorted by name
+	unsigned int count;
+};
+
+// A server whose loss splits off the servers in cut_off
+struct topo_spof
+{
+	struct topo_node *node;
+	struct stringlist *cut_off;
+};
+
+struct topology *topology_load();
+void topology_free(struct topology *topo);
+struct topo_node *topology_find(struct topology *topo, const char *name);
+struct topo_node *topology_primary_uplink(struct topo_node *node);
+struct topo_link *topology_link(struct topo_node *node, struct topo_node *peer);
+unsigned int topology_path(struct topology *topo, struct topo_node *from, struct topo_node *to, int autoconnect_only, struct topo_node **path);
+struct ptrlist *topology_spof(struct topology *topo);
+struct ptrlist *topology_waves(struct topology *topo, struct stringlist *servers, unsigned int max_per_hub);
+const char *topology_orphan_problem(struct topo_node *node);
+
+#endif